@@ -5,33 +5,329 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
-#include <ldns/sha2.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <kvfs/kvfs.h>
 #include <kvfs/chunk.h>
+#include <kvfs/sha256.h>
 
 /*
- * NB: the bottom bit of 'data' is used to indicate whether the
- * chunk owns data (and should eventually free it)
+ * a chunk is a single cache-aligned block holding its header and
+ * room for a whole chunk of data.  The data pointer refers either
+ * to that inline buffer, or to external data passed in by the caller,
+ * in which case 'owner' says whether it should eventually be free'd.
+ *
+ * chunks are reference counted, so that one may be shared between
+ * threads without copying its data.  The count starts at one and
+ * chunk_free() is just chunk_unref().
+ *
+ * free blocks are kept on a per-pool free list, rather than being
+ * returned to malloc.
+ *
+ * a chunk wrapping the caller's data has no use for the buffer, so it
+ * is just the header, in a block of its own without a pool.  those
+ * are created by the hashing threads more than anything, so the free
+ * ones are cached per thread instead, and need no lock.
  */
 
+enum {
+	chunk_alignment = 64,
+	chunk_pool_default_limit = 256,
+	chunk_wrapper_cache_limit = 64
+};
+
 typedef struct chunk_t {
-	uint64_t	data;
-	uint8_t		key[LDNS_SHA256_DIGEST_LENGTH];
+	const uint8_t*		data;
+	chunk_pool_t*		pool;
+	struct chunk_t*		next;
+	atomic_uint			refs;
+	bool				owner;
+	uint8_t				key[chunk_keylength];
+	uint8_t				buffer[chunk_maxlength] __attribute__((aligned(chunk_alignment)));
 } chunk_t;
 
+typedef struct chunk_pool_t {
+	pthread_mutex_t		lock;
+	chunk_t*			free_list;
+	size_t				free_count;
+	size_t				limit;
+	size_t				outstanding;
+	bool				closing;
+} chunk_pool_t;
+
+/* used for chunks that aren't created on behalf of a store */
+static chunk_pool_t chunk_default_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.limit = chunk_pool_default_limit
+};
+
+/* the header, rounded up to the alignment, which is all a wrapper needs */
+static const size_t chunk_wrapper_size =
+	(offsetof(chunk_t, buffer) + chunk_alignment - 1) / chunk_alignment * chunk_alignment;
+
+typedef struct chunk_wrapper_cache_t {
+	chunk_t*			free_list;
+	size_t				free_count;
+} chunk_wrapper_cache_t;
+
+static _Thread_local chunk_wrapper_cache_t chunk_wrapper_cache;
+static pthread_once_t chunk_wrapper_once = PTHREAD_ONCE_INIT;
+static pthread_key_t chunk_wrapper_key;
+
 static void chunk_calckey(const uint8_t* data, uint16_t length, uint8_t depth, uint8_t* key);
 static int chunk_validate(const uint8_t* data, uint16_t length, uint8_t depth);
 
+/*
+ * creates a pool that will cache up to 'limit' free chunks
+ */
+chunk_pool_t* chunk_pool_create(size_t limit)
+{
+	chunk_pool_t* pool = malloc(sizeof *pool);
+	if (!pool) {
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+		free(pool);
+		return NULL;
+	}
+
+	pool->free_list = NULL;
+	pool->free_count = 0;
+	pool->limit = limit ? limit : chunk_pool_default_limit;
+	pool->outstanding = 0;
+	pool->closing = false;
+
+	return pool;
+}
+
+static void chunk_pool_destroy(chunk_pool_t* pool)
+{
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/*
+ * releases the pool's cached chunks.  Chunks still in use keep
+ * the pool alive until the last of them is free'd.
+ */
+void chunk_pool_free(chunk_pool_t* pool)
+{
+	if (!pool || pool == &chunk_default_pool) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->free_list) {
+		chunk_t* chunk = pool->free_list;
+		pool->free_list = chunk->next;
+		free(chunk);
+	}
+	pool->free_count = 0;
+	pool->closing = true;
+	bool idle = (pool->outstanding == 0);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (idle) {
+		chunk_pool_destroy(pool);
+	}
+}
+
+/*
+ * takes an empty chunk from the pool (or the default pool if NULL),
+ * ready for up to chunk_maxlength bytes of data to be written to
+ * chunk_buffer() before calling chunk_commit()
+ */
+chunk_t* chunk_alloc(chunk_pool_t* pool)
+{
+	chunk_t* chunk = NULL;
+
+	if (!pool) {
+		pool = &chunk_default_pool;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->free_list) {
+		chunk = pool->free_list;
+		pool->free_list = chunk->next;
+		pool->free_count--;
+	}
+	pool->outstanding++;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!chunk) {
+		chunk = aligned_alloc(chunk_alignment, sizeof *chunk);
+		if (!chunk) {
+			pthread_mutex_lock(&pool->lock);
+			pool->outstanding--;
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+	}
+
+	chunk->data = chunk->buffer;
+	chunk->pool = pool;
+	chunk->next = NULL;
+	atomic_init(&chunk->refs, 1);
+	chunk->owner = false;
+	memset(chunk->key, 0, chunk_keylength);
+
+	return chunk;
+}
+
+/* frees a thread's cached wrappers when it exits */
+static void chunk_wrapper_drain(void* arg)
+{
+	chunk_wrapper_cache_t* cache = arg;
+
+	while (cache->free_list) {
+		chunk_t* chunk = cache->free_list;
+		cache->free_list = chunk->next;
+		free(chunk);
+	}
+	cache->free_count = 0;
+}
+
+static void chunk_wrapper_init(void)
+{
+	pthread_key_create(&chunk_wrapper_key, chunk_wrapper_drain);
+}
+
+/*
+ * allocates a chunk without a buffer, to point at 'data'
+ */
+static chunk_t* chunk_wrapper_alloc(const uint8_t* data, bool owner)
+{
+	chunk_wrapper_cache_t* cache = &chunk_wrapper_cache;
+	chunk_t* chunk = cache->free_list;
+
+	if (chunk) {
+		cache->free_list = chunk->next;
+		cache->free_count--;
+	} else {
+		chunk = aligned_alloc(chunk_alignment, chunk_wrapper_size);
+		if (!chunk) {
+			return NULL;
+		}
+	}
+
+	chunk->data = data;
+	chunk->pool = NULL;
+	chunk->next = NULL;
+	atomic_init(&chunk->refs, 1);
+	chunk->owner = owner;
+
+	return chunk;
+}
+
+/* caches a wrapper for this thread, or frees it if there are enough */
+static void chunk_wrapper_release(chunk_t* chunk)
+{
+	chunk_wrapper_cache_t* cache = &chunk_wrapper_cache;
+
+	if (cache->free_count >= chunk_wrapper_cache_limit) {
+		free(chunk);
+		return;
+	}
+
+	/* make sure the cache is drained when the thread exits */
+	if (!cache->free_list) {
+		pthread_once(&chunk_wrapper_once, chunk_wrapper_init);
+		pthread_setspecific(chunk_wrapper_key, cache);
+	}
+
+	chunk->next = cache->free_list;
+	cache->free_list = chunk;
+	cache->free_count++;
+}
+
+/*
+ * returns a writable pointer to the chunk's inline buffer
+ */
+uint8_t* chunk_buffer(chunk_t* chunk)
+{
+	assert(chunk);
+	return &chunk->buffer[0];
+}
+
+/*
+ * completes a chunk from chunk_alloc() once 'length' bytes have
+ * been written into its buffer.  On failure the chunk is free'd.
+ */
+chunk_t* chunk_commit(chunk_t* chunk, uint16_t length, uint8_t depth, const uint8_t* key)
+{
+	assert(chunk && chunk->data == chunk->buffer);
+
+	if (chunk_validate(chunk->buffer, length, depth) != 0) {
+		goto error;
+	}
+
+	chunk_calckey(chunk->buffer, length, depth, &chunk->key[0]);
+
+	/* optionally, check that the calculated key matches */
+	if (key && !chunk_key_valid(chunk, key)) {
+		goto error;
+	}
+
+	return chunk;
+
+error:
+	chunk_free(chunk);
+	return NULL;
+}
+
+/*
+ * as chunk_commit(), but trusts that the data matches 'key' rather
+ * than hashing it.  The data is still checked against the length
+ * and depth encoded in the key, and indirection chunks are still
+ * checked for well-formed sub keys.
+ */
+chunk_t* chunk_commit_trusted(chunk_t* chunk, uint16_t length, const uint8_t* key)
+{
+	assert(chunk && chunk->data == chunk->buffer && key);
+
+	if (length != chunk_length_from_key(key)) {
+		errno = KVFS_KEY_NOT_VALID;
+		goto error;
+	}
+
+	if (chunk_validate(chunk->buffer, length, chunk_depth_from_key(key)) != 0) {
+		goto error;
+	}
+
+	memcpy(chunk->key, key, chunk_keylength);
+
+	return chunk;
+
+error:
+	chunk_free(chunk);
+	return NULL;
+}
+
+/*
+ * re-hashes the chunk's data and checks it against its key, for
+ * chunks that were created with chunk_commit_trusted()
+ */
+bool chunk_verify(const chunk_t* chunk)
+{
+	uint8_t key[chunk_keylength];
+
+	assert(chunk);
+	chunk_calckey(chunk->data, chunk_length(chunk), chunk_depth(chunk), key);
+
+	return chunk_key_valid(chunk, key);
+}
+
 /*
  * creates a chunk, just copying the pointer to the passed data.
  *
- * the 'owner' flag is used in a tagged pointer to indicate whether
- * the chunk owns this data itself and should free it when the
- * chunk itself is free'd.
+ * the 'owner' flag indicates whether the chunk owns this data
+ * itself and should free it when the chunk itself is free'd.
  */
 chunk_t* chunk_create(const uint8_t* data, uint16_t length, uint8_t depth, bool owner, const uint8_t *key)
 {
@@ -48,24 +344,19 @@ chunk_t* chunk_create(const uint8_t* data, uint16_t length, uint8_t depth, bool
 		goto error;
 	}
 
-	/* allocate space for the chunk */
-	chunk = malloc(sizeof *chunk);
+	/* allocate space for the chunk, pointing at the caller's data */
+	chunk = chunk_wrapper_alloc(data, owner);
 	if (chunk == NULL) {
-		return NULL;
+		goto error;
 	}
 
 	/* calculate the key */
 	chunk_calckey(data, length, depth, &chunk->key[0]);
 
-	/* copy and tag the pointer (if required) */
-	chunk->data = (uint64_t)data;
-	if (!owner) {
-		chunk->data |= 0x01;
-	}
-
 	/* optionally, check that the calculated key matches */
 	if (key && !chunk_key_valid(chunk, key)) {
-		goto error;
+		chunk_free(chunk);
+		return NULL;
 	}
 
 	return chunk;
@@ -74,10 +365,78 @@ error:
 	if (owner) {
 		free((void *)data);
 	}
-	free(chunk);
 	return NULL;
 }
 
+/*
+ * creates 'count' chunks of the same depth at once, hashing them
+ * together so that multi-buffer SHA-256 can be used.
+ *
+ * 'keys', if not NULL, holds the expected key of each chunk.
+ *
+ * a chunk that fails validation is left as NULL in 'chunks' (and
+ * its data free'd if owned), while the rest are still created.
+ * returns 0 if every chunk was created, -1 otherwise.
+ */
+int chunk_create_batch(chunk_t** chunks, const uint8_t* const* data, const uint16_t* length,
+					   uint8_t depth, bool owner, const uint8_t* keys, size_t count)
+{
+	uint8_t calculated[chunk_maxkeys * chunk_keylength];
+	int result = 0;
+
+	for (size_t base = 0; base < count; base += chunk_maxkeys) {
+		size_t n = count - base < chunk_maxkeys ? count - base : chunk_maxkeys;
+		const uint8_t* valid[chunk_maxkeys];
+		uint16_t valid_length[chunk_maxkeys];
+		size_t index[chunk_maxkeys];
+		size_t m = 0;
+
+		/* only hash the chunks that pass the sanity check */
+		for (size_t i = base; i < base + n; ++i) {
+			chunks[i] = NULL;
+			if (data[i] == NULL) {
+				errno = EINVAL;
+				result = -1;
+			} else if (chunk_validate(data[i], length[i], depth) != 0) {
+				if (owner) {
+					free((void *)data[i]);
+				}
+				result = -1;
+			} else {
+				valid[m] = data[i];
+				valid_length[m] = length[i];
+				index[m++] = i;
+			}
+		}
+
+		chunk_calckey_batch(valid, valid_length, depth, calculated, m);
+
+		for (size_t j = 0; j < m; ++j) {
+			size_t i = index[j];
+			const uint8_t* key = &calculated[j * chunk_keylength];
+			chunk_t* chunk = NULL;
+
+			if (keys && memcmp(key, keys + i * chunk_keylength, chunk_keylength) != 0) {
+				errno = KVFS_KEY_NOT_VALID;
+			} else {
+				chunk = chunk_wrapper_alloc(data[i], owner);
+			}
+
+			if (chunk) {
+				memcpy(chunk->key, key, chunk_keylength);
+				chunks[i] = chunk;
+			} else {
+				if (owner) {
+					free((void *)data[i]);
+				}
+				result = -1;
+			}
+		}
+	}
+
+	return result;
+}
+
 /*
  * creates a chunk as above but takes a copy of the data first
  */
@@ -89,27 +448,107 @@ chunk_t* chunk_create_copy(const uint8_t* data, uint16_t length, uint8_t depth,
 		return NULL;
 	}
 
-	uint8_t* copy = malloc(length);
+	/* can't pass a null pointer */
+	if (data == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	chunk_t* chunk = chunk_alloc(NULL);
+	if (chunk == NULL) {
+		return NULL;
+	}
+
+	memcpy(chunk->buffer, data, length);
+
+	return chunk_commit(chunk, length, depth, key);
+}
+
+/*
+ * takes an additional reference to the chunk, which must be
+ * released with chunk_unref() or chunk_free().  Chunks wrapping
+ * data they don't own are only valid for as long as that data is.
+ */
+chunk_t* chunk_ref(chunk_t* chunk)
+{
+	assert(chunk);
+	atomic_fetch_add_explicit(&chunk->refs, 1, memory_order_relaxed);
+	return chunk;
+}
+
+/*
+ * as chunk_ref(), except that a chunk wrapping data it doesn't own is
+ * copied into a new chunk from 'pool' (or the default pool if NULL),
+ * so that the result stays valid after the caller's data goes away
+ */
+chunk_t* chunk_keep(chunk_t* chunk, chunk_pool_t* pool)
+{
+	assert(chunk);
+
+	if (chunk->pool || chunk->owner) {
+		return chunk_ref(chunk);
+	}
+
+	chunk_t* copy = chunk_alloc(pool);
 	if (copy == NULL) {
 		return NULL;
 	}
 
-	memcpy(copy, data, length);
+	memcpy(copy->buffer, chunk->data, chunk_length(chunk));
+	memcpy(copy->key, chunk->key, chunk_keylength);
 
-	return chunk_create(copy, length, depth, true, key);
+	return copy;
 }
 
 /*
- * frees a chunk and and the data within it
+ * drops a reference to the chunk.  When the last one goes the data
+ * within it is free'd (if owned) and the chunk returned to its pool.
  */
-void chunk_free(chunk_t* chunk)
+void chunk_unref(chunk_t* chunk)
 {
-	if (chunk) {
-		if ((chunk->data & 0x01) == 0x00) {
-			free((uint8_t*)chunk->data);
-		}
+	if (!chunk) {
+		return;
 	}
-	free(chunk);
+
+	if (atomic_fetch_sub_explicit(&chunk->refs, 1, memory_order_acq_rel) != 1) {
+		return;
+	}
+
+	if (chunk->owner) {
+		free((void *)chunk->data);
+	}
+
+	chunk_pool_t* pool = chunk->pool;
+	bool idle = false;
+
+	if (!pool) {
+		chunk_wrapper_release(chunk);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->outstanding--;
+	if (pool->closing || pool->free_count >= pool->limit) {
+		free(chunk);
+		idle = pool->closing && pool->outstanding == 0;
+	} else {
+		chunk->next = pool->free_list;
+		pool->free_list = chunk;
+		pool->free_count++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (idle) {
+		chunk_pool_destroy(pool);
+	}
+}
+
+/*
+ * releases the caller's reference to the chunk
+ */
+void chunk_free(chunk_t* chunk)
+{
+	chunk_unref(chunk);
 }
 
 /*
@@ -127,7 +566,7 @@ const uint8_t* chunk_key(const chunk_t* chunk)
 const uint8_t* chunk_data(const chunk_t* chunk)
 {
 	assert(chunk && chunk->data);
-	return (const uint8_t*)(chunk->data & ~0x01);
+	return chunk->data;
 }
 
 /*
@@ -180,58 +619,42 @@ uint16_t chunk_length_from_key(const uint8_t *key)
 	return length ? length : chunk_maxlength;
 }
 
-uint8_t* chunk_key_from_hex_r(const char *hex, uint8_t *buffer)
-{
-	uint8_t* p = buffer;
-	const char *q = hex;
-
-	for (int i = 0; i < chunk_keylength; ++i, q += 2) {
-		if (sscanf(q, "%2hhx", p++) != 1) {
-			return NULL;
-		}
-	}
-
-	return &buffer[0];
-}
-
-char* chunk_hex_from_key_r(const uint8_t *key, char *hex)
-{
-	char *p = hex;
-	static const char hexchars[] = "0123456789abcdef";
-	for (int i = 0; i < chunk_keylength; ++i) {
-		uint8_t c = *key++;
-		*p++ = hexchars[(c >> 4) & 0x0f];
-		*p++ = hexchars[(c >> 0) & 0x0f];
-	}
-	return p;
-}
-
-const uint8_t* chunk_key_from_hex(const char* hex)
-{
-	static uint8_t buffer[chunk_keylength];
-	return chunk_key_from_hex_r(hex, buffer);
-}
-
-const char* chunk_hex_from_key(const uint8_t* key)
-{
-	static char buffer[chunk_keylength * 2 + 1];
-	chunk_hex_from_key_r(key, buffer);
-	buffer[chunk_keylength * 2] = '\0';
-	return &buffer[0];
-}
-
 /*
  * calculates the SHA-256 key from the data, and
  * encodes the depth and length into that key
  */
 static void chunk_calckey(const uint8_t* data, uint16_t length, uint8_t depth, uint8_t* key)
 {
-	ldns_sha256((unsigned char *)data, length, key);
+	kvfs_sha256(data, length, key);
 
 	key[0] = (depth << 2) | ((length >> 8) & 0x03);
 	key[1] = length & 0xff;
 }
 
+/*
+ * calculates the keys for 'count' chunks of the same depth,
+ * writing them consecutively into 'keys'
+ */
+void chunk_calckey_batch(const uint8_t* const* data, const uint16_t* length, uint8_t depth, uint8_t* keys, size_t count)
+{
+	for (size_t base = 0; base < count; base += chunk_maxkeys) {
+		size_t n = count - base < chunk_maxkeys ? count - base : chunk_maxkeys;
+		size_t lengths[chunk_maxkeys];
+
+		for (size_t i = 0; i < n; ++i) {
+			lengths[i] = length[base + i];
+		}
+
+		kvfs_sha256_batch(data + base, lengths, keys + base * chunk_keylength, n);
+
+		for (size_t i = 0; i < n; ++i) {
+			uint8_t* key = keys + (base + i) * chunk_keylength;
+			key[0] = (depth << 2) | ((lengths[i] >> 8) & 0x03);
+			key[1] = lengths[i] & 0xff;
+		}
+	}
+}
+
 static int chunk_validate(const uint8_t* data, uint16_t length, uint8_t depth)
 {
 	/* chunks can't exceed the maxmimum size, nor be empty */
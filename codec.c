@@ -0,0 +1,387 @@
+/*
+ * codec.c
+ *
+ * text encodings of chunk keys, for stores that can't use binary keys
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <kvfs/chunk.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CODEC_X86
+#include <immintrin.h>
+#endif
+
+typedef char* (*hex_encode_t)(const uint8_t* key, char* hex);
+typedef bool (*hex_decode_t)(const char* hex, uint8_t* key);
+
+static char* hex_encode_scalar(const uint8_t* key, char* hex);
+static bool hex_decode_scalar(const char* hex, uint8_t* key);
+#ifdef CODEC_X86
+static char* hex_encode_ssse3(const uint8_t* key, char* hex);
+static bool hex_decode_ssse3(const char* hex, uint8_t* key);
+static char* hex_encode_avx2(const uint8_t* key, char* hex);
+static bool hex_decode_avx2(const char* hex, uint8_t* key);
+#endif
+
+static hex_encode_t hex_encode = hex_encode_scalar;
+static hex_decode_t hex_decode = hex_decode_scalar;
+
+static const char hexchars[] = "0123456789abcdef";
+static const char base32chars[] = "0123456789abcdefghijklmnopqrstuv";
+static const char base64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/*
+ * picks the widest vector implementation once, at load time
+ */
+__attribute__((constructor))
+static void codec_init(void)
+{
+#ifdef CODEC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		hex_encode = hex_encode_avx2;
+		hex_decode = hex_decode_avx2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		hex_encode = hex_encode_ssse3;
+		hex_decode = hex_decode_ssse3;
+	}
+#endif
+}
+
+//---------------------------------------------------------------------
+
+/*
+ * writes the key as chunk_hexlength lower-case hex digits, without
+ * a terminating NUL, returning a pointer to the end of the text
+ */
+char* chunk_hex_from_key_r(const uint8_t* key, char* hex)
+{
+	return hex_encode(key, hex);
+}
+
+/*
+ * parses a string of exactly chunk_hexlength hex digits (of either
+ * case) into the key.  Returns NULL with errno set to EINVAL on bad
+ * input, including a string that's too short or too long.
+ */
+uint8_t* chunk_key_from_hex_r(const char* hex, uint8_t* key)
+{
+	/* the vector code reads the whole input at once, so must not
+	 * be given a string that ends early */
+	if (strnlen(hex, chunk_hexlength + 1) != chunk_hexlength || !hex_decode(hex, key)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return key;
+}
+
+const uint8_t* chunk_key_from_hex(const char* hex)
+{
+	static uint8_t buffer[chunk_keylength];
+	return chunk_key_from_hex_r(hex, buffer);
+}
+
+const char* chunk_hex_from_key(const uint8_t* key)
+{
+	static char buffer[chunk_hexlength + 1];
+	chunk_hex_from_key_r(key, buffer);
+	buffer[chunk_hexlength] = '\0';
+	return &buffer[0];
+}
+
+/*
+ * writes the key as chunk_base32length characters of unpadded
+ * lower-case "base32hex" (RFC 4648), which is safe for use in
+ * DNS labels and preserves the sort order of the keys
+ */
+char* chunk_base32_from_key_r(const uint8_t* key, char* text)
+{
+	uint32_t acc = 0;
+	int bits = 0;
+
+	for (int i = 0; i < chunk_keylength; ++i) {
+		acc = (acc << 8) | key[i];
+		bits += 8;
+		while (bits >= 5) {
+			bits -= 5;
+			*text++ = base32chars[(acc >> bits) & 0x1f];
+		}
+	}
+	if (bits > 0) {
+		*text++ = base32chars[(acc << (5 - bits)) & 0x1f];
+	}
+
+	return text;
+}
+
+static inline int base32_value(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'v') {
+		return c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'V') {
+		return c - 'A' + 10;
+	} else {
+		return -1;
+	}
+}
+
+/*
+ * parses exactly chunk_base32length characters of base32hex (of
+ * either case).  The unused low bits of the last character must
+ * be zero so that every key has exactly one encoding.
+ */
+uint8_t* chunk_key_from_base32_r(const char* text, uint8_t* key)
+{
+	uint32_t acc = 0;
+	int bits = 0;
+	uint8_t* p = key;
+
+	for (int i = 0; i < chunk_base32length; ++i) {
+		int v = base32_value(text[i]);
+		if (v < 0) {
+			goto error;
+		}
+		acc = (acc << 5) | v;
+		bits += 5;
+		if (bits >= 8) {
+			bits -= 8;
+			*p++ = (acc >> bits) & 0xff;
+		}
+	}
+
+	if ((acc & ((1u << bits) - 1)) != 0) {
+		goto error;
+	}
+
+	return key;
+
+error:
+	errno = EINVAL;
+	return NULL;
+}
+
+/*
+ * writes the key as chunk_base64length characters of unpadded
+ * URL and filename safe base64 (RFC 4648)
+ */
+char* chunk_base64_from_key_r(const uint8_t* key, char* text)
+{
+	uint32_t acc = 0;
+	int bits = 0;
+
+	for (int i = 0; i < chunk_keylength; ++i) {
+		acc = (acc << 8) | key[i];
+		bits += 8;
+		while (bits >= 6) {
+			bits -= 6;
+			*text++ = base64chars[(acc >> bits) & 0x3f];
+		}
+	}
+	if (bits > 0) {
+		*text++ = base64chars[(acc << (6 - bits)) & 0x3f];
+	}
+
+	return text;
+}
+
+static inline int base64_value(char c)
+{
+	if (c >= 'A' && c <= 'Z') {
+		return c - 'A';
+	} else if (c >= 'a' && c <= 'z') {
+		return c - 'a' + 26;
+	} else if (c >= '0' && c <= '9') {
+		return c - '0' + 52;
+	} else if (c == '-') {
+		return 62;
+	} else if (c == '_') {
+		return 63;
+	} else {
+		return -1;
+	}
+}
+
+/*
+ * parses exactly chunk_base64length characters of URL safe
+ * base64, with the same canonical form check as for base32
+ */
+uint8_t* chunk_key_from_base64_r(const char* text, uint8_t* key)
+{
+	uint32_t acc = 0;
+	int bits = 0;
+	uint8_t* p = key;
+
+	for (int i = 0; i < chunk_base64length; ++i) {
+		int v = base64_value(text[i]);
+		if (v < 0) {
+			goto error;
+		}
+		acc = (acc << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			*p++ = (acc >> bits) & 0xff;
+		}
+	}
+
+	if ((acc & ((1u << bits) - 1)) != 0) {
+		goto error;
+	}
+
+	return key;
+
+error:
+	errno = EINVAL;
+	return NULL;
+}
+
+//---------------------------------------------------------------------
+
+static char* hex_encode_scalar(const uint8_t* key, char* hex)
+{
+	for (int i = 0; i < chunk_keylength; ++i) {
+		uint8_t c = *key++;
+		*hex++ = hexchars[(c >> 4) & 0x0f];
+		*hex++ = hexchars[(c >> 0) & 0x0f];
+	}
+	return hex;
+}
+
+static inline int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	} else {
+		return -1;
+	}
+}
+
+static bool hex_decode_scalar(const char* hex, uint8_t* key)
+{
+	for (int i = 0; i < chunk_keylength; ++i, hex += 2) {
+		int hi = hex_value(hex[0]);
+		int lo = hex_value(hex[1]);
+		if (hi < 0 || lo < 0) {
+			return false;
+		}
+		*key++ = (hi << 4) | lo;
+	}
+	return true;
+}
+
+#ifdef CODEC_X86
+
+/*
+ * the vector versions split each byte into nibbles and use a byte
+ * shuffle as a 16 entry lookup table.  Decoding classifies every
+ * character as a digit or (case-folded) letter, rejects anything
+ * else, then folds pairs of nibbles together with a multiply-add.
+ */
+
+__attribute__((target("ssse3")))
+static char* hex_encode_ssse3(const uint8_t* key, char* hex)
+{
+	const __m128i table = _mm_loadu_si128((const __m128i*)hexchars);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+
+	for (int i = 0; i < chunk_keylength; i += 16, hex += 32) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(key + i));
+		__m128i hi = _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(x, 4), mask));
+		__m128i lo = _mm_shuffle_epi8(table, _mm_and_si128(x, mask));
+		_mm_storeu_si128((__m128i*)(hex + 0), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i*)(hex + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+
+	return hex;
+}
+
+__attribute__((target("ssse3")))
+static bool hex_decode_ssse3(const char* hex, uint8_t* key)
+{
+	const __m128i weights = _mm_set1_epi16(0x0110);
+
+	for (int i = 0; i < chunk_hexlength; i += 16, key += 8) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(hex + i));
+		__m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+
+		/* bytes >= 0x80 compare as negative, so fail both ranges */
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+									  _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+		__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+									  _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+		if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff) {
+			return false;
+		}
+
+		__m128i value = _mm_or_si128(
+			_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+			_mm_andnot_si128(digit, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+		__m128i pairs = _mm_maddubs_epi16(value, weights);
+		_mm_storel_epi64((__m128i*)key, _mm_packus_epi16(pairs, pairs));
+	}
+
+	return true;
+}
+
+__attribute__((target("avx2")))
+static char* hex_encode_avx2(const uint8_t* key, char* hex)
+{
+	const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)hexchars));
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+
+	__m256i x = _mm256_loadu_si256((const __m256i*)key);
+	__m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+	__m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(x, mask));
+
+	/* the unpacks work within each 128 bit lane, so swap the middle halves back */
+	__m256i a = _mm256_unpacklo_epi8(hi, lo);
+	__m256i b = _mm256_unpackhi_epi8(hi, lo);
+	_mm256_storeu_si256((__m256i*)(hex + 0), _mm256_permute2x128_si256(a, b, 0x20));
+	_mm256_storeu_si256((__m256i*)(hex + 32), _mm256_permute2x128_si256(a, b, 0x31));
+
+	return hex + chunk_hexlength;
+}
+
+__attribute__((target("avx2")))
+static bool hex_decode_avx2(const char* hex, uint8_t* key)
+{
+	const __m256i weights = _mm256_set1_epi16(0x0110);
+
+	for (int i = 0; i < chunk_hexlength; i += 32, key += 16) {
+		__m256i c = _mm256_loadu_si256((const __m256i*)(hex + i));
+		__m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+
+		__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+										 _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+		__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+										 _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+		if ((uint32_t)_mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) != 0xffffffff) {
+			return false;
+		}
+
+		__m256i value = _mm256_or_si256(
+			_mm256_and_si256(digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+			_mm256_andnot_si256(digit, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10))));
+		__m256i pairs = _mm256_maddubs_epi16(value, weights);
+
+		/* the pack also works per lane, leaving the bytes in qwords 0 and 2 */
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(pairs, pairs), 0x08);
+		_mm_storeu_si128((__m128i*)key, _mm256_castsi256_si128(packed));
+	}
+
+	return true;
+}
+
+#endif
@@ -12,18 +12,15 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	if (strlen(argv[1]) != chunk_keylength * 2) {
+	if (strlen(argv[1]) != chunk_hexlength) {
 		fprintf(stderr, "error: bad key length");
 		return EXIT_FAILURE;
 	}
 
 	uint8_t key[chunk_keylength];
-	uint8_t* q = key;
-	char*p = &argv[1][0];
-	for (int i = 0; i < chunk_keylength; ++i, p += 2) {
-		if (sscanf(p, "%2hhx", q++) != 1) {
-			fprintf(stderr, "error: bad key data");
-		}
+	if (!chunk_key_from_hex_r(argv[1], key)) {
+		fprintf(stderr, "error: bad key data");
+		return EXIT_FAILURE;
 	}
 
 	kvfs_store_t* store = kvfs_create_file("/tmp");
@@ -1,5 +1,9 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <ldns/ldns.h>
 
 #include <kvfs/kvfs.h>
@@ -27,33 +31,26 @@ int main(int argc, char *argv[])
 	kvfs_store_t* store = kvfs_create_dns(resolver);
 
 	for (int i = 1; i < argc; ++i) {
-		char buffer[4096];
-
-		FILE *in = fopen(argv[i], "rb");
-		FILE *out = kvfs_fopen_write(store);
-
-		while (!feof(in)) {
-			ssize_t n = fread(buffer, 1, sizeof buffer, in);
-			if (n > 0) {
-				size_t offset = 0;
-				while (offset < n) {
-					ssize_t r = fwrite(buffer + offset, 1, n, out);
-					if (r < 0) {
-						printf(stderr, "error writing file %d\n", i);
-						break;
-					} 
-					offset += r;
-					n -= r;
-				}
-			}
+		uint8_t key[chunk_keylength];
+
+		int fd = strcmp(argv[i], "-") ? open(argv[i], O_RDONLY) : STDIN_FILENO;
+		if (fd < 0) {
+			fprintf(stderr, "error opening %s: %s\n", argv[i], strerror(errno));
+			continue;
+		}
+
+		int r = kvfs_put_fd(store, fd, key);
+		if (fd != STDIN_FILENO) {
+			close(fd);
+		}
+
+		if (r < 0) {
+			fprintf(stderr, "error storing %s: %s\n", argv[i], kvfs_error(store));
+			continue;
 		}
-		fclose(in);
-		fclose(out);
 
-		// get the key
-		const uint8_t* key = kvfs_last(store);
-		for (int i = 0; i < chunk_keylength; ++i) {
-			fprintf(stdout, "%02x", key[i]);
+		for (int j = 0; j < chunk_keylength; ++j) {
+			fprintf(stdout, "%02x", key[j]);
 		}
 
 		fprintf(stdout, ": %s\n", argv[i]);
@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <ldns/ldns.h>
 #include <ldns/rr.h>
 
@@ -8,22 +10,44 @@
 #include <kvfs/chunk.h>
 #include <kvfs/private.h>
 
+/*
+ * a resolver isn't thread safe, so each request in flight gets one of
+ * its own, cloned on demand from the caller's, which is only used as
+ * a template
+ */
 typedef struct kvfs_dns_context_t {
 	ldns_resolver*	resolver;
-	ldns_status		status;
+	ldns_status		status;			// from the last request to fail
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned int	count;
+	unsigned int	idle;
+	ldns_resolver*	conns[kvfs_connections_max];
+	ldns_resolver*	spare[kvfs_connections_max];
 } kvfs_dns_context_t;
 
 static chunk_t* kvfs_dns_get(kvfs_store_t* store, const uint8_t* key);
+static chunk_t* kvfs_dns_get_raw(kvfs_store_t* store, const uint8_t* key, uint16_t* length);
 static int kvfs_dns_put(kvfs_store_t* store, chunk_t* chunk);
+static int kvfs_dns_has(kvfs_store_t* store, const uint8_t* key);
+static int kvfs_dns_has_many(kvfs_store_t* store, const uint8_t* keys, size_t count, bool* present);
+static int kvfs_dns_put_many(kvfs_store_t* store, chunk_t* const* chunks, size_t count, int* errors);
 static void kvfs_dns_free(kvfs_store_t* store);
 static const char* kvfs_dns_error(kvfs_store_t* store);
 
+static ldns_resolver* kvfs_dns_acquire(kvfs_dns_context_t* context);
+static void kvfs_dns_release(kvfs_dns_context_t* context, ldns_resolver* resolver, ldns_status status);
 static ldns_rdf* hex_domain(kvfs_dns_context_t* context, const uint8_t* key);
-static chunk_t* kvfs_dns_query(kvfs_dns_context_t* context, ldns_rdf* qname, const uint8_t* key);
-static int kvfs_dns_update(kvfs_dns_context_t* context, ldns_rdf* qname, const chunk_t* chunk);
+static ldns_pkt* kvfs_dns_lookup(kvfs_dns_context_t* context, ldns_rdf* qname);
+static chunk_t* kvfs_dns_query(kvfs_store_t* store, ldns_rdf* qname, const uint8_t* key, uint16_t* length);
+static int kvfs_dns_update(kvfs_dns_context_t* context, chunk_t* const* chunks, size_t count);
 
 static const ldns_rr_type rrtype = LDNS_RR_TYPE_NULL;
 
+enum {
+	kvfs_dns_update_max = 16		// RRs per UPDATE, so that it stays a reasonable size
+};
+
 /* --------------------------------------------------------------------
  * public interface
  */
@@ -38,20 +62,29 @@ kvfs_store_t* kvfs_create_dns(ldns_resolver* resolver)
 		return NULL;
 	}
 
-	store = malloc(sizeof *store);
-	context = malloc(sizeof *context);
+	context = calloc(1, sizeof *context);
+	store = kvfs_store_alloc(context);
 
 	if (!store || !context) {
+		kvfs_store_release(store);
 		free(context);
-		free(store);
 		return NULL;
 	}
 
-	store->context = context;
 	context->resolver = resolver;
+	pthread_mutex_init(&context->lock, NULL);
+	pthread_cond_init(&context->cond, NULL);
+
+	/* every chunk is a network round trip, so read ahead by default */
+	store->readahead = kvfs_readahead_default;
+	store->put_window = kvfs_put_window_default;
 
 	store->get = kvfs_dns_get;
+	store->get_raw = kvfs_dns_get_raw;
 	store->put = kvfs_dns_put;
+	store->has = kvfs_dns_has;
+	store->has_many = kvfs_dns_has_many;
+	store->put_many = kvfs_dns_put_many;
 	store->free = kvfs_dns_free;
 	store->error = kvfs_dns_error;
 
@@ -63,6 +96,15 @@ kvfs_store_t* kvfs_create_dns(ldns_resolver* resolver)
  */
 
 static chunk_t* kvfs_dns_get(kvfs_store_t* store, const uint8_t* key)
+{
+	uint16_t length;
+	chunk_t* chunk = kvfs_dns_get_raw(store, key, &length);
+
+	return chunk ? kvfs_store_commit(store, chunk, length, key) : NULL;
+}
+
+/* fetches a chunk into a pooled buffer, leaving it to the caller to commit */
+static chunk_t* kvfs_dns_get_raw(kvfs_store_t* store, const uint8_t* key, uint16_t* length)
 {
 	chunk_t* chunk = NULL;
 
@@ -70,7 +112,7 @@ static chunk_t* kvfs_dns_get(kvfs_store_t* store, const uint8_t* key)
 	if (!domain) {
 		goto error;
 	}
-	chunk = kvfs_dns_query(store->context, domain, key);
+	chunk = kvfs_dns_query(store, domain, key, length);
 	ldns_rdf_deep_free(domain);
 
 error:
@@ -79,45 +121,293 @@ error:
 
 static int kvfs_dns_put(kvfs_store_t* store, chunk_t* chunk)
 {
-	int r;
-
 	if (!chunk) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	ldns_rdf* domain = hex_domain(store->context, chunk_key(chunk));
-	if (!domain) {
-		r = -1;
-		goto cleanup;
+	return kvfs_dns_update(store->context, &chunk, 1);
+}
+
+/* sends the chunks in as few UPDATEs as possible, each signed once */
+static int kvfs_dns_put_many(kvfs_store_t* store, chunk_t* const* chunks, size_t count, int* errors)
+{
+	int result = 0;
+
+	for (size_t base = 0; base < count; base += kvfs_dns_update_max) {
+		size_t n = count - base < kvfs_dns_update_max ? count - base : kvfs_dns_update_max;
+		int error = 0;
+
+		for (size_t i = 0; i < n; ++i) {
+			if (!chunks[base + i]) {
+				error = EINVAL;
+			}
+		}
+		if (!error && kvfs_dns_update(store->context, chunks + base, n) < 0) {
+			error = errno;
+		}
+
+		/* the server applies an UPDATE as a whole, so they share its fate */
+		for (size_t i = 0; i < n; ++i) {
+			errors[base + i] = error;
+		}
+		if (error) {
+			result = -1;
+		}
 	}
 
-	r = kvfs_dns_update(store->context, domain, chunk);
+	return result;
+}
+
+/*
+ * the answer carries the data anyway, but a query is still far cheaper
+ * than a signed UPDATE
+ */
+static int kvfs_dns_has(kvfs_store_t* store, const uint8_t* key)
+{
+	int r = 0;
+
+	ldns_rdf* domain = hex_domain(store->context, key);
+	if (!domain) {
+		return -1;
+	}
 
-cleanup:
+	ldns_pkt* resp = kvfs_dns_lookup(store->context, domain);
 	ldns_rdf_deep_free(domain);
+	if (resp == NULL) {
+		errno = KVFS_DRIVER_ERROR;
+		return -1;
+	}
+
+	ldns_rr_list* answer = ldns_pkt_answer(resp);
+	for (size_t i = 0; !r && i < ldns_rr_list_rr_count(answer); ++i) {
+		ldns_rr* rr = ldns_rr_list_rr(answer, i);
+		if (ldns_rr_get_type(rr) == rrtype &&
+			ldns_rdf_size(ldns_rr_rdf(rr, 0)) == chunk_length_from_key(key))
+		{
+			r = 1;
+		}
+	}
+
+	ldns_pkt_free(resp);
 	return r;
 }
 
+typedef struct kvfs_dns_batch_t {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	size_t				remaining;
+} kvfs_dns_batch_t;
+
+typedef struct kvfs_dns_check_t {
+	kvfs_work_t			work;
+	kvfs_store_t*		store;
+	kvfs_dns_batch_t*	batch;
+	const uint8_t*		key;
+	int					result;
+	int					error;
+} kvfs_dns_check_t;
+
+static void kvfs_dns_check_run(kvfs_work_t* work)
+{
+	kvfs_dns_check_t* check = (kvfs_dns_check_t*)work;
+	kvfs_dns_batch_t* batch = check->batch;
+
+	check->result = kvfs_dns_has(check->store, check->key);
+	check->error = (check->result < 0) ? errno : 0;
+
+	pthread_mutex_lock(&batch->lock);
+	if (--batch->remaining == 0) {
+		pthread_cond_signal(&batch->cond);
+	}
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/*
+ * DNS has no multi-question query, so the questions are asked at once
+ * on the store's worker threads, each with a resolver from the pool
+ */
+static int kvfs_dns_has_many(kvfs_store_t* store, const uint8_t* keys, size_t count, bool* present)
+{
+	kvfs_workq_t* workq = count > 1 ? kvfs_store_workq(store) : NULL;
+	kvfs_dns_check_t* checks = workq ? malloc(count * sizeof *checks) : NULL;
+	kvfs_dns_batch_t batch;
+	int error = 0;
+
+	if (!checks) {
+		/* not worth a thread, or there aren't any */
+		for (size_t i = 0; i < count; ++i) {
+			int r = kvfs_dns_has(store, keys + i * chunk_keylength);
+			if (r < 0) {
+				return -1;
+			}
+			present[i] = (r > 0);
+		}
+		return 0;
+	}
+
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+	batch.remaining = count;
+
+	for (size_t i = 0; i < count; ++i) {
+		checks[i].work.run = kvfs_dns_check_run;
+		checks[i].store = store;
+		checks[i].batch = &batch;
+		checks[i].key = keys + i * chunk_keylength;
+		kvfs_workq_submit(workq, &checks[i].work);
+	}
+
+	pthread_mutex_lock(&batch.lock);
+	while (batch.remaining) {
+		pthread_cond_wait(&batch.cond, &batch.lock);
+	}
+	pthread_mutex_unlock(&batch.lock);
+
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.lock);
+
+	for (size_t i = 0; i < count; ++i) {
+		present[i] = (checks[i].result > 0);
+		if (checks[i].result < 0 && !error) {
+			error = checks[i].error;
+		}
+	}
+	free(checks);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
 static void kvfs_dns_free(kvfs_store_t* store)
 {
 	if (store->context) {
 		kvfs_dns_context_t* context = store->context;
+		for (unsigned int i = 0; i < context->count; ++i) {
+			ldns_resolver_deep_free(context->conns[i]);
+		}
+		pthread_cond_destroy(&context->cond);
+		pthread_mutex_destroy(&context->lock);
 		free(context);
 	}
-	free(store);
+	kvfs_store_release(store);
 }
 
 static const char* kvfs_dns_error(kvfs_store_t* store)
 {
 	kvfs_dns_context_t* context = store->context;
-	return ldns_get_errorstr_by_id(context->status);
+
+	pthread_mutex_lock(&context->lock);
+	ldns_status status = context->status;
+	pthread_mutex_unlock(&context->lock);
+
+	return ldns_get_errorstr_by_id(status);
 }
 
 /* --------------------------------------------------------------------
  * helper functions
  */
 
+/*
+ * gives 'clone' its own copy of one of the template's TSIG strings, if
+ * it has one.  newer versions of ldns copy the string in the setter,
+ * but older ones keep the pointer and free it with the resolver, so if
+ * the setter kept ours it's replaced with a copy.
+ */
+#define kvfs_dns_copy_tsig(clone, resolver, field)									\
+	do {																			\
+		const char* value = ldns_resolver_tsig_##field(resolver);					\
+		if (value) {																\
+			ldns_resolver_set_tsig_##field(clone, (char*)value);					\
+			if (ldns_resolver_tsig_##field(clone) == value) {						\
+				ldns_resolver_set_tsig_##field(clone, strdup(value));				\
+			}																		\
+			if (!ldns_resolver_tsig_##field(clone)) {								\
+				ldns_resolver_deep_free(clone);										\
+				return NULL;														\
+			}																		\
+		}																			\
+	} while (0)
+
+/* copies the settings that matter for queries and updates */
+static ldns_resolver* kvfs_dns_clone(ldns_resolver* resolver)
+{
+	ldns_resolver* clone = ldns_resolver_new();
+	if (!clone) {
+		return NULL;
+	}
+
+	ldns_rdf** nameservers = ldns_resolver_nameservers(resolver);
+	for (size_t i = 0; i < ldns_resolver_nameserver_count(resolver); ++i) {
+		if (ldns_resolver_push_nameserver(clone, nameservers[i]) != LDNS_STATUS_OK) {
+			ldns_resolver_deep_free(clone);
+			return NULL;
+		}
+	}
+
+	if (ldns_resolver_domain(resolver)) {
+		ldns_resolver_set_domain(clone, ldns_rdf_clone(ldns_resolver_domain(resolver)));
+	}
+	ldns_resolver_set_port(clone, ldns_resolver_port(resolver));
+	ldns_resolver_set_usevc(clone, ldns_resolver_usevc(resolver));
+	ldns_resolver_set_fail(clone, ldns_resolver_fail(resolver));
+	ldns_resolver_set_retry(clone, ldns_resolver_retry(resolver));
+	ldns_resolver_set_retrans(clone, ldns_resolver_retrans(resolver));
+	ldns_resolver_set_timeout(clone, ldns_resolver_timeout(resolver));
+	kvfs_dns_copy_tsig(clone, resolver, keyname);
+	kvfs_dns_copy_tsig(clone, resolver, algorithm);
+	kvfs_dns_copy_tsig(clone, resolver, keydata);
+
+	return clone;
+}
+
+/* waits for an idle resolver, cloning another if there's room */
+static ldns_resolver* kvfs_dns_acquire(kvfs_dns_context_t* context)
+{
+	ldns_resolver* resolver = NULL;
+
+	pthread_mutex_lock(&context->lock);
+	while (!context->idle) {
+		if (context->count < kvfs_connections_max &&
+			(resolver = kvfs_dns_clone(context->resolver)) != NULL)
+		{
+			context->conns[context->count++] = resolver;
+			break;
+		}
+
+		/* with no resolvers at all there's nothing to wait for */
+		if (context->count == 0) {
+			break;
+		}
+		pthread_cond_wait(&context->cond, &context->lock);
+	}
+	if (!resolver && context->idle) {
+		resolver = context->spare[--context->idle];
+	}
+	pthread_mutex_unlock(&context->lock);
+
+	if (!resolver) {
+		errno = ENOMEM;
+	}
+
+	return resolver;
+}
+
+static void kvfs_dns_release(kvfs_dns_context_t* context, ldns_resolver* resolver, ldns_status status)
+{
+	pthread_mutex_lock(&context->lock);
+	if (status != LDNS_STATUS_OK) {
+		context->status = status;
+	}
+	context->spare[context->idle++] = resolver;
+	pthread_cond_signal(&context->cond);
+	pthread_mutex_unlock(&context->lock);
+}
+
 /* produces a relative qname representing the key */
 static ldns_rdf* hex_domain(kvfs_dns_context_t* context, const uint8_t* key)
 {
@@ -153,95 +443,137 @@ static ldns_rdf* hex_domain(kvfs_dns_context_t* context, const uint8_t* key)
 	return prefix;
 }
 
-static chunk_t* kvfs_dns_query(kvfs_dns_context_t* context, ldns_rdf* qname, const uint8_t* key)
+static ldns_pkt* kvfs_dns_lookup(kvfs_dns_context_t* context, ldns_rdf* qname)
 {
-	ldns_resolver* resolver = context->resolver;
-	chunk_t* chunk = NULL;
+	ldns_resolver* resolver = kvfs_dns_acquire(context);
+	if (!resolver) {
+		return NULL;
+	}
 
 	ldns_resolver_set_recursive(resolver, true);
 	ldns_resolver_set_edns_udp_size(resolver, 2048);
 	ldns_resolver_set_defnames(resolver, false);
-	ldns_pkt* resp = ldns_resolver_query(context->resolver, qname, rrtype, LDNS_RR_CLASS_IN, LDNS_RD);
+	ldns_pkt* resp = NULL;
+	ldns_status status = ldns_resolver_query_status(&resp, resolver, qname, rrtype, LDNS_RR_CLASS_IN, LDNS_RD);
+	kvfs_dns_release(context, resolver, status);
+
+	return resp;
+}
+
+static chunk_t* kvfs_dns_query(kvfs_store_t* store, ldns_rdf* qname, const uint8_t* key, uint16_t* length)
+{
+	chunk_t* chunk = NULL;
+
+	ldns_pkt* resp = kvfs_dns_lookup(store->context, qname);
 	if (resp == NULL) {
 		return NULL;
 	}
 
+	/* the data's length is part of the key, so that picks out the right RR */
+	errno = ENOENT;
 	ldns_rr_list* answer = ldns_pkt_answer(resp);
 	for (size_t i = 0; !chunk && i < ldns_rr_list_rr_count(answer); ++i) {
 		ldns_rr* rr = ldns_rr_list_rr(answer, i);
-		if (ldns_rr_get_type(rr) != rrtype) {
+		ldns_rdf* rdf = ldns_rr_rdf(rr, 0);
+		if (ldns_rr_get_type(rr) != rrtype || ldns_rdf_size(rdf) != chunk_length_from_key(key)) {
 			continue;
 		}
 
-		/* take ownership of the RR data */
-		ldns_rdf* rdf = ldns_rr_rdf(rr, 0);
-		uint8_t* data = ldns_rdf_data(rdf);
-		size_t length = ldns_rdf_size(rdf);
-
-		/* create the chunk, has the side effect of validating the data against the key */
-		uint8_t depth = chunk_depth_from_key(key);
-		chunk = chunk_create(data, length, depth, true, key);
-
-		/* fixup the RR to avoid double-free */
-		ldns_rdf_set_data(rdf, NULL);
-		ldns_rdf_set_size(rdf, 0);
+		/* copy the RR data into a pooled chunk */
+		chunk = chunk_alloc(store->pool);
+		if (!chunk) {
+			break;
+		}
+		*length = ldns_rdf_size(rdf);
+		memcpy(chunk_buffer(chunk), ldns_rdf_data(rdf), *length);
 	}
 
 	ldns_pkt_free(resp);
 	return chunk;
 }
 
-static ldns_pkt* kvfs_dns_make_update(kvfs_dns_context_t* context, ldns_rdf* qname, const chunk_t* chunk)
+/* builds an UPDATE adding an RR for each chunk, signed if need be */
+static ldns_pkt* kvfs_dns_make_update(kvfs_dns_context_t* context, ldns_resolver* resolver,
+										chunk_t* const* chunks, size_t count, ldns_status* status)
 {
-	ldns_resolver* resolver = context->resolver;
-
 	ldns_rr_list* updates = ldns_rr_list_new();
-	ldns_rr* rr = ldns_rr_new();
-	ldns_rdf* owner = ldns_rdf_clone(qname);
-	ldns_rdf* rdata = ldns_rdf_new_frm_data(LDNS_RDF_TYPE_NONE, chunk_length(chunk), (void *)chunk_data(chunk));
 	ldns_rdf* zone = ldns_rdf_clone(ldns_resolver_domain(resolver));
+	ldns_pkt* pkt = NULL;
 
-	if (!updates || !rr || !owner || !rdata || !zone) {
-		return NULL;
+	if (!updates || !zone) {
+		goto error;
 	}
 
-	ldns_rr_set_type(rr, rrtype);
-	ldns_rr_set_ttl(rr, 86400);
-	ldns_rr_set_owner(rr, owner);
-	ldns_rr_push_rdf(rr, rdata);
-	ldns_rr_list_push_rr(updates, rr);
+	for (size_t i = 0; i < count; ++i) {
+		ldns_rr* rr = ldns_rr_new();
+		ldns_rdf* owner = hex_domain(context, chunk_key(chunks[i]));
+		ldns_rdf* rdata = ldns_rdf_new_frm_data(LDNS_RDF_TYPE_NONE, chunk_length(chunks[i]),
+												(void *)chunk_data(chunks[i]));
+
+		if (!rr || !owner || !rdata) {
+			ldns_rr_free(rr);
+			ldns_rdf_deep_free(owner);
+			ldns_rdf_deep_free(rdata);
+			goto error;
+		}
+
+		ldns_rr_set_type(rr, rrtype);
+		ldns_rr_set_ttl(rr, 86400);
+		ldns_rr_set_owner(rr, owner);
+		ldns_rr_push_rdf(rr, rdata);
+		ldns_rr_list_push_rr(updates, rr);
+	}
 
-	ldns_pkt *pkt = ldns_update_pkt_new(zone, LDNS_RR_CLASS_IN, NULL, updates, NULL);
-	ldns_rr_list_free(updates);
+	pkt = ldns_update_pkt_new(zone, LDNS_RR_CLASS_IN, NULL, updates, NULL);
+	zone = NULL;
+	if (!pkt) {
+		goto error;
+	}
 
-	if (pkt && ldns_resolver_tsig_keyname(resolver)) {
-		context->status = ldns_update_pkt_tsig_add(pkt, resolver);
-		if (context->status != LDNS_STATUS_OK) {
+	if (ldns_resolver_tsig_keyname(resolver)) {
+		*status = ldns_update_pkt_tsig_add(pkt, resolver);
+		if (*status != LDNS_STATUS_OK) {
 			goto error;
 		}
 	}
 
+	ldns_rr_list_deep_free(updates);
 	return pkt;
 
 error:
 	errno = KVFS_DRIVER_ERROR;
+	ldns_rr_list_deep_free(updates);
+	ldns_rdf_deep_free(zone);
 	ldns_pkt_free(pkt);
 	return NULL;
 }
 
-static int kvfs_dns_update(kvfs_dns_context_t* context, ldns_rdf* qname, const chunk_t* chunk)
+static int kvfs_dns_update(kvfs_dns_context_t* context, chunk_t* const* chunks, size_t count)
 {
+	ldns_status status = LDNS_STATUS_OK;
 	ldns_pkt* r_pkt = NULL;
-	ldns_pkt* u_pkt = kvfs_dns_make_update(context, qname, chunk);
+
+	ldns_resolver* resolver = kvfs_dns_acquire(context);
+	if (!resolver) {
+		return -1;
+	}
+
+	ldns_pkt* u_pkt = kvfs_dns_make_update(context, resolver, chunks, count, &status);
 	if (!u_pkt) {
+		kvfs_dns_release(context, resolver, status);
 		return -1;
 	}
 
+	/* more than one RR won't fit in a datagram */
+	bool usevc = ldns_resolver_usevc(resolver);
+	if (count > 1) {
+		ldns_resolver_set_usevc(resolver, true);
+	}
+
 	errno = 0;
-	ldns_resolver* resolver = context->resolver;
 	ldns_pkt_set_random_id(u_pkt);
-	context->status = ldns_resolver_send_pkt(&r_pkt, resolver, u_pkt);
-	if (context->status == LDNS_STATUS_OK) {
+	status = ldns_resolver_send_pkt(&r_pkt, resolver, u_pkt);
+	if (status == LDNS_STATUS_OK) {
 		if (ldns_pkt_get_rcode(r_pkt) != LDNS_RCODE_NOERROR) {
 			errno = ENOENT;
 		}
@@ -250,6 +582,8 @@ static int kvfs_dns_update(kvfs_dns_context_t* context, ldns_rdf* qname, const c
 		errno = KVFS_DRIVER_ERROR;
 	}
 	ldns_pkt_free(u_pkt);
+	ldns_resolver_set_usevc(resolver, usevc);
+	kvfs_dns_release(context, resolver, status);
 
 	return (errno == 0) ? 0 : -1;
 }
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <limits.h>
 #include <errno.h>
 
@@ -17,20 +18,22 @@ typedef struct kvfs_file_context_t {
 /* buffer must be at least _POSIX_PATH_MAX long */
 static void hex_path(kvfs_file_context_t* context, const uint8_t* key, char* buffer)
 {
-	snprintf(buffer, _POSIX_PATH_MAX, "%s/%s.kvfs", context->path, chunk_hex_from_key(key));
+	char hex[chunk_hexlength];
+	chunk_hex_from_key_r(key, hex);
+	snprintf(buffer, _POSIX_PATH_MAX, "%s/%.*s.kvfs", context->path, (int)sizeof hex, hex);
 }
 
-static chunk_t* kvfs_file_get(kvfs_store_t* store, const uint8_t* key)
+/* reads a chunk into a pooled buffer, leaving it to the caller to commit */
+static chunk_t* kvfs_file_get_raw(kvfs_store_t* store, const uint8_t* key, uint16_t* size)
 {
 	char path[_POSIX_PATH_MAX];
-	uint8_t* buffer;
-	uint8_t depth;
+	chunk_t* chunk;
 	ssize_t length;
 	int fd;
 
-	buffer = malloc(chunk_maxlength);
-	if (!buffer) {
-		goto error;
+	chunk = chunk_alloc(store->pool);
+	if (!chunk) {
+		return NULL;
 	}
 
 	hex_path(store->context, key, path);
@@ -39,25 +42,35 @@ static chunk_t* kvfs_file_get(kvfs_store_t* store, const uint8_t* key)
 		goto error;
 	}
 
-	length = read(fd, buffer, chunk_maxlength);
+	length = read(fd, chunk_buffer(chunk), chunk_maxlength);
+	close(fd);
 	if (length < 0) {
 		// TODO better error / short read check
 		goto error;
 	}
 
-	depth = chunk_depth_from_key(key);
-	return chunk_create(buffer, length, depth, true, key);
+	*size = length;
+	return chunk;
 
 error:
-	free(buffer);
+	chunk_free(chunk);
 	return NULL;
 }
 
+static chunk_t* kvfs_file_get(kvfs_store_t* store, const uint8_t* key)
+{
+	uint16_t length;
+	chunk_t* chunk = kvfs_file_get_raw(store, key, &length);
+
+	return chunk ? kvfs_store_commit(store, chunk, length, key) : NULL;
+}
+
 static int kvfs_file_put(kvfs_store_t* store, chunk_t* chunk)
 {
 	char path[_POSIX_PATH_MAX];
 	const uint8_t* buffer;
 	ssize_t length;
+	ssize_t written;
 	int fd;
 
 	kvfs_file_context_t* context = store->context;
@@ -71,11 +84,24 @@ static int kvfs_file_put(kvfs_store_t* store, chunk_t* chunk)
 	length = chunk_length(chunk);
 
 	// TODO better short write check
-	if (write(fd, buffer, length) != length) {
-		return -1;
-	} else {
-		return 0;
+	written = write(fd, buffer, length);
+	close(fd);
+
+	return (written == length) ? 0 : -1;
+}
+
+/* a file of the wrong length is left over from a failed put */
+static int kvfs_file_has(kvfs_store_t* store, const uint8_t* key)
+{
+	char path[_POSIX_PATH_MAX];
+	struct stat st;
+
+	hex_path(store->context, key, path);
+	if (stat(path, &st) < 0) {
+		return (errno == ENOENT) ? 0 : -1;
 	}
+
+	return st.st_size == chunk_length_from_key(key);
 }
 
 static void kvfs_file_free(kvfs_store_t* store)
@@ -85,7 +111,7 @@ static void kvfs_file_free(kvfs_store_t* store)
 		free(context->path);
 		free(context);
 	}
-	free(store);
+	kvfs_store_release(store);
 }
 
 static const char *kvfs_file_error(kvfs_store_t* store)
@@ -105,22 +131,23 @@ kvfs_store_t* kvfs_create_file(const char* path)
 		return NULL;
 	}
 
-	store = malloc(sizeof *store);
 	context = malloc(sizeof *context);
 	path_copy = strdup(path);
+	store = kvfs_store_alloc(context);
 
 	if (!store || !context || !path_copy) {
+		kvfs_store_release(store);
 		free(path_copy);
 		free(context);
-		free(store);
 		return NULL;
 	}
 
-	store->context = context;
 	context->path = path_copy;
 	context->path_length = strlen(path);
 	store->get = kvfs_file_get;
+	store->get_raw = kvfs_file_get_raw;
 	store->put = kvfs_file_put;
+	store->has = kvfs_file_has;
 	store->free = kvfs_file_free;
 	store->error = kvfs_file_error;
 
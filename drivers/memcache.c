@@ -1,27 +1,108 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <kvfs/drivers/memcache.h>
 #include <kvfs/chunk.h>
 #include <kvfs/private.h>
 
+/*
+ * a memcached_st can only be used by one thread at a time, so each
+ * request in flight gets a connection of its own, cloned on demand
+ * from the caller's, which is never used directly.  the clones buffer
+ * their sets, so that a batch of them goes out together.
+ */
+typedef struct kvfs_memcache_context_t {
+	memcached_st*		memc;
+	bool				failed;
+	char				message[256];	// from the last connection to see an error
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	unsigned int		count;
+	unsigned int		idle;
+	memcached_st*		conns[kvfs_connections_max];
+	memcached_st*		spare[kvfs_connections_max];
+} kvfs_memcache_context_t;
+
+/* waits for an idle connection, opening another if there's room */
+static memcached_st* kvfs_memcache_acquire(kvfs_memcache_context_t* context)
+{
+	memcached_st* memc = NULL;
+
+	pthread_mutex_lock(&context->lock);
+	while (!context->idle) {
+		if (context->count < kvfs_connections_max &&
+			(memc = memcached_clone(NULL, context->memc)) != NULL)
+		{
+			memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+			context->conns[context->count++] = memc;
+			break;
+		}
+
+		/* with no connections at all there's nothing to wait for */
+		if (context->count == 0) {
+			break;
+		}
+		pthread_cond_wait(&context->cond, &context->lock);
+	}
+	if (!memc && context->idle) {
+		memc = context->spare[--context->idle];
+	}
+	pthread_mutex_unlock(&context->lock);
+
+	if (!memc) {
+		errno = ENOMEM;
+	}
+
+	return memc;
+}
+
+/* keeps the error message, as once released the connection is anyone's */
+static void kvfs_memcache_release(kvfs_memcache_context_t* context, memcached_st* memc, bool failed)
+{
+	pthread_mutex_lock(&context->lock);
+	if (failed) {
+		snprintf(context->message, sizeof context->message, "%s", memcached_last_error_message(memc));
+		context->failed = true;
+	}
+	context->spare[context->idle++] = memc;
+	pthread_cond_signal(&context->cond);
+	pthread_mutex_unlock(&context->lock);
+}
+
 static chunk_t* kvfs_memcache_get(kvfs_store_t* store, const uint8_t* key)
 {
-	char keybuf[chunk_keylength * 2];
+	char keybuf[chunk_hexlength];
 	size_t length;
 	uint32_t flags;
-	uint8_t depth;
 	memcached_return r;
+	kvfs_memcache_context_t* context = store->context;
+
+	memcached_st* memc = kvfs_memcache_acquire(context);
+	if (!memc) {
+		return NULL;
+	}
 
 	chunk_hex_from_key_r(key, keybuf);
-	char* data = memcached_get(store->context,
+	char* data = memcached_get(memc,
 		keybuf, sizeof keybuf,
 		&length, &flags, &r);
+	kvfs_memcache_release(context, memc, r != MEMCACHED_SUCCESS && r != MEMCACHED_NOTFOUND);
 
 	if (r == MEMCACHED_SUCCESS) {
 		if (data) {
-			depth = chunk_depth_from_key(key);
-			return chunk_create(data, length, depth, true, key);
+			/* copy into a pooled chunk, rejecting oversized values up front */
+			chunk_t* chunk = NULL;
+			if (length > chunk_maxlength) {
+				errno = EINVAL;
+			} else if ((chunk = chunk_alloc(store->pool)) != NULL) {
+				memcpy(chunk_buffer(chunk), data, length);
+				chunk = kvfs_store_commit(store, chunk, length, key);
+			}
+			free(data);
+			return chunk;
 		} else {
 			errno = ENOENT;
 		}
@@ -34,33 +115,267 @@ static chunk_t* kvfs_memcache_get(kvfs_store_t* store, const uint8_t* key)
 	return NULL;
 }
 
+/*
+ * asks for every key with a single multi-get, so that the server can
+ * answer them all in one round trip.  the results come back in any
+ * order, and only for the keys that were found.
+ */
+static int kvfs_memcache_get_many(kvfs_store_t* store, const uint8_t* keys, size_t count,
+								  chunk_t** chunks, int* errors)
+{
+	kvfs_memcache_context_t* context = store->context;
+	char (*keybufs)[chunk_hexlength] = malloc(count * sizeof *keybufs);
+	const char** names = malloc(count * sizeof *names);
+	size_t* lengths = malloc(count * sizeof *lengths);
+	uint16_t* sizes = malloc(count * sizeof *sizes);
+	int result = 0;
+
+	for (size_t i = 0; i < count; ++i) {
+		chunks[i] = NULL;
+		errors[i] = ENOMEM;
+	}
+
+	if (!keybufs || !names || !lengths || !sizes) {
+		result = -1;
+		goto cleanup;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		chunk_hex_from_key_r(keys + i * chunk_keylength, keybufs[i]);
+		names[i] = keybufs[i];
+		lengths[i] = chunk_hexlength;
+		errors[i] = ENOENT;
+	}
+
+	memcached_st* memc = kvfs_memcache_acquire(context);
+	if (!memc) {
+		for (size_t i = 0; i < count; ++i) {
+			errors[i] = errno;
+		}
+		result = -1;
+		goto cleanup;
+	}
+
+	memcached_return r = memcached_mget(memc, names, lengths, count);
+	memcached_result_st* item;
+
+	while (r == MEMCACHED_SUCCESS && (item = memcached_fetch_result(memc, NULL, &r)) != NULL) {
+		const char* name = memcached_result_key_value(item);
+		size_t length = memcached_result_length(item);
+
+		/* the same key may have been asked for more than once */
+		for (size_t i = 0; i < count; ++i) {
+			if (chunks[i] || memcached_result_key_length(item) != chunk_hexlength ||
+				memcmp(name, keybufs[i], chunk_hexlength) != 0)
+			{
+				continue;
+			}
+			if (length > chunk_maxlength) {
+				errors[i] = EINVAL;
+			} else if ((chunks[i] = chunk_alloc(store->pool)) != NULL) {
+				memcpy(chunk_buffer(chunks[i]), memcached_result_value(item), length);
+				sizes[i] = length;
+			} else {
+				errors[i] = ENOMEM;
+			}
+		}
+		memcached_result_free(item);
+	}
+
+	bool failed = (r != MEMCACHED_SUCCESS && r != MEMCACHED_END && r != MEMCACHED_NOTFOUND);
+	kvfs_memcache_release(context, memc, failed);
+
+	/* check the keys together once the connection is free for other threads */
+	kvfs_store_commit_many(store, chunks, sizes, keys, count, errors);
+
+	for (size_t i = 0; i < count; ++i) {
+		if (!chunks[i] && failed && errors[i] == ENOENT) {
+			errors[i] = KVFS_DRIVER_ERROR;
+		}
+		if (errors[i]) {
+			result = -1;
+		}
+	}
+
+cleanup:
+	free(sizes);
+	free(lengths);
+	free(names);
+	free(keybufs);
+
+	return result;
+}
+
+/*
+ * sends a set for each chunk without waiting for the replies, then asks
+ * whether the last one is there, which the server can't answer until
+ * it has worked through everything before it on the connection.  the
+ * replies to the sets themselves are dropped, so it's only the last
+ * that's checked, but anything that stops them reaching the server
+ * fails the lot.
+ */
+static int kvfs_memcache_put_many(kvfs_store_t* store, chunk_t* const* chunks, size_t count, int* errors)
+{
+	char keybuf[chunk_hexlength];
+	kvfs_memcache_context_t* context = store->context;
+	memcached_return r = MEMCACHED_SUCCESS;
+	int error = 0;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	memcached_st* memc = kvfs_memcache_acquire(context);
+	if (!memc) {
+		error = errno;
+		goto done;
+	}
+
+	for (size_t i = 0; i < count && (r == MEMCACHED_SUCCESS || r == MEMCACHED_BUFFERED); ++i) {
+		chunk_hex_from_key_r(chunk_key(chunks[i]), keybuf);
+		r = memcached_set(memc,
+			keybuf, sizeof keybuf,
+			chunk_data(chunks[i]), chunk_length(chunks[i]),
+			0, 0);
+	}
+	if (r == MEMCACHED_SUCCESS || r == MEMCACHED_BUFFERED) {
+		r = memcached_flush_buffers(memc);
+	}
+	if (r == MEMCACHED_SUCCESS) {
+		r = memcached_exist(memc, keybuf, sizeof keybuf);
+	}
+	kvfs_memcache_release(context, memc, r != MEMCACHED_SUCCESS);
+
+	if (r != MEMCACHED_SUCCESS) {
+		error = KVFS_DRIVER_ERROR;
+	}
+
+done:
+	for (size_t i = 0; i < count; ++i) {
+		errors[i] = error;
+	}
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
 static int kvfs_memcache_put(kvfs_store_t* store, chunk_t* chunk)
 {
-	char keybuf[chunk_keylength * 2];
+	int error;
 
-	chunk_hex_from_key_r(chunk_key(chunk), keybuf);
-	memcached_return r = memcached_set(store->context,
-		keybuf, sizeof keybuf,
-		chunk_data(chunk), chunk_length(chunk),
-		0, 0);
+	return kvfs_memcache_put_many(store, &chunk, 1, &error);
+}
+
+static int kvfs_memcache_has(kvfs_store_t* store, const uint8_t* key)
+{
+	char keybuf[chunk_hexlength];
+	kvfs_memcache_context_t* context = store->context;
+
+	memcached_st* memc = kvfs_memcache_acquire(context);
+	if (!memc) {
+		return -1;
+	}
+
+	chunk_hex_from_key_r(key, keybuf);
+	memcached_return r = memcached_exist(memc, keybuf, sizeof keybuf);
+	kvfs_memcache_release(context, memc, r != MEMCACHED_SUCCESS && r != MEMCACHED_NOTFOUND);
 
 	if (r == MEMCACHED_SUCCESS) {
+		return 1;
+	} else if (r == MEMCACHED_NOTFOUND) {
 		return 0;
-	}  else {
-		errno = KVFS_DRIVER_ERROR;
 	}
 
+	errno = KVFS_DRIVER_ERROR;
 	return -1;
 }
 
+/*
+ * asks for every key with a single multi-get, as get_many does, but
+ * only looks at which keys come back
+ */
+static int kvfs_memcache_has_many(kvfs_store_t* store, const uint8_t* keys, size_t count, bool* present)
+{
+	kvfs_memcache_context_t* context = store->context;
+	char (*keybufs)[chunk_hexlength] = malloc(count * sizeof *keybufs);
+	const char** names = malloc(count * sizeof *names);
+	size_t* lengths = malloc(count * sizeof *lengths);
+	int result = -1;
+
+	if (!keybufs || !names || !lengths) {
+		goto cleanup;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		chunk_hex_from_key_r(keys + i * chunk_keylength, keybufs[i]);
+		names[i] = keybufs[i];
+		lengths[i] = chunk_hexlength;
+		present[i] = false;
+	}
+
+	memcached_st* memc = kvfs_memcache_acquire(context);
+	if (!memc) {
+		goto cleanup;
+	}
+
+	memcached_return r = memcached_mget(memc, names, lengths, count);
+	memcached_result_st* item;
+
+	while (r == MEMCACHED_SUCCESS && (item = memcached_fetch_result(memc, NULL, &r)) != NULL) {
+		for (size_t i = 0; i < count; ++i) {
+			if (memcached_result_key_length(item) == chunk_hexlength &&
+				memcmp(memcached_result_key_value(item), keybufs[i], chunk_hexlength) == 0)
+			{
+				present[i] = true;
+			}
+		}
+		memcached_result_free(item);
+	}
+
+	bool failed = (r != MEMCACHED_SUCCESS && r != MEMCACHED_END && r != MEMCACHED_NOTFOUND);
+	kvfs_memcache_release(context, memc, failed);
+
+	if (failed) {
+		errno = KVFS_DRIVER_ERROR;
+	} else {
+		result = 0;
+	}
+
+cleanup:
+	free(lengths);
+	free(names);
+	free(keybufs);
+
+	return result;
+}
+
 static void kvfs_memcache_free(kvfs_store_t* store)
 {
-	free(store);
+	if (store->context) {
+		kvfs_memcache_context_t* context = store->context;
+		for (unsigned int i = 0; i < context->count; ++i) {
+			memcached_free(context->conns[i]);
+		}
+		pthread_cond_destroy(&context->cond);
+		pthread_mutex_destroy(&context->lock);
+		free(context);
+	}
+	kvfs_store_release(store);
 }
 
 static const char* kvfs_memcache_error(kvfs_store_t* store)
 {
-	return memcached_last_error_message(store->context);
+	kvfs_memcache_context_t* context = store->context;
+
+	pthread_mutex_lock(&context->lock);
+	bool failed = context->failed;
+	pthread_mutex_unlock(&context->lock);
+
+	return failed ? context->message : memcached_last_error_message(context->memc);
 }
 
 kvfs_store_t* kvfs_create_memcache(memcached_st* memc)
@@ -70,14 +385,29 @@ kvfs_store_t* kvfs_create_memcache(memcached_st* memc)
 		return NULL;
 	}
 
-	kvfs_store_t* store = malloc(sizeof *store);
-	if (!store) {
+	kvfs_memcache_context_t* context = calloc(1, sizeof *context);
+	kvfs_store_t* store = kvfs_store_alloc(context);
+
+	if (!store || !context) {
+		kvfs_store_release(store);
+		free(context);
 		return NULL;
 	}
 
-	store->context = memc;
+	context->memc = memc;
+	pthread_mutex_init(&context->lock, NULL);
+	pthread_cond_init(&context->cond, NULL);
+
+	/* every chunk is a network round trip, so read ahead by default */
+	store->readahead = kvfs_readahead_default;
+	store->put_window = kvfs_put_window_default;
+
 	store->get = kvfs_memcache_get;
 	store->put = kvfs_memcache_put;
+	store->has = kvfs_memcache_has;
+	store->has_many = kvfs_memcache_has_many;
+	store->get_many = kvfs_memcache_get_many;
+	store->put_many = kvfs_memcache_put_many;
 	store->free = kvfs_memcache_free;
 	store->error = kvfs_memcache_error;
 
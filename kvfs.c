@@ -2,8 +2,11 @@
  * kvfs.c
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <assert.h>
 
 #include <kvfs/kvfs.h>
 #include <kvfs/private.h>
@@ -16,20 +19,713 @@ static const char* errors[] = {
 	"unspecified driver error"
 };
 
+enum {
+	kvfs_verifier_queue = 1024
+};
+
+/*
+ * the background verifier for KVFS_VERIFY_DEFERRED holds a reference
+ * to each chunk handed out unverified until it has been re-hashed
+ */
+typedef struct kvfs_verifier_t {
+	kvfs_store_t*		store;
+	pthread_t			thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	chunk_t*			queue[kvfs_verifier_queue];
+	size_t				head;
+	size_t				count;
+	bool				stopping;
+} kvfs_verifier_t;
+
+static void kvfs_verifier_check(kvfs_store_t* store, chunk_t* chunk)
+{
+	if (chunk_verify(chunk)) {
+		atomic_fetch_add(&store->counters.verified, 1);
+		atomic_fetch_add(&store->counters.verified_bytes, chunk_length(chunk));
+	} else {
+		atomic_fetch_add(&store->counters.verify_failures, 1);
+	}
+	chunk_unref(chunk);
+}
+
+static void* kvfs_verifier_run(void* arg)
+{
+	kvfs_verifier_t* verifier = arg;
+
+	pthread_mutex_lock(&verifier->lock);
+	for (;;) {
+		while (verifier->count == 0 && !verifier->stopping) {
+			pthread_cond_wait(&verifier->cond, &verifier->lock);
+		}
+
+		/* drain the queue fully before stopping */
+		if (verifier->count == 0) {
+			break;
+		}
+
+		chunk_t* chunk = verifier->queue[verifier->head];
+		verifier->head = (verifier->head + 1) % kvfs_verifier_queue;
+		verifier->count--;
+
+		pthread_mutex_unlock(&verifier->lock);
+		kvfs_verifier_check(verifier->store, chunk);
+		pthread_mutex_lock(&verifier->lock);
+	}
+	pthread_mutex_unlock(&verifier->lock);
+
+	return NULL;
+}
+
+static kvfs_verifier_t* kvfs_verifier_start(kvfs_store_t* store)
+{
+	kvfs_verifier_t* verifier = calloc(1, sizeof *verifier);
+	if (!verifier) {
+		return NULL;
+	}
+
+	verifier->store = store;
+	pthread_mutex_init(&verifier->lock, NULL);
+	pthread_cond_init(&verifier->cond, NULL);
+
+	if (pthread_create(&verifier->thread, NULL, kvfs_verifier_run, verifier) != 0) {
+		pthread_cond_destroy(&verifier->cond);
+		pthread_mutex_destroy(&verifier->lock);
+		free(verifier);
+		return NULL;
+	}
+
+	return verifier;
+}
+
+static void kvfs_verifier_stop(kvfs_verifier_t* verifier)
+{
+	if (!verifier) {
+		return;
+	}
+
+	pthread_mutex_lock(&verifier->lock);
+	verifier->stopping = true;
+	pthread_cond_signal(&verifier->cond);
+	pthread_mutex_unlock(&verifier->lock);
+
+	pthread_join(verifier->thread, NULL);
+	pthread_cond_destroy(&verifier->cond);
+	pthread_mutex_destroy(&verifier->lock);
+	free(verifier);
+}
+
+/*
+ * queues the chunk for verification, or verifies it immediately
+ * if the verifier has fallen too far behind
+ */
+static void kvfs_verifier_push(kvfs_verifier_t* verifier, chunk_t* chunk)
+{
+	chunk_ref(chunk);
+
+	pthread_mutex_lock(&verifier->lock);
+	if (verifier->count < kvfs_verifier_queue) {
+		verifier->queue[(verifier->head + verifier->count) % kvfs_verifier_queue] = chunk;
+		verifier->count++;
+		chunk = NULL;
+		pthread_cond_signal(&verifier->cond);
+	}
+	pthread_mutex_unlock(&verifier->lock);
+
+	if (chunk) {
+		kvfs_verifier_check(verifier->store, chunk);
+	}
+}
+
+//---------------------------------------------------------------------
+
+/*
+ * allocates a zeroed store with its own chunk pool - for use by
+ * the drivers, which then fill in the function pointers
+ */
+kvfs_store_t* kvfs_store_alloc(void* context)
+{
+	kvfs_store_t* store = calloc(1, sizeof *store);
+	if (!store) {
+		return NULL;
+	}
+
+	store->pool = chunk_pool_create(0);
+	if (!store->pool) {
+		free(store);
+		return NULL;
+	}
+
+	store->context = context;
+	store->workers = kvfs_workers_default;
+	pthread_mutex_init(&store->lock, NULL);
+
+	return store;
+}
+
+/*
+ * the counterpart to kvfs_store_alloc(), called from the driver's
+ * free function once it has released its context
+ */
+void kvfs_store_release(kvfs_store_t* store)
+{
+	if (store) {
+		kvfs_verifier_stop(store->verifier);
+		kvfs_workq_free(store->workq);
+		kvfs_filter_free(atomic_load_explicit(&store->filter, memory_order_relaxed));
+		pthread_mutex_destroy(&store->lock);
+		chunk_pool_free(store->pool);
+		free(store);
+	}
+}
+
+/*
+ * returns the store's thread pool, starting it if necessary
+ */
+kvfs_workq_t* kvfs_store_workq(kvfs_store_t* store)
+{
+	pthread_mutex_lock(&store->lock);
+	if (!store->workq) {
+		store->workq = kvfs_workq_create(store->workers);
+	}
+	kvfs_workq_t* workq = store->workq;
+	pthread_mutex_unlock(&store->lock);
+
+	return workq;
+}
+
+/*
+ * returns the store's filter of keys seen, creating it if necessary
+ */
+static kvfs_filter_t* kvfs_store_filter(kvfs_store_t* store)
+{
+	kvfs_filter_t* filter = atomic_load_explicit(&store->filter, memory_order_acquire);
+	if (filter) {
+		return filter;
+	}
+
+	/* the release pairs with the acquire above, so the filter is seen whole */
+	pthread_mutex_lock(&store->lock);
+	filter = atomic_load_explicit(&store->filter, memory_order_relaxed);
+	if (!filter) {
+		filter = kvfs_filter_create();
+		atomic_store_explicit(&store->filter, filter, memory_order_release);
+	}
+	pthread_mutex_unlock(&store->lock);
+
+	return filter;
+}
+
+/* says whether a fetched chunk of 'depth' should be hashed now */
+static bool kvfs_store_should_verify(kvfs_store_t* store, uint8_t depth)
+{
+	switch (store->verify) {
+		case KVFS_VERIFY_SAMPLED:
+			return atomic_fetch_add(&store->verify_count, 1) % store->verify_rate == 0;
+		case KVFS_VERIFY_INDIRECT:
+			return depth > 0;
+		case KVFS_VERIFY_DEFERRED:
+			return false;
+		default:
+			return true;
+	}
+}
+
+static void kvfs_store_verified(kvfs_store_t* store, chunk_t* chunk, uint16_t length)
+{
+	if (chunk) {
+		atomic_fetch_add(&store->counters.verified, 1);
+		atomic_fetch_add(&store->counters.verified_bytes, length);
+	} else if (errno == KVFS_KEY_NOT_VALID) {
+		atomic_fetch_add(&store->counters.verify_failures, 1);
+	}
+}
+
+/* completes a chunk without hashing it, queueing it for later if deferred */
+static chunk_t* kvfs_store_trust(kvfs_store_t* store, chunk_t* chunk, uint16_t length, const uint8_t* key)
+{
+	chunk = chunk_commit_trusted(chunk, length, key);
+	if (chunk) {
+		atomic_fetch_add(&store->counters.unverified, 1);
+		atomic_fetch_add(&store->counters.unverified_bytes, length);
+		if (store->verifier) {
+			atomic_fetch_add(&store->counters.deferred, 1);
+			kvfs_verifier_push(store->verifier, chunk);
+		}
+	}
+
+	return chunk;
+}
+
+/*
+ * completes a chunk that a driver has read into a pooled buffer,
+ * hashing it or not according to the store's verification policy
+ */
+chunk_t* kvfs_store_commit(kvfs_store_t* store, chunk_t* chunk, uint16_t length, const uint8_t* key)
+{
+	uint8_t depth = chunk_depth_from_key(key);
+
+	if (!kvfs_store_should_verify(store, depth)) {
+		return kvfs_store_trust(store, chunk, length, key);
+	}
+
+	chunk = chunk_commit(chunk, length, depth, key);
+	kvfs_store_verified(store, chunk, length);
+
+	return chunk;
+}
+
+/*
+ * as kvfs_store_commit(), for 'count' chunks fetched together under
+ * consecutive 'keys'.  the chunks to be verified are hashed in batches
+ * of the same depth with chunk_calckey_batch().  NULL chunks are
+ * skipped, and any chunk that fails is free'd and left NULL with its
+ * errno in 'errors'.
+ */
+void kvfs_store_commit_many(kvfs_store_t* store, chunk_t** chunks, const uint16_t* lengths,
+							const uint8_t* keys, size_t count, int* errors)
+{
+	for (size_t base = 0; base < count; base += chunk_maxkeys) {
+		size_t n = count - base < chunk_maxkeys ? count - base : chunk_maxkeys;
+		uint8_t calculated[chunk_maxkeys * chunk_keylength];
+		const uint8_t* data[chunk_maxkeys];
+		uint16_t length[chunk_maxkeys];
+		size_t index[chunk_maxkeys];
+		size_t waiting = 0;
+
+		/* check everything but the hash, which is left for the batch */
+		for (size_t i = base; i < base + n; ++i) {
+			const uint8_t* key = keys + i * chunk_keylength;
+			if (!chunks[i]) {
+				continue;
+			}
+			if (!kvfs_store_should_verify(store, chunk_depth_from_key(key))) {
+				chunks[i] = kvfs_store_trust(store, chunks[i], lengths[i], key);
+			} else if ((chunks[i] = chunk_commit_trusted(chunks[i], lengths[i], key)) != NULL) {
+				index[waiting++] = i;
+			} else {
+				kvfs_store_verified(store, NULL, lengths[i]);
+			}
+			errors[i] = chunks[i] ? 0 : errno;
+		}
+
+		/* then hash the rest a depth at a time */
+		while (waiting) {
+			uint8_t depth = chunk_depth(chunks[index[0]]);
+			size_t batch[chunk_maxkeys];
+			size_t m = 0, left = 0;
+
+			for (size_t j = 0; j < waiting; ++j) {
+				chunk_t* chunk = chunks[index[j]];
+				if (chunk_depth(chunk) == depth) {
+					data[m] = chunk_data(chunk);
+					length[m] = chunk_length(chunk);
+					batch[m++] = index[j];
+				} else {
+					index[left++] = index[j];
+				}
+			}
+			waiting = left;
+
+			chunk_calckey_batch(data, length, depth, calculated, m);
+
+			for (size_t j = 0; j < m; ++j) {
+				size_t i = batch[j];
+				if (!chunk_key_valid(chunks[i], calculated + j * chunk_keylength)) {
+					chunk_free(chunks[i]);
+					chunks[i] = NULL;
+					errno = KVFS_KEY_NOT_VALID;
+				}
+				kvfs_store_verified(store, chunks[i], lengths[i]);
+				errors[i] = chunks[i] ? 0 : errno;
+			}
+		}
+	}
+}
+
+/*
+ * sets how chunks fetched from the store are checked against their
+ * keys.  'rate' is only used by KVFS_VERIFY_SAMPLED, which hashes one
+ * chunk in every 'rate'.  This must not be called while other threads
+ * are using the store.
+ */
+int kvfs_set_verify(kvfs_store_t* store, kvfs_verify_t policy, unsigned int rate)
+{
+	if (!store || policy > KVFS_VERIFY_DEFERRED || (policy == KVFS_VERIFY_SAMPLED && rate == 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (policy == KVFS_VERIFY_DEFERRED && !store->verifier) {
+		store->verifier = kvfs_verifier_start(store);
+		if (!store->verifier) {
+			return -1;
+		}
+	} else if (policy != KVFS_VERIFY_DEFERRED && store->verifier) {
+		kvfs_verifier_stop(store->verifier);
+		store->verifier = NULL;
+	}
+
+	store->verify = policy;
+	store->verify_rate = rate;
+	atomic_store(&store->verify_count, 0);
+
+	return 0;
+}
+
+/*
+ * sets the largest read-ahead window for streams opened on this store
+ * (zero disables read-ahead) and the number of threads that fetch
+ * chunks in the background.  This must not be called while other
+ * threads are using the store.
+ */
+int kvfs_set_readahead(kvfs_store_t* store, unsigned int window, unsigned int threads)
+{
+	if (!store || window > kvfs_readahead_max || (window && threads == 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (threads && threads != store->workers) {
+		kvfs_workq_free(store->workq);
+		store->workq = NULL;
+		store->workers = threads;
+	}
+
+	store->readahead = window;
+
+	return 0;
+}
+
+/*
+ * takes a snapshot of the store's counters
+ */
+void kvfs_stats(kvfs_store_t* store, kvfs_stats_t* stats)
+{
+	kvfs_counters_t* counters = &store->counters;
+
+	stats->gets = atomic_load(&counters->gets);
+	stats->puts = atomic_load(&counters->puts);
+	stats->verified = atomic_load(&counters->verified);
+	stats->verified_bytes = atomic_load(&counters->verified_bytes);
+	stats->unverified = atomic_load(&counters->unverified);
+	stats->unverified_bytes = atomic_load(&counters->unverified_bytes);
+	stats->deferred = atomic_load(&counters->deferred);
+	stats->verify_failures = atomic_load(&counters->verify_failures);
+	stats->readahead = atomic_load(&counters->readahead);
+	stats->skipped = atomic_load(&counters->skipped);
+	stats->skipped_bytes = atomic_load(&counters->skipped_bytes);
+}
+
 chunk_t* kvfs_get(kvfs_store_t* store, const uint8_t* key)
 {
+	atomic_fetch_add(&store->counters.gets, 1);
 	return store->get(store, key);
 }
 
-int kvfs_put(kvfs_store_t* store, chunk_t* chunk)
+/*
+ * fetches 'count' consecutive keys, in a single request if the driver
+ * can.  a chunk that couldn't be fetched is left NULL with its errno
+ * in 'errors', and if there were any the errno of the first is set
+ * and -1 returned.
+ */
+int kvfs_get_many(kvfs_store_t* store, const uint8_t* keys, size_t count, chunk_t** chunks, int* errors)
+{
+	int error = 0;
+
+	if (!store || (count && (!keys || !chunks || !errors))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	atomic_fetch_add(&store->counters.gets, count);
+
+	if (store->get_many) {
+		store->get_many(store, keys, count, chunks, errors);
+	} else if (store->get_raw && count > 1) {
+		uint16_t lengths[chunk_maxkeys];
+		for (size_t base = 0; base < count; base += chunk_maxkeys) {
+			size_t n = count - base < chunk_maxkeys ? count - base : chunk_maxkeys;
+			for (size_t i = 0; i < n; ++i) {
+				chunks[base + i] = store->get_raw(store, keys + (base + i) * chunk_keylength, &lengths[i]);
+				errors[base + i] = chunks[base + i] ? 0 : errno;
+			}
+			kvfs_store_commit_many(store, chunks + base, lengths, keys + base * chunk_keylength, n, errors + base);
+		}
+	} else {
+		for (size_t i = 0; i < count; ++i) {
+			chunks[i] = store->get(store, keys + i * chunk_keylength);
+			errors[i] = chunks[i] ? 0 : errno;
+		}
+	}
+
+	for (size_t i = 0; i < count && !error; ++i) {
+		error = errors[i];
+	}
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+typedef struct kvfs_get_batch_t {
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
+	size_t					remaining;
+} kvfs_get_batch_t;
+
+typedef struct kvfs_get_item_t {
+	kvfs_work_t				work;
+	kvfs_store_t*			store;
+	kvfs_get_batch_t*		batch;
+	const uint8_t*			key;
+	chunk_t*				chunk;
+	uint16_t				length;			// if not yet committed
+	int						error;
+} kvfs_get_item_t;
+
+static void kvfs_get_item_run(kvfs_work_t* work)
+{
+	kvfs_get_item_t* item = (kvfs_get_item_t*)work;
+	kvfs_get_batch_t* batch = item->batch;
+
+	/* if the driver allows, the chunks are verified together afterwards */
+	if (item->store->get_raw) {
+		atomic_fetch_add(&item->store->counters.gets, 1);
+		item->chunk = item->store->get_raw(item->store, item->key, &item->length);
+	} else {
+		item->chunk = kvfs_get(item->store, item->key);
+	}
+	item->error = item->chunk ? 0 : errno;
+
+	pthread_mutex_lock(&batch->lock);
+	if (--batch->remaining == 0) {
+		pthread_cond_signal(&batch->cond);
+	}
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/*
+ * fetches up to chunk_maxkeys consecutive keys at once on the store's
+ * worker threads.  chunks that couldn't be fetched are left NULL, and
+ * if there were any the errno of the first is set and -1 returned.
+ */
+int kvfs_get_parallel(kvfs_store_t* store, const uint8_t* keys, size_t count, chunk_t** chunks)
+{
+	kvfs_get_item_t items[chunk_maxkeys];
+	kvfs_get_batch_t batch;
+	int error = 0;
+
+	assert(count <= chunk_maxkeys);
+
+	/* a driver that can batch them does better than a thread per key */
+	if (count > 1 && store->get_many) {
+		int errors[chunk_maxkeys];
+		return kvfs_get_many(store, keys, count, chunks, errors);
+	}
+
+	kvfs_workq_t* workq = count > 1 ? kvfs_store_workq(store) : NULL;
+	if (!workq) {
+		/* not worth a thread, or there aren't any */
+		for (size_t i = 0; i < count; ++i) {
+			chunks[i] = kvfs_get(store, keys + i * chunk_keylength);
+			if (!chunks[i] && !error) {
+				error = errno;
+			}
+		}
+	} else {
+		pthread_mutex_init(&batch.lock, NULL);
+		pthread_cond_init(&batch.cond, NULL);
+		batch.remaining = count;
+
+		for (size_t i = 0; i < count; ++i) {
+			items[i].work.run = kvfs_get_item_run;
+			items[i].store = store;
+			items[i].batch = &batch;
+			items[i].key = keys + i * chunk_keylength;
+			items[i].length = 0;
+			kvfs_workq_submit(workq, &items[i].work);
+		}
+
+		pthread_mutex_lock(&batch.lock);
+		while (batch.remaining) {
+			pthread_cond_wait(&batch.cond, &batch.lock);
+		}
+		pthread_mutex_unlock(&batch.lock);
+
+		pthread_cond_destroy(&batch.cond);
+		pthread_mutex_destroy(&batch.lock);
+
+		int errors[chunk_maxkeys];
+		uint16_t lengths[chunk_maxkeys];
+		for (size_t i = 0; i < count; ++i) {
+			chunks[i] = items[i].chunk;
+			errors[i] = items[i].error;
+			lengths[i] = items[i].length;
+		}
+
+		if (store->get_raw) {
+			kvfs_store_commit_many(store, chunks, lengths, keys, count, errors);
+		}
+
+		for (size_t i = 0; i < count && !error; ++i) {
+			error = errors[i];
+		}
+	}
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* stores a chunk without making it the store's last key */
+int kvfs_store_put(kvfs_store_t* store, chunk_t* chunk)
 {
+	kvfs_filter_t* filter = atomic_load_explicit(&store->filter, memory_order_acquire);
+
+	atomic_fetch_add(&store->counters.puts, 1);
 	int result = store->put(store, chunk);
+	if (result >= 0 && filter) {
+		kvfs_filter_add(filter, chunk_key(chunk));
+	}
+	return result;
+}
+
+/*
+ * as kvfs_store_put(), but skips chunks that the store already has.
+ * with KVFS_DEDUP_FILTER the store is only asked about chunks that
+ * its filter has seen, and anything else is stored without asking.
+ * a failed check just means that the chunk is stored anyway.
+ */
+int kvfs_store_put_dedup(kvfs_store_t* store, chunk_t* chunk, kvfs_dedup_t dedup)
+{
+	const uint8_t* key = chunk_key(chunk);
+
+	if (dedup != KVFS_DEDUP_NONE && store->has) {
+		kvfs_filter_t* filter = (dedup == KVFS_DEDUP_FILTER) ? kvfs_store_filter(store) : NULL;
+		if ((!filter || kvfs_filter_test(filter, key)) && kvfs_has(store, key) > 0) {
+			atomic_fetch_add(&store->counters.skipped, 1);
+			atomic_fetch_add(&store->counters.skipped_bytes, chunk_length(chunk));
+			return 0;
+		}
+	}
+
+	return kvfs_store_put(store, chunk);
+}
+
+/*
+ * sets 'present' for each of 'count' keys that the store has, asking
+ * for them all at once if the driver can.  fails with ENOTSUP if the
+ * driver can't tell.
+ */
+int kvfs_store_has_many(kvfs_store_t* store, const uint8_t* keys, size_t count, bool* present)
+{
+	if (store->has_many) {
+		if (store->has_many(store, keys, count, present) < 0) {
+			return -1;
+		}
+
+		kvfs_filter_t* filter = atomic_load_explicit(&store->filter, memory_order_acquire);
+		for (size_t i = 0; filter && i < count; ++i) {
+			if (present[i]) {
+				kvfs_filter_add(filter, keys + i * chunk_keylength);
+			}
+		}
+		return 0;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		int r = kvfs_has(store, keys + i * chunk_keylength);
+		if (r < 0) {
+			return -1;
+		}
+		present[i] = (r > 0);
+	}
+
+	return 0;
+}
+
+/*
+ * stores 'count' chunks, in a single request if the driver can, without
+ * changing the store's last key.  each chunk's errno is set in 'errors',
+ * or zero if it was stored, and if any failed the errno of the first is
+ * set and -1 returned.
+ */
+int kvfs_put_many(kvfs_store_t* store, chunk_t* const* chunks, size_t count, int* errors)
+{
+	kvfs_filter_t* filter = store ? atomic_load_explicit(&store->filter, memory_order_acquire) : NULL;
+	int error = 0;
+
+	if (!store || (count && (!chunks || !errors))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	atomic_fetch_add(&store->counters.puts, count);
+
+	if (store->put_many) {
+		store->put_many(store, chunks, count, errors);
+	} else {
+		for (size_t i = 0; i < count; ++i) {
+			errors[i] = store->put(store, chunks[i]) < 0 ? errno : 0;
+		}
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		if (errors[i] == 0 && filter) {
+			kvfs_filter_add(filter, chunk_key(chunks[i]));
+		} else if (errors[i] && !error) {
+			error = errors[i];
+		}
+	}
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+int kvfs_put(kvfs_store_t* store, chunk_t* chunk)
+{
+	int result = kvfs_store_put(store, chunk);
 	if (result >= 0) {
 		memcpy(store->last, chunk_key(chunk), chunk_keylength);
 	}
 	return result;
 }
 
+/*
+ * returns 1 if the store has the chunk for 'key', 0 if it doesn't or
+ * -1 on error.  fails with ENOTSUP if the driver can't tell.
+ */
+int kvfs_has(kvfs_store_t* store, const uint8_t* key)
+{
+	if (!store || !key) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!store->has) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	int result = store->has(store, key);
+	kvfs_filter_t* filter = atomic_load_explicit(&store->filter, memory_order_acquire);
+	if (result > 0 && filter) {
+		kvfs_filter_add(filter, key);
+	}
+	return result;
+}
+
 void kvfs_free(kvfs_store_t* store)
 {
 	store->free(store);
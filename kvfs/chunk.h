@@ -15,16 +15,35 @@ extern "C" {
 
 enum {
 	chunk_keylength = 32,
-	chunk_maxlength = 1024
+	chunk_maxlength = 1024,
+	chunk_maxkeys = chunk_maxlength / chunk_keylength,
+	chunk_hexlength = chunk_keylength * 2,
+	chunk_base32length = (chunk_keylength * 8 + 4) / 5,
+	chunk_base64length = (chunk_keylength * 8 + 5) / 6
 };
 
 typedef struct chunk_t chunk_t;
+typedef struct chunk_pool_t chunk_pool_t;
+
+chunk_pool_t*		chunk_pool_create(size_t limit);
+void				chunk_pool_free(chunk_pool_t* pool);
+
+chunk_t*			chunk_alloc(chunk_pool_t* pool);
+uint8_t*			chunk_buffer(chunk_t* chunk);
+chunk_t*			chunk_commit(chunk_t* chunk, uint16_t length, uint8_t depth, const uint8_t* key);
+chunk_t*			chunk_commit_trusted(chunk_t* chunk, uint16_t length, const uint8_t* key);
 
 chunk_t*			chunk_create(const uint8_t* data, uint16_t length, uint8_t depth, bool owner, const uint8_t* key);
 chunk_t*			chunk_create_copy(const uint8_t* data, uint16_t length, uint8_t depth, const uint8_t* key);
+int					chunk_create_batch(chunk_t** chunks, const uint8_t* const* data, const uint16_t* length,
+									   uint8_t depth, bool owner, const uint8_t* keys, size_t count);
 
 void				chunk_free(chunk_t* chunk);
 
+chunk_t*			chunk_ref(chunk_t* chunk);
+chunk_t*			chunk_keep(chunk_t* chunk, chunk_pool_t* pool);
+void				chunk_unref(chunk_t* chunk);
+
 const uint8_t*		chunk_key(const chunk_t* chunk);
 const uint8_t*		chunk_data(const chunk_t* chunk);
 uint8_t				chunk_depth(const chunk_t* chunk);
@@ -39,7 +58,16 @@ const char*			chunk_hex_from_key(const uint8_t* key);
 uint8_t*			chunk_key_from_hex_r(const char *hex, uint8_t *key);
 char*				chunk_hex_from_key_r(const uint8_t* key, char *hex);
 
+uint8_t*			chunk_key_from_base32_r(const char* text, uint8_t* key);
+char*				chunk_base32_from_key_r(const uint8_t* key, char* text);
+uint8_t*			chunk_key_from_base64_r(const char* text, uint8_t* key);
+char*				chunk_base64_from_key_r(const uint8_t* key, char* text);
+
 bool				chunk_key_valid(const chunk_t* chunk, const uint8_t *key);
+bool				chunk_verify(const chunk_t* chunk);
+
+void				chunk_calckey_batch(const uint8_t* const* data, const uint16_t* length, uint8_t depth,
+										uint8_t* keys, size_t count);
 
 #ifdef __cplusplus
 }
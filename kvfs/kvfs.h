@@ -7,6 +7,8 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <kvfs/chunk.h>
 
 #ifdef __cplusplus
@@ -14,15 +16,109 @@ extern "C" {
 #endif
 
 typedef struct kvfs_store_t kvfs_store_t;
+typedef struct kvfs_iter_t kvfs_iter_t;
+
+typedef enum {
+	KVFS_VERIFY_ALWAYS = 0,			// hash every chunk fetched
+	KVFS_VERIFY_SAMPLED,			// hash one in every 'rate' chunks
+	KVFS_VERIFY_INDIRECT,			// only hash indirection chunks
+	KVFS_VERIFY_DEFERRED			// hash in a background thread
+} kvfs_verify_t;
+
+typedef enum {
+	KVFS_DEDUP_NONE = 0,			// store every chunk
+	KVFS_DEDUP_CHECK,				// ask the store first, every time
+	KVFS_DEDUP_FILTER				// only ask about chunks seen before
+} kvfs_dedup_t;
+
+typedef struct kvfs_stats_t {
+	uint64_t		gets;
+	uint64_t		puts;
+	uint64_t		verified;
+	uint64_t		verified_bytes;
+	uint64_t		unverified;
+	uint64_t		unverified_bytes;
+	uint64_t		deferred;
+	uint64_t		verify_failures;
+	uint64_t		readahead;		// chunks fetched by read-ahead
+	uint64_t		skipped;		// puts avoided because the store had the chunk
+	uint64_t		skipped_bytes;
+} kvfs_stats_t;
+
+typedef struct kvfs_stat_t {
+	uint64_t		size;			// in bytes
+	uint8_t			depth;			// of the root, zero for a single chunk
+	uint64_t		chunks;			// including the indirection chunks
+} kvfs_stat_t;
+
+typedef struct kvfs_range_t {
+	uint64_t		offset;
+	size_t			length;
+	void*			buf;
+	ssize_t			result;			// bytes read, or -1 on error
+} kvfs_range_t;
+
+typedef struct kvfs_read_options_t {
+	int				readahead;		// max window in chunks, 0 for the store's default, -1 for none
+	unsigned int	parallel;		// fetch this many leaves at once, 0 to read them in turn
+} kvfs_read_options_t;
+
+typedef struct kvfs_write_options_t {
+	unsigned int	threads;		// hash on this many threads, 0 to hash in the caller
+	int				window;			// puts in flight, 0 for the store's default, -1 to put in the caller
+	kvfs_dedup_t	dedup;			// skip chunks the store already has
+} kvfs_write_options_t;
+
+typedef struct kvfs_copy_options_t {
+	int				parallel;		// puts in flight, 0 for the destination's default, -1 to put in turn
+} kvfs_copy_options_t;
+
+/* return non-zero to stop the fetch */
+typedef int		(*kvfs_fetch_callback_t)(void* context, const uint8_t* data, size_t length);
+
+/* return non-zero to stop the diff */
+typedef int		(*kvfs_diff_callback_t)(void* context, uint64_t offset, uint64_t length);
 
 chunk_t*		kvfs_get(kvfs_store_t* store, const uint8_t* key);
 int				kvfs_put(kvfs_store_t* store, chunk_t* chunk);
+int				kvfs_has(kvfs_store_t* store, const uint8_t* key);
+int				kvfs_get_many(kvfs_store_t* store, const uint8_t* keys, size_t count,
+							  chunk_t** chunks, int* errors);
+int				kvfs_put_many(kvfs_store_t* store, chunk_t* const* chunks, size_t count, int* errors);
 void			kvfs_free(kvfs_store_t* store);
 const uint8_t*	kvfs_last(kvfs_store_t* store);
 const char*		kvfs_error(kvfs_store_t* store);
 
+int				kvfs_set_verify(kvfs_store_t* store, kvfs_verify_t policy, unsigned int rate);
+void			kvfs_stats(kvfs_store_t* store, kvfs_stats_t* stats);
+int				kvfs_set_readahead(kvfs_store_t* store, unsigned int window, unsigned int threads);
+
 FILE*			kvfs_fopen_read(kvfs_store_t* store, const uint8_t* key);
+FILE*			kvfs_fopen_read_ex(kvfs_store_t* store, const uint8_t* key, const kvfs_read_options_t* options);
 FILE*			kvfs_fopen_write(kvfs_store_t* store);
+FILE*			kvfs_fopen_write_ex(kvfs_store_t* store, const kvfs_write_options_t* options);
+
+int				kvfs_fetch(kvfs_store_t* store, const uint8_t* root, kvfs_fetch_callback_t callback,
+						   void* context, const kvfs_read_options_t* options);
+kvfs_iter_t*	kvfs_iter_open(kvfs_store_t* store, const uint8_t* root, const kvfs_read_options_t* options);
+int				kvfs_iter_next(kvfs_iter_t* iter, const uint8_t** data, size_t* length);
+void			kvfs_iter_close(kvfs_iter_t* iter);
+
+int				kvfs_stat(kvfs_store_t* store, const uint8_t* root, kvfs_stat_t* info);
+ssize_t			kvfs_pread(kvfs_store_t* store, const uint8_t* root, uint64_t offset, void* buf, size_t length);
+int				kvfs_preadv(kvfs_store_t* store, const uint8_t* root, kvfs_range_t* ranges, size_t count);
+
+int				kvfs_put_buffer(kvfs_store_t* store, const void* data, size_t length, uint8_t* root);
+int				kvfs_put_iov(kvfs_store_t* store, const struct iovec* iov, int iovcnt, uint8_t* root);
+int				kvfs_put_fd(kvfs_store_t* store, int fd, uint8_t* root);
+int				kvfs_append(kvfs_store_t* store, const uint8_t* root, const void* data, size_t length,
+							uint8_t* new_root);
+int				kvfs_patch(kvfs_store_t* store, const uint8_t* root, uint64_t offset,
+						   const void* data, size_t length, uint8_t* new_root);
+int				kvfs_diff(kvfs_store_t* store, const uint8_t* a, const uint8_t* b,
+						  kvfs_diff_callback_t callback, void* context);
+int				kvfs_copy(kvfs_store_t* src, kvfs_store_t* dst, const uint8_t* root,
+						  const kvfs_copy_options_t* options);
 
 enum {
 	KVFS_ERRNO_BASE	= 0x1000,
@@ -6,21 +6,171 @@
 #define __kvfs_impl_h
 
 #include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <kvfs/kvfs.h>
 #include <kvfs/chunk.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+enum {
+	kvfs_maxdepth = 10,				// deepest tree whose size fits in 64 bits
+	kvfs_readahead_max = 64,		// largest read-ahead window, in chunks
+	kvfs_readahead_default = 32,	// for drivers with high latency
+	kvfs_workers_default = 4,		// background threads per store
+	kvfs_fetch_default = 32,		// leaves in flight for kvfs_fetch()
+	kvfs_fetch_max = 1024,
+	kvfs_pipeline_max = 64,			// hashing threads per writer
+	kvfs_put_window_max = 64,		// puts in flight per writer
+	kvfs_put_window_default = 16,	// for drivers with high latency
+	kvfs_builder_held = 64,			// indirection chunks a writer holds back
+	kvfs_connections_max = 64		// per store, for drivers with one request per connection
+};
+
+/* work items for the store's thread pool, embedded in the caller's data */
+typedef struct kvfs_work_t {
+	void					(*run)(struct kvfs_work_t* work);
+	struct kvfs_work_t*		next;
+} kvfs_work_t;
+
+typedef struct kvfs_workq_t kvfs_workq_t;
+typedef struct kvfs_prefetch_t kvfs_prefetch_t;
+typedef struct kvfs_fetcher_t kvfs_fetcher_t;
+typedef struct kvfs_pipeline_t kvfs_pipeline_t;
+typedef struct kvfs_putter_t kvfs_putter_t;
+typedef struct kvfs_filter_t kvfs_filter_t;
+
+typedef int		(*kvfs_pipeline_commit_t)(void* context, chunk_t* chunk);
+
+typedef struct kvfs_counters_t {
+	atomic_uint_fast64_t	gets;
+	atomic_uint_fast64_t	puts;
+	atomic_uint_fast64_t	verified;
+	atomic_uint_fast64_t	verified_bytes;
+	atomic_uint_fast64_t	unverified;
+	atomic_uint_fast64_t	unverified_bytes;
+	atomic_uint_fast64_t	deferred;
+	atomic_uint_fast64_t	verify_failures;
+	atomic_uint_fast64_t	readahead;
+	atomic_uint_fast64_t	skipped;
+	atomic_uint_fast64_t	skipped_bytes;
+} kvfs_counters_t;
+
+typedef struct kvfs_verifier_t kvfs_verifier_t;
+
 typedef struct kvfs_store_t {
 	void*			context;
+	chunk_pool_t*	pool;
+	kvfs_verify_t	verify;
+	unsigned int	verify_rate;
+	atomic_uint		verify_count;
+	kvfs_verifier_t* verifier;
+	kvfs_counters_t	counters;
+	pthread_mutex_t	lock;
+	kvfs_workq_t*	workq;			// created on first use
+	unsigned int	workers;
+	unsigned int	readahead;
+	unsigned int	put_window;		// writers' default, 0 to put synchronously
+	kvfs_filter_t* _Atomic filter;	// keys seen, created on first use
 	uint8_t			last[chunk_keylength];
 	chunk_t*		(*get)(struct kvfs_store_t* store, const uint8_t* key);
+	chunk_t*		(*get_raw)(struct kvfs_store_t* store, const uint8_t* key,		// optional, and
+							   uint16_t* length);									// left uncommitted
 	int				(*put)(struct kvfs_store_t* store, chunk_t* chunk);
+	int				(*has)(struct kvfs_store_t* store, const uint8_t* key);			// optional
+	int				(*has_many)(struct kvfs_store_t* store, const uint8_t* keys,	// optional
+								size_t count, bool* present);
+	int				(*get_many)(struct kvfs_store_t* store, const uint8_t* keys,	// optional
+								size_t count, chunk_t** chunks, int* errors);
+	int				(*put_many)(struct kvfs_store_t* store, chunk_t* const* chunks,	// optional
+								size_t count, int* errors);
 	void			(*free)(struct kvfs_store_t* store);
 	const char*		(*error)(struct kvfs_store_t* store);
 } kvfs_store_t;
 
+typedef struct kvfs_cursor_t {
+	kvfs_store_t*		store;
+	kvfs_prefetch_t*	prefetch;
+	uint8_t				depth;						// of the root
+	bool				done;
+	uint8_t				root[chunk_keylength];
+	chunk_t*			chunks[kvfs_maxdepth + 1];	// indirection chunk at each depth
+	uint16_t			next[kvfs_maxdepth + 1];	// offset of the next key in each
+	uint16_t			hinted[kvfs_maxdepth + 1];	// keys before this have been prefetched
+} kvfs_cursor_t;
+
+/* the partly built indirection levels of a tree being written */
+typedef struct kvfs_builder_t {
+	kvfs_store_t*		store;
+	kvfs_putter_t*		putter;									// if storing in the background
+	kvfs_dedup_t		dedup;
+	uint8_t				height;									// levels in use
+	uint16_t			count[kvfs_maxdepth + 1];				// keys waiting at each level
+	uint8_t				keys[kvfs_maxdepth + 1][chunk_maxlength];
+	unsigned int		held;									// chunks awaiting their subtrees
+	chunk_t*			pending[kvfs_builder_held];
+} kvfs_builder_t;
+
+kvfs_store_t*	kvfs_store_alloc(void* context);
+void			kvfs_store_release(kvfs_store_t* store);
+chunk_t*		kvfs_store_commit(kvfs_store_t* store, chunk_t* chunk, uint16_t length, const uint8_t* key);
+void			kvfs_store_commit_many(kvfs_store_t* store, chunk_t** chunks, const uint16_t* lengths,
+									   const uint8_t* keys, size_t count, int* errors);
+int				kvfs_store_put(kvfs_store_t* store, chunk_t* chunk);
+int				kvfs_store_put_dedup(kvfs_store_t* store, chunk_t* chunk, kvfs_dedup_t dedup);
+int				kvfs_store_has_many(kvfs_store_t* store, const uint8_t* keys, size_t count, bool* present);
+kvfs_workq_t*	kvfs_store_workq(kvfs_store_t* store);
+int				kvfs_get_parallel(kvfs_store_t* store, const uint8_t* keys, size_t count, chunk_t** chunks);
+
+kvfs_workq_t*	kvfs_workq_create(unsigned int threads);
+void			kvfs_workq_free(kvfs_workq_t* workq);
+void			kvfs_workq_submit(kvfs_workq_t* workq, kvfs_work_t* work);
+
+kvfs_prefetch_t*
+				kvfs_prefetch_create(kvfs_store_t* store, unsigned int window);
+void			kvfs_prefetch_free(kvfs_prefetch_t* prefetch);
+void			kvfs_prefetch_reset(kvfs_prefetch_t* prefetch);
+size_t			kvfs_prefetch_hint(kvfs_prefetch_t* prefetch, const uint8_t* keys, size_t count);
+chunk_t*		kvfs_prefetch_take(kvfs_prefetch_t* prefetch, const uint8_t* key);
+
+kvfs_fetcher_t*	kvfs_fetcher_create(kvfs_store_t* store, const uint8_t* root, uint64_t offset, unsigned int parallel);
+void			kvfs_fetcher_free(kvfs_fetcher_t* fetcher);
+int				kvfs_fetcher_next(kvfs_fetcher_t* fetcher, const uint8_t** data, size_t* length);
+
+kvfs_pipeline_t*
+				kvfs_pipeline_create(unsigned int threads, kvfs_pipeline_commit_t commit, void* context);
+int				kvfs_pipeline_write(kvfs_pipeline_t* pipeline, const uint8_t* data, size_t length);
+int				kvfs_pipeline_finish(kvfs_pipeline_t* pipeline);
+void			kvfs_pipeline_free(kvfs_pipeline_t* pipeline);
+
+void			kvfs_builder_init(kvfs_builder_t* builder, kvfs_store_t* store,
+								  kvfs_putter_t* putter, kvfs_dedup_t dedup);
+int				kvfs_builder_add(kvfs_builder_t* builder, const uint8_t* key);
+int				kvfs_builder_finish(kvfs_builder_t* builder, uint8_t* root);
+int				kvfs_builder_resume(kvfs_builder_t* builder, const uint8_t* root, uint8_t* tail);
+void			kvfs_builder_free(kvfs_builder_t* builder);
+
+kvfs_putter_t*	kvfs_putter_create(kvfs_store_t* store, unsigned int window, kvfs_dedup_t dedup);
+void			kvfs_putter_free(kvfs_putter_t* putter);
+int				kvfs_putter_put(kvfs_putter_t* putter, chunk_t* chunk);
+int				kvfs_putter_finish(kvfs_putter_t* putter);
+
+kvfs_filter_t*	kvfs_filter_create(void);
+void			kvfs_filter_free(kvfs_filter_t* filter);
+void			kvfs_filter_add(kvfs_filter_t* filter, const uint8_t* key);
+bool			kvfs_filter_test(kvfs_filter_t* filter, const uint8_t* key);
+
+uint64_t		kvfs_span(uint8_t depth);
+int				kvfs_tree_size(kvfs_store_t* store, const uint8_t* key, uint64_t* size);
+
+int				kvfs_cursor_open(kvfs_cursor_t* cursor, kvfs_store_t* store, const uint8_t* root,
+								 uint64_t offset, kvfs_prefetch_t* prefetch, uint64_t* skip);
+int				kvfs_cursor_next(kvfs_cursor_t* cursor, uint8_t* key);
+int				kvfs_cursor_next_leaf(kvfs_cursor_t* cursor, chunk_t** leaf);
+void			kvfs_cursor_close(kvfs_cursor_t* cursor);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,39 @@
+/*
+ * sha256.h
+ */
+
+#ifndef __sha256_h
+#define __sha256_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+	sha256_digestlength = 32,
+	sha256_blocklength = 64
+};
+
+typedef enum {
+	KVFS_SHA256_SCALAR = 0,
+	KVFS_SHA256_AVX2,
+	KVFS_SHA256_SHANI,
+	KVFS_SHA256_LAST
+} kvfs_sha256_impl_t;
+
+void				kvfs_sha256(const uint8_t* data, size_t length, uint8_t* digest);
+void				kvfs_sha256_batch(const uint8_t* const* data, const size_t* length, uint8_t* digests, size_t count);
+
+kvfs_sha256_impl_t	kvfs_sha256_impl(void);
+bool				kvfs_sha256_supported(kvfs_sha256_impl_t impl);
+int					kvfs_sha256_select(kvfs_sha256_impl_t impl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __sha256_h
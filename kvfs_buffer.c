@@ -0,0 +1,514 @@
+/*
+ * kvfs_buffer.c
+ *
+ * stores a file that's already in memory.  every chunk boundary is
+ * known up front, so each level of the tree is hashed and stored by
+ * the store's worker threads at once, working directly on the caller's
+ * memory, before moving on to the level above.
+ *
+ * files read from a descriptor are mapped where possible and stored a
+ * window of leaves at a time in the same way, with a builder making
+ * the levels above, so the memory used doesn't grow with the file.
+ * appending works the same way, starting from a builder loaded with
+ * the existing file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <kvfs/kvfs.h>
+#include <kvfs/chunk.h>
+#include <kvfs/private.h>
+
+enum {
+	kvfs_buffer_job = 256,			// chunks per work item
+	kvfs_buffer_window = 4096		// leaves per window when reading a descriptor
+};
+
+/* one level of the tree, as the chunks' data and the keys to fill in */
+typedef struct kvfs_level_t {
+	const uint8_t*			data;		// contiguous, or
+	const uint8_t* const*	pieces;		// one pointer per chunk
+	uint64_t				length;
+	uint8_t					depth;
+	uint8_t*				keys;
+} kvfs_level_t;
+
+typedef struct kvfs_buffer_batch_t {
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
+	size_t					remaining;
+} kvfs_buffer_batch_t;
+
+typedef struct kvfs_buffer_job_t {
+	kvfs_work_t				work;
+	kvfs_store_t*			store;
+	const kvfs_level_t*		level;
+	kvfs_buffer_batch_t*	batch;
+	size_t					begin;
+	size_t					end;
+	int						error;
+} kvfs_buffer_job_t;
+
+static size_t kvfs_level_count(const kvfs_level_t* level)
+{
+	return (level->length + chunk_maxlength - 1) / chunk_maxlength;
+}
+
+/* hashes and stores chunks [begin, end) of 'level', recording their keys */
+static int kvfs_level_store(kvfs_store_t* store, const kvfs_level_t* level, size_t begin, size_t end)
+{
+	chunk_t* chunks[chunk_maxkeys];
+	const uint8_t* data[chunk_maxkeys];
+	uint16_t lengths[chunk_maxkeys];
+	int errors[chunk_maxkeys];
+
+	for (size_t base = begin; base < end; base += chunk_maxkeys) {
+		size_t count = end - base < chunk_maxkeys ? end - base : chunk_maxkeys;
+
+		for (size_t i = 0; i < count; ++i) {
+			uint64_t offset = (uint64_t)(base + i) * chunk_maxlength;
+			data[i] = level->pieces ? level->pieces[base + i] : level->data + offset;
+			lengths[i] = level->length - offset < chunk_maxlength ? level->length - offset : chunk_maxlength;
+		}
+
+		int r = chunk_create_batch(chunks, data, lengths, level->depth, false, NULL, count);
+		if (r >= 0) {
+			r = kvfs_put_many(store, chunks, count, errors);
+		}
+
+		for (size_t i = 0; i < count; ++i) {
+			if (r >= 0) {
+				memcpy(level->keys + (base + i) * chunk_keylength, chunk_key(chunks[i]), chunk_keylength);
+			}
+			if (chunks[i]) {
+				chunk_free(chunks[i]);
+			}
+		}
+
+		if (r < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void kvfs_level_run(kvfs_work_t* work)
+{
+	kvfs_buffer_job_t* job = (kvfs_buffer_job_t*)work;
+
+	job->error = 0;
+	if (kvfs_level_store(job->store, job->level, job->begin, job->end) < 0) {
+		job->error = errno;
+	}
+
+	kvfs_buffer_batch_t* batch = job->batch;
+	pthread_mutex_lock(&batch->lock);
+	if (--batch->remaining == 0) {
+		pthread_cond_signal(&batch->cond);
+	}
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/*
+ * stores a whole level, split into jobs for the store's workers.  if
+ * several jobs fail, the error reported is from the first in the file.
+ */
+static int kvfs_level_store_parallel(kvfs_store_t* store, const kvfs_level_t* level)
+{
+	kvfs_buffer_batch_t batch;
+	size_t count = kvfs_level_count(level);
+	size_t jobs = (count + kvfs_buffer_job - 1) / kvfs_buffer_job;
+
+	kvfs_workq_t* workq = jobs > 1 ? kvfs_store_workq(store) : NULL;
+	if (!workq) {
+		return kvfs_level_store(store, level, 0, count);
+	}
+
+	kvfs_buffer_job_t* job = calloc(jobs, sizeof *job);
+	if (!job) {
+		return -1;
+	}
+
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+	batch.remaining = jobs;
+
+	for (size_t i = 0; i < jobs; ++i) {
+		job[i].work.run = kvfs_level_run;
+		job[i].store = store;
+		job[i].level = level;
+		job[i].batch = &batch;
+		job[i].begin = i * kvfs_buffer_job;
+		job[i].end = (i + 1) * kvfs_buffer_job < count ? (i + 1) * kvfs_buffer_job : count;
+		kvfs_workq_submit(workq, &job[i].work);
+	}
+
+	pthread_mutex_lock(&batch.lock);
+	while (batch.remaining) {
+		pthread_cond_wait(&batch.cond, &batch.lock);
+	}
+	pthread_mutex_unlock(&batch.lock);
+
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.lock);
+
+	int error = 0;
+	for (size_t i = 0; !error && i < jobs; ++i) {
+		error = job[i].error;
+	}
+	free(job);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * stores the leaves described by 'level' and then every level above
+ * them, until there's a single key left for the root
+ */
+static int kvfs_levels_store(kvfs_store_t* store, kvfs_level_t level, uint8_t* root)
+{
+	uint8_t* below = NULL;
+
+	for (;;) {
+		size_t count = kvfs_level_count(&level);
+
+		level.keys = malloc(count * chunk_keylength);
+		if (!level.keys || kvfs_level_store_parallel(store, &level) < 0) {
+			break;
+		}
+
+		free(below);
+		below = level.keys;
+
+		if (count == 1) {
+			memcpy(root, level.keys, chunk_keylength);
+			free(below);
+			return 0;
+		}
+
+		if (level.depth == kvfs_maxdepth) {
+			errno = EFBIG;
+			break;
+		}
+
+		level.data = level.keys;
+		level.pieces = NULL;
+		level.length = (uint64_t)count * chunk_keylength;
+		level.depth++;
+	}
+
+	if (level.keys != below) {
+		free(level.keys);
+	}
+	free(below);
+
+	return -1;
+}
+
+//---------------------------------------------------------------------
+
+/*
+ * stores the 'length' bytes at 'data' as a file and copies its key to
+ * 'root', leaving the store's last key alone.  the data must not change
+ * until this returns.
+ */
+int kvfs_put_buffer(kvfs_store_t* store, const void* data, size_t length, uint8_t* root)
+{
+	if (!store || !data || length == 0 || !root) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	kvfs_level_t level = {
+		.data = data,
+		.length = length
+	};
+
+	return kvfs_levels_store(store, level, root);
+}
+
+/*
+ * as kvfs_put_buffer(), for a file gathered from 'iovcnt' buffers.  only
+ * the chunks that straddle two buffers are copied.
+ */
+int kvfs_put_iov(kvfs_store_t* store, const struct iovec* iov, int iovcnt, uint8_t* root)
+{
+	uint64_t length = 0;
+
+	if (!store || !iov || iovcnt <= 0 || !root) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (int i = 0; i < iovcnt; ++i) {
+		length += iov[i].iov_len;
+	}
+
+	if (length == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (iovcnt == 1) {
+		return kvfs_put_buffer(store, iov[0].iov_base, iov[0].iov_len, root);
+	}
+
+	size_t count = (length + chunk_maxlength - 1) / chunk_maxlength;
+	const uint8_t** pieces = malloc(count * sizeof *pieces);
+	uint8_t* bounce = malloc((size_t)(iovcnt - 1) * chunk_maxlength);
+	uint8_t* next = bounce;
+	int r = -1;
+
+	if (!pieces || !bounce) {
+		goto cleanup;
+	}
+
+	int segment = 0;
+	size_t offset = 0;					// within the current buffer
+
+	for (size_t i = 0; i < count; ++i) {
+		uint64_t remaining = length - (uint64_t)i * chunk_maxlength;
+		size_t want = remaining < chunk_maxlength ? remaining : chunk_maxlength;
+
+		while (offset == iov[segment].iov_len) {
+			segment++;
+			offset = 0;
+		}
+
+		if (iov[segment].iov_len - offset >= want) {
+			pieces[i] = (const uint8_t*)iov[segment].iov_base + offset;
+			offset += want;
+			continue;
+		}
+
+		/* gather a chunk that straddles buffers */
+		for (size_t have = 0; have < want; ) {
+			while (offset == iov[segment].iov_len) {
+				segment++;
+				offset = 0;
+			}
+			size_t n = iov[segment].iov_len - offset < want - have ? iov[segment].iov_len - offset : want - have;
+			memcpy(next + have, (const uint8_t*)iov[segment].iov_base + offset, n);
+			offset += n;
+			have += n;
+		}
+		pieces[i] = next;
+		next += chunk_maxlength;
+	}
+
+	kvfs_level_t level = {
+		.pieces = pieces,
+		.length = length
+	};
+
+	r = kvfs_levels_store(store, level, root);
+
+cleanup:
+	free(bounce);
+	free(pieces);
+	return r;
+}
+
+//---------------------------------------------------------------------
+
+/* stores a window of leaves and passes their keys on to 'builder' */
+static int kvfs_window_store(kvfs_store_t* store, kvfs_builder_t* builder,
+							 const uint8_t* data, size_t length, uint8_t* keys)
+{
+	kvfs_level_t level = {
+		.data = data,
+		.length = length,
+		.keys = keys
+	};
+
+	if (kvfs_level_store_parallel(store, &level) < 0) {
+		return -1;
+	}
+
+	for (size_t i = 0, count = kvfs_level_count(&level); i < count; ++i) {
+		if (kvfs_builder_add(builder, keys + i * chunk_keylength) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int kvfs_put_mapped(kvfs_store_t* store, kvfs_builder_t* builder,
+						   const uint8_t* data, size_t length, uint8_t* keys)
+{
+	const size_t window = kvfs_buffer_window * chunk_maxlength;
+
+	for (size_t offset = 0; offset < length; offset += window) {
+		size_t n = length - offset < window ? length - offset : window;
+		if (kvfs_window_store(store, builder, data + offset, n, keys) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * reads a window at a time until the end of the file, using pread()
+ * on files that can seek, so that the whole file is stored
+ */
+static int kvfs_put_read(kvfs_store_t* store, kvfs_builder_t* builder, int fd, bool seekable,
+						 uint8_t* buffer, uint8_t* keys)
+{
+	const size_t window = kvfs_buffer_window * chunk_maxlength;
+	off_t position = 0;
+
+	for (;;) {
+		size_t have = 0;
+
+		while (have < window) {
+			ssize_t n = seekable ? pread(fd, buffer + have, window - have, position)
+								 : read(fd, buffer + have, window - have);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			} else if (n < 0) {
+				return -1;
+			} else if (n == 0) {
+				break;
+			}
+			have += n;
+			position += n;
+		}
+
+		if (have && kvfs_window_store(store, builder, buffer, have, keys) < 0) {
+			return -1;
+		}
+
+		if (have < window) {
+			return 0;
+		}
+	}
+}
+
+/*
+ * stores the file open on 'fd' and copies its key to 'root', leaving
+ * the store's last key alone.  regular files are stored in full,
+ * whatever the descriptor's offset, while pipes and the like are read
+ * from where they are until the end.
+ */
+int kvfs_put_fd(kvfs_store_t* store, int fd, uint8_t* root)
+{
+	kvfs_builder_t builder;
+	struct stat st;
+	int r = -1;
+
+	if (!store || fd < 0 || !root) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		return -1;
+	}
+
+	uint8_t* keys = malloc(kvfs_buffer_window * chunk_keylength);
+	if (!keys) {
+		return -1;
+	}
+
+	kvfs_builder_init(&builder, store, NULL, KVFS_DEDUP_NONE);
+
+	bool regular = S_ISREG(st.st_mode);
+	void* map = MAP_FAILED;
+	if (regular && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+
+	if (map != MAP_FAILED) {
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		r = kvfs_put_mapped(store, &builder, map, st.st_size, keys);
+		munmap(map, st.st_size);
+	} else {
+		uint8_t* buffer = malloc(kvfs_buffer_window * chunk_maxlength);
+		if (buffer) {
+			r = kvfs_put_read(store, &builder, fd, regular, buffer, keys);
+			free(buffer);
+		}
+	}
+
+	if (r == 0) {
+		r = kvfs_builder_finish(&builder, root);
+		if (r == 0) {
+			/* an empty file has no chunks, so no key */
+			errno = EINVAL;
+			r = -1;
+		}
+	}
+
+	free(keys);
+
+	return (r < 0) ? -1 : 0;
+}
+
+//---------------------------------------------------------------------
+
+/*
+ * appends 'length' bytes to the file under 'root', copying the new
+ * file's key to 'new_root'.  only the chunks down the right hand side
+ * of the old tree are fetched and replaced, and every complete subtree
+ * to their left is reused as it is.
+ */
+int kvfs_append(kvfs_store_t* store, const uint8_t* root, const void* data, size_t length, uint8_t* new_root)
+{
+	kvfs_builder_t builder;
+	uint8_t tail[chunk_maxlength];
+
+	if (!store || !root || (length && !data) || !new_root) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (length == 0) {
+		memmove(new_root, root, chunk_keylength);
+		return 0;
+	}
+
+	uint8_t* keys = malloc(kvfs_buffer_window * chunk_keylength);
+	if (!keys) {
+		return -1;
+	}
+
+	kvfs_builder_init(&builder, store, NULL, KVFS_DEDUP_NONE);
+
+	int r = kvfs_builder_resume(&builder, root, tail);
+	size_t used = 0;
+
+	/* the old last leaf is topped up from the start of the new data */
+	if (r > 0) {
+		size_t have = r;
+		used = chunk_maxlength - have < length ? chunk_maxlength - have : length;
+		memcpy(tail + have, data, used);
+		r = kvfs_window_store(store, &builder, tail, have + used, keys);
+	}
+
+	if (r >= 0) {
+		r = kvfs_put_mapped(store, &builder, (const uint8_t*)data + used, length - used, keys);
+	}
+
+	if (r == 0 && kvfs_builder_finish(&builder, new_root) < 0) {
+		r = -1;
+	}
+
+	free(keys);
+
+	return r;
+}
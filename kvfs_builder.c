@@ -0,0 +1,238 @@
+/*
+ * kvfs_builder.c
+ *
+ * builds the indirection levels of a tree as keys arrive.  each level
+ * holds at most one chunk's worth of keys, and a full level is stored
+ * and passed up straight away, so the memory used is bounded by the
+ * depth of the tree rather than the size of the file.
+ *
+ * a chunk must never be stored before everything under it, or a store
+ * could end up with a parent whose subtree is missing, which
+ * kvfs_copy() would then take to be complete.  when the chunks are
+ * stored in the background, the indirection chunks are held back and
+ * queued a level at a time, each level once everything below it has
+ * been stored.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include <kvfs/kvfs.h>
+#include <kvfs/chunk.h>
+#include <kvfs/private.h>
+
+/*
+ * 'putter' may be NULL, to store each chunk before carrying on.  if
+ * not, it takes care of any deduplication itself.
+ */
+void kvfs_builder_init(kvfs_builder_t* builder, kvfs_store_t* store,
+					   kvfs_putter_t* putter, kvfs_dedup_t dedup)
+{
+	builder->store = store;
+	builder->putter = putter;
+	builder->dedup = dedup;
+	builder->height = 0;
+	builder->held = 0;
+	memset(builder->count, 0, sizeof builder->count);
+}
+
+/*
+ * queues the indirection chunks held back so far, lowest level first,
+ * waiting for every put before each level to finish
+ */
+static int kvfs_builder_release(kvfs_builder_t* builder)
+{
+	int r = 0;
+
+	for (uint8_t depth = 1; r == 0 && depth <= builder->height; ++depth) {
+		r = kvfs_putter_finish(builder->putter);
+		for (unsigned int i = 0; r == 0 && i < builder->held; ++i) {
+			if (chunk_depth(builder->pending[i]) == depth) {
+				r = kvfs_putter_put(builder->putter, builder->pending[i]);
+			}
+		}
+	}
+
+	kvfs_builder_free(builder);
+
+	return r;
+}
+
+/* holds back an indirection chunk until everything under it is stored */
+static int kvfs_builder_hold(kvfs_builder_t* builder, uint8_t level, uint8_t* key)
+{
+	uint16_t length = builder->count[level] * chunk_keylength;
+	chunk_t* chunk = chunk_create_copy(builder->keys[level], length, level + 1, NULL);
+	if (!chunk) {
+		return -1;
+	}
+
+	memcpy(key, chunk_key(chunk), chunk_keylength);
+	builder->pending[builder->held++] = chunk;
+
+	return (builder->held == kvfs_builder_held) ? kvfs_builder_release(builder) : 0;
+}
+
+/* stores the keys waiting at 'level' as one chunk and passes its key up */
+static int kvfs_builder_flush(kvfs_builder_t* builder, uint8_t level)
+{
+	uint8_t key[chunk_keylength];
+
+	if (level >= kvfs_maxdepth) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (builder->putter) {
+		if (kvfs_builder_hold(builder, level, key) < 0) {
+			return -1;
+		}
+	} else {
+		uint16_t length = builder->count[level] * chunk_keylength;
+		chunk_t* chunk = chunk_create(builder->keys[level], length, level + 1, false, NULL);
+		if (!chunk) {
+			return -1;
+		}
+
+		int r = kvfs_store_put_dedup(builder->store, chunk, builder->dedup);
+		memcpy(key, chunk_key(chunk), chunk_keylength);
+		chunk_free(chunk);
+
+		if (r < 0) {
+			return -1;
+		}
+	}
+
+	builder->count[level] = 0;
+
+	return kvfs_builder_add(builder, key);
+}
+
+/*
+ * adds the key of a chunk that has already been stored.  the key's
+ * depth says which level it belongs to, and keys must arrive in file
+ * order with every subtree but the last one complete.
+ */
+int kvfs_builder_add(kvfs_builder_t* builder, const uint8_t* key)
+{
+	uint8_t level = chunk_depth_from_key(key);
+
+	if (level > kvfs_maxdepth) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	/* a previous flush of this level failed, so try it again */
+	if (builder->count[level] == chunk_maxkeys && kvfs_builder_flush(builder, level) < 0) {
+		return -1;
+	}
+
+	memcpy(builder->keys[level] + builder->count[level] * chunk_keylength, key, chunk_keylength);
+	builder->count[level]++;
+
+	if (level >= builder->height) {
+		builder->height = level + 1;
+	}
+
+	if (builder->count[level] == chunk_maxkeys) {
+		return kvfs_builder_flush(builder, level);
+	}
+
+	return 0;
+}
+
+/*
+ * stores whatever is left at each level, bottom up, until a single key
+ * remains at the top, which is copied to 'root'.  returns 0 if no keys
+ * were ever added, in which case there's no root, or 1 otherwise.
+ */
+int kvfs_builder_finish(kvfs_builder_t* builder, uint8_t* root)
+{
+	if (builder->height == 0) {
+		return 0;
+	}
+
+	for (uint8_t level = 0; ; ++level) {
+		if (builder->count[level] == 0) {
+			continue;
+		}
+
+		/* a lone key with nothing above it is the root */
+		if (level == builder->height - 1 && builder->count[level] == 1) {
+			if (builder->putter && kvfs_builder_release(builder) < 0) {
+				return -1;
+			}
+			memcpy(root, builder->keys[level], chunk_keylength);
+			builder->count[level] = 0;
+			builder->height = 0;
+			return 1;
+		}
+
+		if (kvfs_builder_flush(builder, level) < 0) {
+			return -1;
+		}
+	}
+}
+
+/*
+ * loads an empty builder with the file under 'root', as though it had
+ * just been written except for its last leaf, so that more data can be
+ * added after it.  every key but the last in each chunk down the right
+ * hand side is a complete subtree that can be reused as it stands.
+ * the last leaf's data is copied to 'tail' and its length returned,
+ * unless it's full, in which case it's reused too and 0 is returned.
+ */
+int kvfs_builder_resume(kvfs_builder_t* builder, const uint8_t* root, uint8_t* tail)
+{
+	uint8_t key[chunk_keylength];
+	memcpy(key, root, chunk_keylength);
+
+	for (;;) {
+		uint8_t depth = chunk_depth_from_key(key);
+		if (depth > kvfs_maxdepth) {
+			errno = EFBIG;
+			return -1;
+		}
+
+		/* a full last leaf can stay as it is, without fetching it */
+		if (depth == 0 && chunk_length_from_key(key) == chunk_maxlength) {
+			return kvfs_builder_add(builder, key);
+		}
+
+		chunk_t* chunk = kvfs_get(builder->store, key);
+		if (!chunk) {
+			return -1;
+		}
+
+		const uint8_t* data = chunk_data(chunk);
+		uint16_t length = chunk_length(chunk);
+
+		if (depth == 0) {
+			memcpy(tail, data, length);
+			chunk_free(chunk);
+			return length;
+		}
+
+		int r = 0;
+		for (uint16_t offset = 0; r == 0 && offset + chunk_keylength < length; offset += chunk_keylength) {
+			r = kvfs_builder_add(builder, data + offset);
+		}
+		memcpy(key, data + length - chunk_keylength, chunk_keylength);
+		chunk_free(chunk);
+
+		if (r < 0) {
+			return -1;
+		}
+	}
+}
+
+/*
+ * drops any indirection chunks still held back, e.g. after a failure
+ */
+void kvfs_builder_free(kvfs_builder_t* builder)
+{
+	for (unsigned int i = 0; i < builder->held; ++i) {
+		chunk_free(builder->pending[i]);
+	}
+	builder->held = 0;
+}
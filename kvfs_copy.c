@@ -0,0 +1,168 @@
+/*
+ * kvfs_copy.c
+ *
+ * copies a file's tree from one store to another as it stands, chunk
+ * by chunk, without reading the data back out or hashing it again.
+ *
+ * the tree is walked from the root down and the destination is asked
+ * about each chunk's children before they're fetched, so any subtree
+ * it already has is skipped as a whole.  that only works if having a
+ * chunk means having everything under it, so an indirection chunk is
+ * never stored until all of its subtree has been.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <kvfs/kvfs.h>
+#include <kvfs/chunk.h>
+#include <kvfs/private.h>
+
+enum {
+	kvfs_copy_pending = 256			// indirection chunks held back at once
+};
+
+typedef struct kvfs_copy_t {
+	kvfs_store_t*			src;
+	kvfs_store_t*			dst;
+	kvfs_putter_t*			putter;			// if storing in the background
+	size_t					count;
+	chunk_t*				pending[kvfs_copy_pending];
+} kvfs_copy_t;
+
+/*
+ * stores the indirection chunks held back so far, once every put
+ * queued before them has finished.  they're in the order their
+ * subtrees were finished, so each is stored after those under it.
+ */
+static int kvfs_copy_flush(kvfs_copy_t* copy)
+{
+	int r = copy->putter ? kvfs_putter_finish(copy->putter) : 0;
+
+	for (size_t i = 0; i < copy->count; ++i) {
+		if (r == 0 && kvfs_store_put(copy->dst, copy->pending[i]) < 0) {
+			r = -1;
+		}
+		chunk_free(copy->pending[i]);
+	}
+	copy->count = 0;
+
+	return r;
+}
+
+/*
+ * copies the subtree under 'chunk', which the destination doesn't have,
+ * and frees 'chunk'.  leaves are stored straight away, but 'chunk' is
+ * held back if it's an indirection chunk.
+ */
+static int kvfs_copy_tree(kvfs_copy_t* copy, chunk_t* chunk)
+{
+	uint8_t missing[chunk_maxlength];
+	chunk_t* children[chunk_maxkeys];
+	bool present[chunk_maxkeys];
+	int errors[chunk_maxkeys];
+	size_t n = 0;
+
+	if (chunk_depth(chunk) == 0) {
+		int r = copy->putter ? kvfs_putter_put(copy->putter, chunk)
+							 : kvfs_store_put(copy->dst, chunk);
+		chunk_free(chunk);
+		return r;
+	}
+
+	const uint8_t* keys = chunk_data(chunk);
+	size_t count = chunk_length(chunk) / chunk_keylength;
+
+	/* if the destination can't say, copy the lot */
+	if (kvfs_store_has_many(copy->dst, keys, count, present) < 0) {
+		memset(present, 0, sizeof present);
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		if (!present[i]) {
+			memcpy(missing + n++ * chunk_keylength, keys + i * chunk_keylength, chunk_keylength);
+		}
+	}
+
+	int r = kvfs_get_parallel(copy->src, missing, n, children);
+
+	/* without a putter, missing leaves are stored as one batch */
+	bool batched = (chunk_depth(chunk) == 1 && !copy->putter);
+	if (r == 0 && batched) {
+		r = kvfs_put_many(copy->dst, children, n, errors);
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		if (r == 0 && !batched) {
+			r = kvfs_copy_tree(copy, children[i]);
+		} else if (children[i]) {
+			chunk_free(children[i]);
+		}
+	}
+
+	if (r == 0 && copy->count == kvfs_copy_pending) {
+		r = kvfs_copy_flush(copy);
+	}
+
+	if (r < 0) {
+		chunk_free(chunk);
+		return -1;
+	}
+
+	copy->pending[copy->count++] = chunk;
+
+	return 0;
+}
+
+/*
+ * copies the file under 'root' from 'src' to 'dst', skipping any part
+ * of it that 'dst' already has.  the chunks are copied as they are,
+ * so the file has the same key in both stores.  'dst's last key is
+ * left alone.
+ */
+int kvfs_copy(kvfs_store_t* src, kvfs_store_t* dst, const uint8_t* root, const kvfs_copy_options_t* options)
+{
+	kvfs_copy_t copy = {
+		.src = src,
+		.dst = dst
+	};
+
+	if (!src || !dst || !root || (options && options->parallel > kvfs_put_window_max)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (kvfs_has(dst, root) > 0) {
+		return 0;
+	}
+
+	chunk_t* chunk = kvfs_get(src, root);
+	if (!chunk) {
+		return -1;
+	}
+
+	int window = (options && options->parallel) ? options->parallel : (int)dst->put_window;
+	if (window > 0) {
+		copy.putter = kvfs_putter_create(dst, window, KVFS_DEDUP_NONE);
+		if (!copy.putter) {
+			chunk_free(chunk);
+			return -1;
+		}
+	}
+
+	int r = kvfs_copy_tree(&copy, chunk);
+
+	if (r == 0) {
+		r = kvfs_copy_flush(&copy);
+	} else {
+		/* nothing held back can be stored now, as its subtree is incomplete */
+		for (size_t i = 0; i < copy.count; ++i) {
+			chunk_free(copy.pending[i]);
+		}
+	}
+
+	kvfs_putter_free(copy.putter);
+
+	return r;
+}
@@ -0,0 +1,264 @@
+/*
+ * kvfs_fetch.c
+ *
+ * fetches the leaves of a tree in parallel on the store's worker
+ * threads and hands them back in file order.
+ *
+ * leaves are issued strictly left to right into a ring of 'parallel'
+ * slots and the work queue is FIFO, so the leftmost outstanding leaf
+ * is always the next to be fetched and the first bytes arrive after
+ * a single round trip.  a slot is only reused once its chunk has been
+ * delivered, which bounds the memory held in the reorder buffer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <kvfs/kvfs.h>
+#include <kvfs/chunk.h>
+#include <kvfs/private.h>
+
+enum {
+	kvfs_fetch_spine = 4			// read-ahead for the indirection chunks
+};
+
+typedef struct kvfs_fetch_slot_t {
+	kvfs_work_t					work;
+	struct kvfs_fetcher_t*		fetcher;
+	bool						done;
+	int							error;
+	chunk_t*					chunk;
+	uint8_t						key[chunk_keylength];
+} kvfs_fetch_slot_t;
+
+struct kvfs_fetcher_t {
+	kvfs_store_t*				store;
+	kvfs_workq_t*				workq;
+	kvfs_prefetch_t*			prefetch;
+	kvfs_cursor_t				cursor;
+	pthread_mutex_t				lock;
+	pthread_cond_t				cond;
+	uint64_t					head;			// next slot to deliver
+	uint64_t					tail;			// next slot to issue
+	uint64_t					skip;			// into the first leaf
+	bool						exhausted;
+	int							error;			// from the cursor, once it's reached
+	unsigned int				busy;
+	chunk_t*					current;		// delivered, until the next call
+	unsigned int				size;
+	kvfs_fetch_slot_t			slots[];
+};
+
+static void kvfs_fetcher_run(kvfs_work_t* work)
+{
+	kvfs_fetch_slot_t* slot = (kvfs_fetch_slot_t*)work;
+	kvfs_fetcher_t* fetcher = slot->fetcher;
+
+	chunk_t* chunk = kvfs_get(fetcher->store, slot->key);
+	int error = chunk ? 0 : errno;
+
+	pthread_mutex_lock(&fetcher->lock);
+	slot->chunk = chunk;
+	slot->error = error;
+	slot->done = true;
+	fetcher->busy--;
+	pthread_cond_broadcast(&fetcher->cond);
+	pthread_mutex_unlock(&fetcher->lock);
+}
+
+/* issues leaves until the ring is full or the tree runs out */
+static void kvfs_fetcher_fill(kvfs_fetcher_t* fetcher)
+{
+	while (!fetcher->exhausted && fetcher->tail - fetcher->head < fetcher->size) {
+		kvfs_fetch_slot_t* slot = &fetcher->slots[fetcher->tail % fetcher->size];
+
+		int r = kvfs_cursor_next(&fetcher->cursor, slot->key);
+		if (r <= 0) {
+			fetcher->error = (r < 0) ? errno : 0;
+			fetcher->exhausted = true;
+			break;
+		}
+
+		slot->done = false;
+		slot->chunk = NULL;
+
+		pthread_mutex_lock(&fetcher->lock);
+		fetcher->busy++;
+		pthread_mutex_unlock(&fetcher->lock);
+
+		kvfs_workq_submit(fetcher->workq, &slot->work);
+		fetcher->tail++;
+	}
+}
+
+/*
+ * starts fetching the file under 'root' from 'offset' onwards, with
+ * up to 'parallel' leaves in flight at once
+ */
+kvfs_fetcher_t* kvfs_fetcher_create(kvfs_store_t* store, const uint8_t* root, uint64_t offset, unsigned int parallel)
+{
+	if (parallel == 0 || parallel > kvfs_fetch_max) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	kvfs_workq_t* workq = kvfs_store_workq(store);
+	if (!workq) {
+		return NULL;
+	}
+
+	kvfs_fetcher_t* fetcher = calloc(1, sizeof *fetcher + parallel * sizeof(kvfs_fetch_slot_t));
+	if (!fetcher) {
+		return NULL;
+	}
+
+	fetcher->store = store;
+	fetcher->workq = workq;
+	fetcher->size = parallel;
+	pthread_mutex_init(&fetcher->lock, NULL);
+	pthread_cond_init(&fetcher->cond, NULL);
+
+	for (unsigned int i = 0; i < parallel; ++i) {
+		fetcher->slots[i].fetcher = fetcher;
+		fetcher->slots[i].work.run = kvfs_fetcher_run;
+	}
+
+	fetcher->prefetch = kvfs_prefetch_create(store, kvfs_fetch_spine);
+	if (!fetcher->prefetch ||
+		kvfs_cursor_open(&fetcher->cursor, store, root, offset, fetcher->prefetch, &fetcher->skip) < 0)
+	{
+		kvfs_fetcher_free(fetcher);
+		return NULL;
+	}
+
+	kvfs_fetcher_fill(fetcher);
+
+	return fetcher;
+}
+
+/*
+ * waits for anything still in flight and releases it all
+ */
+void kvfs_fetcher_free(kvfs_fetcher_t* fetcher)
+{
+	if (!fetcher) {
+		return;
+	}
+
+	pthread_mutex_lock(&fetcher->lock);
+	while (fetcher->busy) {
+		pthread_cond_wait(&fetcher->cond, &fetcher->lock);
+	}
+	pthread_mutex_unlock(&fetcher->lock);
+
+	for (uint64_t i = fetcher->head; i < fetcher->tail; ++i) {
+		kvfs_fetch_slot_t* slot = &fetcher->slots[i % fetcher->size];
+		if (slot->chunk) {
+			chunk_free(slot->chunk);
+		}
+	}
+
+	if (fetcher->current) {
+		chunk_free(fetcher->current);
+	}
+
+	kvfs_cursor_close(&fetcher->cursor);
+	kvfs_prefetch_free(fetcher->prefetch);
+	pthread_cond_destroy(&fetcher->cond);
+	pthread_mutex_destroy(&fetcher->lock);
+	free(fetcher);
+}
+
+/*
+ * returns the next piece of the file in order, which remains valid
+ * until the next call.  returns 1 for data, 0 at the end of the file
+ * and -1 on error.
+ */
+int kvfs_fetcher_next(kvfs_fetcher_t* fetcher, const uint8_t** data, size_t* length)
+{
+	do {
+		if (fetcher->current) {
+			chunk_free(fetcher->current);
+			fetcher->current = NULL;
+		}
+
+		kvfs_fetcher_fill(fetcher);
+
+		if (fetcher->head == fetcher->tail) {
+			if (fetcher->error) {
+				errno = fetcher->error;
+				return -1;
+			}
+			return 0;
+		}
+
+		kvfs_fetch_slot_t* slot = &fetcher->slots[fetcher->head % fetcher->size];
+
+		pthread_mutex_lock(&fetcher->lock);
+		while (!slot->done) {
+			pthread_cond_wait(&fetcher->cond, &fetcher->lock);
+		}
+		pthread_mutex_unlock(&fetcher->lock);
+
+		if (!slot->chunk) {
+			errno = slot->error;
+			return -1;
+		}
+
+		fetcher->current = slot->chunk;
+		slot->chunk = NULL;
+		fetcher->head++;
+
+		uint16_t clength = chunk_length(fetcher->current);
+		uint64_t skip = fetcher->skip < clength ? fetcher->skip : clength;
+		fetcher->skip = 0;
+
+		*data = chunk_data(fetcher->current) + skip;
+		*length = clength - skip;
+
+		/* keep the workers busy while the caller deals with this one */
+		kvfs_fetcher_fill(fetcher);
+
+	} while (*length == 0);
+
+	return 1;
+}
+
+//---------------------------------------------------------------------
+
+/*
+ * fetches the whole file under 'root', passing each piece to 'callback'
+ * in order.  a non-zero return from the callback stops the fetch and
+ * is passed back to the caller.
+ */
+int kvfs_fetch(kvfs_store_t* store, const uint8_t* root, kvfs_fetch_callback_t callback,
+			   void* context, const kvfs_read_options_t* options)
+{
+	const uint8_t* data;
+	size_t length;
+	int r;
+
+	if (!store || !root || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	unsigned int parallel = (options && options->parallel) ? options->parallel : kvfs_fetch_default;
+	kvfs_fetcher_t* fetcher = kvfs_fetcher_create(store, root, 0, parallel);
+	if (!fetcher) {
+		return -1;
+	}
+
+	while ((r = kvfs_fetcher_next(fetcher, &data, &length)) > 0) {
+		r = callback(context, data, length);
+		if (r != 0) {
+			break;
+		}
+	}
+
+	kvfs_fetcher_free(fetcher);
+
+	return r;
+}
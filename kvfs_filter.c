@@ -0,0 +1,73 @@
+/*
+ * kvfs_filter.c
+ *
+ * a fixed size Bloom filter of chunk keys.  the keys are digests
+ * already, so the bit positions are just taken from the key itself.
+ *
+ * bits are only ever set, atomically, so the filter can be read and
+ * added to from any number of threads without a lock.
+ */
+
+#include <stdlib.h>
+
+#include <kvfs/kvfs.h>
+#include <kvfs/chunk.h>
+#include <kvfs/private.h>
+
+enum {
+	kvfs_filter_bits = 23,			// 1MB of filter
+	kvfs_filter_hashes = 4
+};
+
+struct kvfs_filter_t {
+	atomic_uint_fast64_t	words[(1 << kvfs_filter_bits) / 64];
+};
+
+/* the n'th bit position for 'key', skipping the depth and length bytes */
+static uint32_t kvfs_filter_bit(const uint8_t* key, unsigned int n)
+{
+	const uint8_t* p = key + 2 + n * 4;
+	uint32_t v = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+	return v & ((1u << kvfs_filter_bits) - 1);
+}
+
+kvfs_filter_t* kvfs_filter_create(void)
+{
+	kvfs_filter_t* filter = malloc(sizeof *filter);
+	if (!filter) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < sizeof filter->words / sizeof filter->words[0]; ++i) {
+		atomic_init(&filter->words[i], 0);
+	}
+
+	return filter;
+}
+
+void kvfs_filter_free(kvfs_filter_t* filter)
+{
+	free(filter);
+}
+
+void kvfs_filter_add(kvfs_filter_t* filter, const uint8_t* key)
+{
+	for (unsigned int n = 0; n < kvfs_filter_hashes; ++n) {
+		uint32_t bit = kvfs_filter_bit(key, n);
+		atomic_fetch_or_explicit(&filter->words[bit / 64], (uint64_t)1 << (bit % 64), memory_order_relaxed);
+	}
+}
+
+/* false if 'key' has definitely never been added */
+bool kvfs_filter_test(kvfs_filter_t* filter, const uint8_t* key)
+{
+	for (unsigned int n = 0; n < kvfs_filter_hashes; ++n) {
+		uint32_t bit = kvfs_filter_bit(key, n);
+		uint64_t word = atomic_load_explicit(&filter->words[bit / 64], memory_order_relaxed);
+		if (!(word & ((uint64_t)1 << (bit % 64)))) {
+			return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,110 @@
+/*
+ * kvfs_iter.c
+ *
+ * walks the leaves of a file in order, handing out views of the chunk
+ * data itself rather than copying it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <kvfs/kvfs.h>
+#include <kvfs/chunk.h>
+#include <kvfs/private.h>
+
+struct kvfs_iter_t {
+	kvfs_store_t*		store;
+	kvfs_fetcher_t*		fetcher;		// if fetching in parallel
+	kvfs_cursor_t		cursor;			// otherwise
+	chunk_t*			current;
+};
+
+/*
+ * starts iterating over the file under 'root'.  leaves are fetched in
+ * parallel if the options or the store's read-ahead setting ask for it.
+ */
+kvfs_iter_t* kvfs_iter_open(kvfs_store_t* store, const uint8_t* root, const kvfs_read_options_t* options)
+{
+	uint64_t skip;
+
+	if (!store || !root || (options && options->readahead > kvfs_readahead_max)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	int readahead = (options && options->readahead) ? options->readahead : (int)store->readahead;
+	unsigned int parallel = (options && options->parallel) ? options->parallel
+						  : (readahead > 0) ? (unsigned int)readahead : 0;
+
+	kvfs_iter_t* iter = calloc(1, sizeof *iter);
+	if (!iter) {
+		return NULL;
+	}
+
+	iter->store = store;
+
+	if (parallel) {
+		iter->fetcher = kvfs_fetcher_create(store, root, 0, parallel);
+		if (!iter->fetcher) {
+			goto error;
+		}
+	} else if (kvfs_cursor_open(&iter->cursor, store, root, 0, NULL, &skip) < 0) {
+		goto error;
+	}
+
+	return iter;
+
+error:
+	kvfs_iter_close(iter);
+	return NULL;
+}
+
+/*
+ * points 'data' at the next leaf's contents, which remain valid until
+ * the next call or kvfs_iter_close().  returns 1 if there was another
+ * leaf, 0 at the end of the file or -1 on error.
+ */
+int kvfs_iter_next(kvfs_iter_t* iter, const uint8_t** data, size_t* length)
+{
+	if (!iter || !data || !length) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (iter->fetcher) {
+		return kvfs_fetcher_next(iter->fetcher, data, length);
+	}
+
+	do {
+		if (iter->current) {
+			chunk_free(iter->current);
+			iter->current = NULL;
+		}
+
+		int r = kvfs_cursor_next_leaf(&iter->cursor, &iter->current);
+		if (r <= 0) {
+			return r;
+		}
+
+		*data = chunk_data(iter->current);
+		*length = chunk_length(iter->current);
+
+	} while (*length == 0);
+
+	return 1;
+}
+
+void kvfs_iter_close(kvfs_iter_t* iter)
+{
+	if (!iter) {
+		return;
+	}
+
+	if (iter->current) {
+		chunk_free(iter->current);
+	}
+	kvfs_fetcher_free(iter->fetcher);
+	kvfs_cursor_close(&iter->cursor);
+	free(iter);
+}
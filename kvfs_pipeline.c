@@ -0,0 +1,339 @@
+/*
+ * kvfs_pipeline.c
+ *
+ * splits a stream of bytes into leaf chunks and hashes them on several
+ * threads at once, while a single committer thread hands the finished
+ * chunks to a callback in their original order.
+ *
+ * the producer fills a ring of batch-sized buffers.  each hashing
+ * thread claims the next filled buffer, and the committer follows
+ * behind, releasing buffers back to the producer once their chunks
+ * have been committed.  all of the ring indices move forwards only,
+ * so a buffer's position in the stream is just its sequence number.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <kvfs/kvfs.h>
+#include <kvfs/chunk.h>
+#include <kvfs/private.h>
+
+enum {
+	kvfs_pipeline_batch = 8			// chunks per buffer
+};
+
+typedef enum {
+	kvfs_pipeline_empty = 0,
+	kvfs_pipeline_filled,
+	kvfs_pipeline_hashing,
+	kvfs_pipeline_hashed
+} kvfs_pipeline_state_t;
+
+typedef struct kvfs_pipeline_slot_t {
+	kvfs_pipeline_state_t	state;
+	size_t					length;
+	int						error;
+	size_t					count;
+	chunk_t*				chunks[kvfs_pipeline_batch];
+	uint8_t*				buffer;
+} kvfs_pipeline_slot_t;
+
+struct kvfs_pipeline_t {
+	kvfs_pipeline_commit_t	commit;
+	void*					context;
+	pthread_mutex_t			lock;
+	pthread_cond_t			filled;
+	pthread_cond_t			hashed;
+	pthread_cond_t			emptied;
+	uint64_t				head;			// next to commit
+	uint64_t				claim;			// next to hash
+	uint64_t				tail;			// next to fill
+	size_t					fill;			// bytes in the slot being filled
+	bool					finishing;
+	int						error;
+	bool					committer_started;
+	pthread_t				committer;
+	unsigned int			started;
+	pthread_t*				threads;
+	size_t					size;
+	kvfs_pipeline_slot_t*	slots;
+};
+
+static void kvfs_pipeline_hash(kvfs_pipeline_slot_t* slot)
+{
+	const uint8_t* data[kvfs_pipeline_batch];
+	uint16_t lengths[kvfs_pipeline_batch];
+	size_t count = 0;
+
+	for (size_t offset = 0; offset < slot->length; offset += chunk_maxlength, ++count) {
+		data[count] = slot->buffer + offset;
+		lengths[count] = (slot->length - offset < chunk_maxlength) ? slot->length - offset : chunk_maxlength;
+	}
+
+	slot->count = count;
+	slot->error = 0;
+	if (chunk_create_batch(slot->chunks, data, lengths, 0, false, NULL, count) < 0) {
+		slot->error = errno;
+	}
+}
+
+static void* kvfs_pipeline_hasher(void* arg)
+{
+	kvfs_pipeline_t* pipeline = arg;
+
+	pthread_mutex_lock(&pipeline->lock);
+	for (;;) {
+		while (pipeline->claim == pipeline->tail && !pipeline->finishing) {
+			pthread_cond_wait(&pipeline->filled, &pipeline->lock);
+		}
+
+		if (pipeline->claim == pipeline->tail) {
+			break;
+		}
+
+		kvfs_pipeline_slot_t* slot = &pipeline->slots[pipeline->claim++ % pipeline->size];
+		slot->state = kvfs_pipeline_hashing;
+
+		pthread_mutex_unlock(&pipeline->lock);
+		kvfs_pipeline_hash(slot);
+		pthread_mutex_lock(&pipeline->lock);
+
+		slot->state = kvfs_pipeline_hashed;
+		pthread_cond_broadcast(&pipeline->hashed);
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return NULL;
+}
+
+/*
+ * commits each slot's chunks in order.  after an error the remaining
+ * slots are still drained, just not committed, so nothing waits forever.
+ */
+static void* kvfs_pipeline_committer(void* arg)
+{
+	kvfs_pipeline_t* pipeline = arg;
+
+	pthread_mutex_lock(&pipeline->lock);
+	for (;;) {
+		kvfs_pipeline_slot_t* slot = &pipeline->slots[pipeline->head % pipeline->size];
+
+		while (!(pipeline->head < pipeline->tail && slot->state == kvfs_pipeline_hashed) &&
+			   !(pipeline->finishing && pipeline->head == pipeline->tail))
+		{
+			pthread_cond_wait(&pipeline->hashed, &pipeline->lock);
+		}
+
+		if (pipeline->head == pipeline->tail) {
+			break;
+		}
+
+		int error = pipeline->error ? pipeline->error : slot->error;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		for (size_t i = 0; i < slot->count; ++i) {
+			if (!error && pipeline->commit(pipeline->context, slot->chunks[i]) < 0) {
+				error = errno;
+			}
+			if (slot->chunks[i]) {
+				chunk_free(slot->chunks[i]);
+				slot->chunks[i] = NULL;
+			}
+		}
+
+		pthread_mutex_lock(&pipeline->lock);
+		if (error && !pipeline->error) {
+			pipeline->error = error;
+		}
+		slot->state = kvfs_pipeline_empty;
+		pipeline->head++;
+		pthread_cond_signal(&pipeline->emptied);
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return NULL;
+}
+
+/* hands the slot being filled over to the hashing threads */
+static void kvfs_pipeline_publish(kvfs_pipeline_t* pipeline)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	kvfs_pipeline_slot_t* slot = &pipeline->slots[pipeline->tail % pipeline->size];
+	slot->length = pipeline->fill;
+	slot->state = kvfs_pipeline_filled;
+	pipeline->tail++;
+	pipeline->fill = 0;
+	pthread_cond_signal(&pipeline->filled);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+/*
+ * joins the threads.  only called once everything has been published
+ * and 'finishing' is set.
+ */
+static void kvfs_pipeline_join(kvfs_pipeline_t* pipeline)
+{
+	for (unsigned int i = 0; i < pipeline->started; ++i) {
+		pthread_join(pipeline->threads[i], NULL);
+	}
+	pipeline->started = 0;
+
+	if (pipeline->committer_started) {
+		pthread_join(pipeline->committer, NULL);
+		pipeline->committer_started = false;
+	}
+}
+
+/*
+ * starts 'threads' hashing threads and a committer, which passes each
+ * leaf chunk to 'commit' in order
+ */
+kvfs_pipeline_t* kvfs_pipeline_create(unsigned int threads, kvfs_pipeline_commit_t commit, void* context)
+{
+	if (threads == 0 || threads > kvfs_pipeline_max || !commit) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	kvfs_pipeline_t* pipeline = calloc(1, sizeof *pipeline);
+	if (!pipeline) {
+		return NULL;
+	}
+
+	pipeline->commit = commit;
+	pipeline->context = context;
+	pipeline->size = 2 * threads + 2;
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->filled, NULL);
+	pthread_cond_init(&pipeline->hashed, NULL);
+	pthread_cond_init(&pipeline->emptied, NULL);
+
+	pipeline->threads = calloc(threads, sizeof *pipeline->threads);
+	pipeline->slots = calloc(pipeline->size, sizeof *pipeline->slots);
+	if (!pipeline->threads || !pipeline->slots) {
+		goto error;
+	}
+
+	for (size_t i = 0; i < pipeline->size; ++i) {
+		pipeline->slots[i].buffer = malloc(kvfs_pipeline_batch * chunk_maxlength);
+		if (!pipeline->slots[i].buffer) {
+			goto error;
+		}
+	}
+
+	if (pthread_create(&pipeline->committer, NULL, kvfs_pipeline_committer, pipeline) != 0) {
+		goto error;
+	}
+	pipeline->committer_started = true;
+
+	for (; pipeline->started < threads; ++pipeline->started) {
+		if (pthread_create(&pipeline->threads[pipeline->started], NULL, kvfs_pipeline_hasher, pipeline) != 0) {
+			goto error;
+		}
+	}
+
+	return pipeline;
+
+error:
+	kvfs_pipeline_free(pipeline);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/*
+ * queues 'length' bytes to be chunked, waiting for room in the ring if
+ * the hashing threads or the committer are behind
+ */
+int kvfs_pipeline_write(kvfs_pipeline_t* pipeline, const uint8_t* data, size_t length)
+{
+	const size_t batch = kvfs_pipeline_batch * chunk_maxlength;
+
+	while (length) {
+		kvfs_pipeline_slot_t* slot = &pipeline->slots[pipeline->tail % pipeline->size];
+
+		if (pipeline->fill == 0) {
+			pthread_mutex_lock(&pipeline->lock);
+			while (slot->state != kvfs_pipeline_empty) {
+				pthread_cond_wait(&pipeline->emptied, &pipeline->lock);
+			}
+			int error = pipeline->error;
+			pthread_mutex_unlock(&pipeline->lock);
+
+			if (error) {
+				errno = error;
+				return -1;
+			}
+		}
+
+		size_t amount = batch - pipeline->fill < length ? batch - pipeline->fill : length;
+		memcpy(slot->buffer + pipeline->fill, data, amount);
+		pipeline->fill += amount;
+		data += amount;
+		length -= amount;
+
+		if (pipeline->fill == batch) {
+			kvfs_pipeline_publish(pipeline);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * flushes the final partial chunk and waits for everything to be
+ * committed, returning -1 if anything failed along the way
+ */
+int kvfs_pipeline_finish(kvfs_pipeline_t* pipeline)
+{
+	if (pipeline->fill) {
+		kvfs_pipeline_publish(pipeline);
+	}
+
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->finishing = true;
+	pthread_cond_broadcast(&pipeline->filled);
+	pthread_cond_broadcast(&pipeline->hashed);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	kvfs_pipeline_join(pipeline);
+
+	if (pipeline->error) {
+		errno = pipeline->error;
+		return -1;
+	}
+
+	return 0;
+}
+
+void kvfs_pipeline_free(kvfs_pipeline_t* pipeline)
+{
+	if (!pipeline) {
+		return;
+	}
+
+	/* discards anything not yet published */
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->finishing = true;
+	pthread_cond_broadcast(&pipeline->filled);
+	pthread_cond_broadcast(&pipeline->hashed);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	kvfs_pipeline_join(pipeline);
+
+	if (pipeline->slots) {
+		for (size_t i = 0; i < pipeline->size; ++i) {
+			free(pipeline->slots[i].buffer);
+		}
+	}
+
+	free(pipeline->slots);
+	free(pipeline->threads);
+	pthread_cond_destroy(&pipeline->emptied);
+	pthread_cond_destroy(&pipeline->hashed);
+	pthread_cond_destroy(&pipeline->filled);
+	pthread_mutex_destroy(&pipeline->lock);
+	free(pipeline);
+}
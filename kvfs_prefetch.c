@@ -0,0 +1,268 @@
+/*
+ * kvfs_prefetch.c
+ *
+ * per-stream read-ahead.  readers hint the keys they expect to need
+ * next and the prefetcher fetches up to 'window' of them at a time on
+ * the store's worker threads.  the window starts small and doubles
+ * each time a hinted chunk is actually used, up to the stream's limit,
+ * and drops back again after a seek.  if the driver can fetch several
+ * keys in one request, each hint's keys are fetched as a single batch.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <kvfs/kvfs.h>
+#include <kvfs/chunk.h>
+#include <kvfs/private.h>
+
+enum {
+	kvfs_prefetch_initial = 4
+};
+
+typedef enum {
+	kvfs_slot_empty = 0,
+	kvfs_slot_pending,
+	kvfs_slot_ready,
+	kvfs_slot_abandoned			// still being fetched, but no longer wanted
+} kvfs_slot_state_t;
+
+typedef struct kvfs_prefetch_slot_t {
+	kvfs_work_t					work;
+	struct kvfs_prefetch_t*		prefetch;
+	kvfs_slot_state_t			state;
+	uint64_t					seq;
+	chunk_t*					chunk;
+	struct kvfs_prefetch_slot_t* next;			// the rest of a batch
+	uint8_t						key[chunk_keylength];
+} kvfs_prefetch_slot_t;
+
+struct kvfs_prefetch_t {
+	kvfs_store_t*				store;
+	kvfs_workq_t*				workq;
+	pthread_mutex_t				lock;
+	pthread_cond_t				cond;
+	unsigned int				window;
+	unsigned int				max;
+	unsigned int				outstanding;	// pending or ready
+	unsigned int				busy;			// being fetched
+	uint64_t					seq;
+	kvfs_prefetch_slot_t		slots[kvfs_readahead_max];
+};
+
+/* hands a fetched chunk to its slot, unless it's no longer wanted */
+static void kvfs_prefetch_done(kvfs_prefetch_t* prefetch, kvfs_prefetch_slot_t* slot, chunk_t* chunk)
+{
+	if (chunk) {
+		atomic_fetch_add(&prefetch->store->counters.readahead, 1);
+	}
+
+	if (slot->state == kvfs_slot_abandoned) {
+		if (chunk) {
+			chunk_free(chunk);
+		}
+		slot->state = kvfs_slot_empty;
+	} else {
+		slot->chunk = chunk;
+		slot->state = kvfs_slot_ready;
+	}
+	prefetch->busy--;
+}
+
+static void kvfs_prefetch_run(kvfs_work_t* work)
+{
+	kvfs_prefetch_slot_t* slot = (kvfs_prefetch_slot_t*)work;
+	kvfs_prefetch_t* prefetch = slot->prefetch;
+	uint8_t keys[kvfs_readahead_max * chunk_keylength];
+	chunk_t* chunks[kvfs_readahead_max];
+	int errors[kvfs_readahead_max];
+	size_t count = 0;
+
+	/* the slots are only relinked once they're empty again */
+	for (kvfs_prefetch_slot_t* s = slot; s; s = s->next) {
+		memcpy(keys + count++ * chunk_keylength, s->key, chunk_keylength);
+	}
+
+	if (count > 1) {
+		kvfs_get_many(prefetch->store, keys, count, chunks, errors);
+	} else {
+		chunks[0] = kvfs_get(prefetch->store, slot->key);
+	}
+
+	pthread_mutex_lock(&prefetch->lock);
+	for (size_t i = 0; slot; ++i) {
+		kvfs_prefetch_slot_t* next = slot->next;
+		kvfs_prefetch_done(prefetch, slot, chunks[i]);
+		slot = next;
+	}
+	pthread_cond_broadcast(&prefetch->cond);
+	pthread_mutex_unlock(&prefetch->lock);
+}
+
+kvfs_prefetch_t* kvfs_prefetch_create(kvfs_store_t* store, unsigned int window)
+{
+	if (window == 0 || window > kvfs_readahead_max) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	kvfs_workq_t* workq = kvfs_store_workq(store);
+	if (!workq) {
+		return NULL;
+	}
+
+	kvfs_prefetch_t* prefetch = calloc(1, sizeof *prefetch);
+	if (!prefetch) {
+		return NULL;
+	}
+
+	prefetch->store = store;
+	prefetch->workq = workq;
+	prefetch->max = window;
+	prefetch->window = window < kvfs_prefetch_initial ? window : kvfs_prefetch_initial;
+	pthread_mutex_init(&prefetch->lock, NULL);
+	pthread_cond_init(&prefetch->cond, NULL);
+
+	for (size_t i = 0; i < kvfs_readahead_max; ++i) {
+		prefetch->slots[i].prefetch = prefetch;
+		prefetch->slots[i].work.run = kvfs_prefetch_run;
+	}
+
+	return prefetch;
+}
+
+/*
+ * waits for any fetches still in flight and frees the prefetcher
+ */
+void kvfs_prefetch_free(kvfs_prefetch_t* prefetch)
+{
+	if (!prefetch) {
+		return;
+	}
+
+	kvfs_prefetch_reset(prefetch);
+
+	pthread_mutex_lock(&prefetch->lock);
+	while (prefetch->busy) {
+		pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+	}
+	pthread_mutex_unlock(&prefetch->lock);
+
+	pthread_cond_destroy(&prefetch->cond);
+	pthread_mutex_destroy(&prefetch->lock);
+	free(prefetch);
+}
+
+/*
+ * discards everything fetched or being fetched, e.g. after a seek,
+ * and shrinks the window back to its initial size
+ */
+void kvfs_prefetch_reset(kvfs_prefetch_t* prefetch)
+{
+	pthread_mutex_lock(&prefetch->lock);
+	for (size_t i = 0; i < kvfs_readahead_max; ++i) {
+		kvfs_prefetch_slot_t* slot = &prefetch->slots[i];
+		if (slot->state == kvfs_slot_ready) {
+			if (slot->chunk) {
+				chunk_free(slot->chunk);
+			}
+			slot->chunk = NULL;
+			slot->state = kvfs_slot_empty;
+		} else if (slot->state == kvfs_slot_pending) {
+			slot->state = kvfs_slot_abandoned;
+		}
+	}
+	prefetch->outstanding = 0;
+	prefetch->window = prefetch->max < kvfs_prefetch_initial ? prefetch->max : kvfs_prefetch_initial;
+	pthread_mutex_unlock(&prefetch->lock);
+}
+
+/*
+ * starts fetching as many of the 'count' consecutive keys as the
+ * window allows, returning how many were accepted
+ */
+size_t kvfs_prefetch_hint(kvfs_prefetch_t* prefetch, const uint8_t* keys, size_t count)
+{
+	kvfs_prefetch_slot_t* batch = NULL;
+	kvfs_prefetch_slot_t** link = &batch;
+	size_t accepted = 0;
+	size_t i = 0;
+
+	pthread_mutex_lock(&prefetch->lock);
+	while (accepted < count && prefetch->outstanding < prefetch->window) {
+		while (i < kvfs_readahead_max && prefetch->slots[i].state != kvfs_slot_empty) {
+			++i;
+		}
+		if (i == kvfs_readahead_max) {
+			break;
+		}
+
+		kvfs_prefetch_slot_t* slot = &prefetch->slots[i];
+		memcpy(slot->key, keys + accepted * chunk_keylength, chunk_keylength);
+		slot->state = kvfs_slot_pending;
+		slot->seq = prefetch->seq++;
+		slot->chunk = NULL;
+		slot->next = NULL;
+		prefetch->outstanding++;
+		prefetch->busy++;
+		++accepted;
+
+		if (prefetch->store->get_many) {
+			*link = slot;
+			link = &slot->next;
+		} else {
+			kvfs_workq_submit(prefetch->workq, &slot->work);
+		}
+	}
+	pthread_mutex_unlock(&prefetch->lock);
+
+	if (batch) {
+		kvfs_workq_submit(prefetch->workq, &batch->work);
+	}
+
+	return accepted;
+}
+
+/*
+ * returns the chunk for 'key' if it was hinted, waiting for the fetch
+ * to complete if necessary.  returns NULL if the key wasn't hinted or
+ * the fetch failed, in which case the caller should fetch it itself
+ * to find out why.
+ */
+chunk_t* kvfs_prefetch_take(kvfs_prefetch_t* prefetch, const uint8_t* key)
+{
+	kvfs_prefetch_slot_t* slot = NULL;
+	chunk_t* chunk = NULL;
+
+	pthread_mutex_lock(&prefetch->lock);
+	for (size_t i = 0; i < kvfs_readahead_max; ++i) {
+		kvfs_prefetch_slot_t* s = &prefetch->slots[i];
+		if ((s->state == kvfs_slot_pending || s->state == kvfs_slot_ready) &&
+			(!slot || s->seq < slot->seq) &&
+			memcmp(s->key, key, chunk_keylength) == 0)
+		{
+			slot = s;
+		}
+	}
+
+	if (slot) {
+		while (slot->state == kvfs_slot_pending) {
+			pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+		}
+
+		/* the slot can only have been reset by this stream's own thread */
+		chunk = slot->chunk;
+		slot->chunk = NULL;
+		slot->state = kvfs_slot_empty;
+		prefetch->outstanding--;
+
+		if (chunk && prefetch->window < prefetch->max) {
+			prefetch->window = (prefetch->window * 2 < prefetch->max) ? prefetch->window * 2 : prefetch->max;
+		}
+	}
+	pthread_mutex_unlock(&prefetch->lock);
+
+	return chunk;
+}
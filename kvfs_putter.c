@@ -0,0 +1,188 @@
+/*
+ * kvfs_putter.c
+ *
+ * stores chunks in the background, with up to a window's worth of puts
+ * in flight at once, so that a writer isn't held up by a round trip to
+ * the store for every chunk.
+ *
+ * each put is given a sequence number as it's queued.  puts may finish
+ * in any order, but the failure that's reported is always the one with
+ * the lowest sequence number, so the same error comes back however the
+ * puts happen to be scheduled.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <kvfs/kvfs.h>
+#include <kvfs/chunk.h>
+#include <kvfs/private.h>
+
+typedef struct kvfs_put_slot_t {
+	kvfs_work_t					work;
+	struct kvfs_putter_t*		putter;
+	bool						busy;
+	uint64_t					sequence;
+	chunk_t*					chunk;
+} kvfs_put_slot_t;
+
+struct kvfs_putter_t {
+	kvfs_store_t*				store;
+	kvfs_dedup_t				dedup;
+	kvfs_workq_t*				workq;
+	pthread_mutex_t				lock;
+	pthread_cond_t				cond;
+	uint64_t					tail;			// next sequence number
+	unsigned int				busy;
+	uint64_t					failed;			// earliest failure, or UINT64_MAX
+	int							error;
+	unsigned int				size;
+	kvfs_put_slot_t				slots[];
+};
+
+static void kvfs_putter_run(kvfs_work_t* work)
+{
+	kvfs_put_slot_t* slot = (kvfs_put_slot_t*)work;
+	kvfs_putter_t* putter = slot->putter;
+
+	int r = kvfs_store_put_dedup(putter->store, slot->chunk, putter->dedup);
+	int error = errno;
+
+	chunk_free(slot->chunk);
+	slot->chunk = NULL;
+
+	pthread_mutex_lock(&putter->lock);
+	if (r < 0 && slot->sequence < putter->failed) {
+		putter->failed = slot->sequence;
+		putter->error = error;
+	}
+	slot->busy = false;
+	putter->busy--;
+	pthread_cond_broadcast(&putter->cond);
+	pthread_mutex_unlock(&putter->lock);
+}
+
+/* waits for every queued put to finish.  called with the lock held. */
+static void kvfs_putter_drain(kvfs_putter_t* putter)
+{
+	while (putter->busy) {
+		pthread_cond_wait(&putter->cond, &putter->lock);
+	}
+}
+
+/*
+ * starts a putter with up to 'window' puts in flight, each on its
+ * own thread.  chunks the store already has are skipped according
+ * to 'dedup'.
+ */
+kvfs_putter_t* kvfs_putter_create(kvfs_store_t* store, unsigned int window, kvfs_dedup_t dedup)
+{
+	if (window == 0 || window > kvfs_put_window_max) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	kvfs_putter_t* putter = calloc(1, sizeof *putter + window * sizeof(kvfs_put_slot_t));
+	if (!putter) {
+		return NULL;
+	}
+
+	putter->store = store;
+	putter->dedup = dedup;
+	putter->size = window;
+	putter->failed = UINT64_MAX;
+	pthread_mutex_init(&putter->lock, NULL);
+	pthread_cond_init(&putter->cond, NULL);
+
+	for (unsigned int i = 0; i < window; ++i) {
+		putter->slots[i].putter = putter;
+		putter->slots[i].work.run = kvfs_putter_run;
+	}
+
+	putter->workq = kvfs_workq_create(window);
+	if (!putter->workq) {
+		kvfs_putter_free(putter);
+		return NULL;
+	}
+
+	return putter;
+}
+
+/*
+ * waits for anything still in flight and releases it all
+ */
+void kvfs_putter_free(kvfs_putter_t* putter)
+{
+	if (!putter) {
+		return;
+	}
+
+	pthread_mutex_lock(&putter->lock);
+	kvfs_putter_drain(putter);
+	pthread_mutex_unlock(&putter->lock);
+
+	kvfs_workq_free(putter->workq);
+	pthread_cond_destroy(&putter->cond);
+	pthread_mutex_destroy(&putter->lock);
+	free(putter);
+}
+
+/*
+ * queues 'chunk' to be stored, waiting for room in the window if need
+ * be.  the putter takes its own reference, so the caller keeps theirs,
+ * and only copies chunks that point into the caller's buffers.  fails
+ * straight away once an earlier put has failed.
+ */
+int kvfs_putter_put(kvfs_putter_t* putter, chunk_t* chunk)
+{
+	chunk_t* held = chunk_keep(chunk, putter->store->pool);
+	if (!held) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&putter->lock);
+
+	kvfs_put_slot_t* slot = &putter->slots[putter->tail % putter->size];
+	while (slot->busy && putter->failed == UINT64_MAX) {
+		pthread_cond_wait(&putter->cond, &putter->lock);
+	}
+
+	if (putter->failed != UINT64_MAX) {
+		int error = putter->error;
+		pthread_mutex_unlock(&putter->lock);
+		chunk_free(held);
+		errno = error;
+		return -1;
+	}
+
+	slot->busy = true;
+	slot->sequence = putter->tail++;
+	slot->chunk = held;
+	putter->busy++;
+
+	pthread_mutex_unlock(&putter->lock);
+
+	kvfs_workq_submit(putter->workq, &slot->work);
+
+	return 0;
+}
+
+/*
+ * waits for every queued put to finish, returning -1 with the error
+ * from the earliest one that failed
+ */
+int kvfs_putter_finish(kvfs_putter_t* putter)
+{
+	pthread_mutex_lock(&putter->lock);
+	kvfs_putter_drain(putter);
+	int error = (putter->failed != UINT64_MAX) ? putter->error : 0;
+	pthread_mutex_unlock(&putter->lock);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
@@ -8,43 +8,72 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
 
 #include <kvfs/kvfs.h>
 #include <kvfs/chunk.h>
+#include <kvfs/private.h>
 
+/* the writer hashes this many chunks at a time */
+enum {
+	kvfs_stdio_batch = 8
+};
+
+/*
+ * the reader walks the tree with a cursor holding one indirection
+ * chunk per level, so after opening nothing is allocated per chunk
+ * beyond what the store's pool recycles
+ */
 typedef struct kvfs_read_cookie_t {
 	kvfs_store_t*				store;
-	uint8_t*					buffer;
-	const uint8_t*				key;
-	struct kvfs_read_cookie_t*	next;
-	chunk_t*					chunk;
-	uint16_t					length;
-	uint16_t					offset;
+	uint8_t						root[chunk_keylength];
+	kvfs_cursor_t				cursor;
+	kvfs_prefetch_t*			prefetch;		// may be NULL
+	chunk_t*					leaf;			// the leaf being read
+	uint16_t					offset;			// within the leaf
+	uint64_t					position;
+	uint64_t					size;			// UINT64_MAX until known
+	bool						failed;			// a read or seek failed part way
+	unsigned int				parallel;		// if set, read through 'fetcher'
+	kvfs_fetcher_t*				fetcher;
+	const uint8_t*				data;			// delivered by the fetcher
+	size_t						avail;
 } kvfs_read_cookie_t;
 
+/*
+ * the writer passes each leaf's key to a builder, which stores the
+ * indirection chunks above it as soon as they fill up
+ */
 typedef struct kvfs_write_cookie_t {
 	kvfs_store_t*				store;
 	uint8_t*					buffer;
-	uint8_t*					keybuffer;
-	size_t						keybuffer_length;
-	size_t						keybuffer_offset;
-	uint16_t					offset;
-	uint8_t						depth;
+	size_t						offset;
+	kvfs_builder_t				builder;
+	kvfs_pipeline_t*			pipeline;		// if hashing on other threads
+	kvfs_putter_t*				putter;			// if storing in the background
+	kvfs_dedup_t				dedup;
 } kvfs_write_cookie_t;
 
 static kvfs_read_cookie_t*
-				kvfs_stdio_reader_alloc(kvfs_store_t* store, const uint8_t* key);
+				kvfs_stdio_reader_alloc(kvfs_store_t* store, const uint8_t* key,
+										kvfs_prefetch_t* prefetch, unsigned int parallel);
 static void		kvfs_stdio_reader_free(void* cookie);
-static int		kvfs_stdio_reader_read(void* cookie, char* buf, int size);
+static int		kvfs_stdio_reader_top(void* cookie, char* buf, int size);
 static ssize_t	kvfs_stdio_reader_wrapper(void* cookie, char* buf, size_t size);
+#ifdef __linux__
+static int		kvfs_stdio_reader_seek_wrapper(void* cookie, off64_t* offset, int whence);
+#else
+static fpos_t	kvfs_stdio_reader_seek_wrapper(void* cookie, fpos_t offset, int whence);
+#endif
 static int		kvfs_stdio_reader_close(void* cookie);
 
 static kvfs_write_cookie_t*
-				kvfs_stdio_writer_alloc(kvfs_store_t* store, uint8_t depth);
+				kvfs_stdio_writer_alloc(kvfs_store_t* store);
 static void		kvfs_stdio_writer_free(void* cookie);
+static int		kvfs_stdio_writer_commit(void* cookie, chunk_t* chunk);
 static int		kvfs_stdio_writer_write(void* cookie, const char* buf, int size);
 static ssize_t	kvfs_stdio_writer_wrapper(void* cookie, const char* buf, size_t size);
 static int		kvfs_stdio_writer_close(void* cookie);
@@ -53,13 +82,35 @@ static int		kvfs_stdio_writer_close(void* cookie);
 
 FILE* kvfs_fopen_read(kvfs_store_t* store, const uint8_t* key)
 {
-	if (!key) {
+	return kvfs_fopen_read_ex(store, key, NULL);
+}
+
+FILE* kvfs_fopen_read_ex(kvfs_store_t* store, const uint8_t* key, const kvfs_read_options_t* options)
+{
+	kvfs_prefetch_t* prefetch = NULL;
+
+	if (!store || !key || (options && options->readahead > kvfs_readahead_max)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	unsigned int parallel = options ? options->parallel : 0;
+	if (parallel > kvfs_fetch_max) {
 		errno = EINVAL;
 		return NULL;
 	}
 
-	kvfs_read_cookie_t* cookie = kvfs_stdio_reader_alloc(store, key);
+	int readahead = (options && options->readahead) ? options->readahead : (int)store->readahead;
+	if (readahead > 0 && !parallel) {
+		prefetch = kvfs_prefetch_create(store, readahead);
+		if (!prefetch) {
+			return NULL;
+		}
+	}
+
+	kvfs_read_cookie_t* cookie = kvfs_stdio_reader_alloc(store, key, prefetch, parallel);
 	if (!cookie) {
+		kvfs_prefetch_free(prefetch);
 		return NULL;
 	}
 
@@ -67,28 +118,64 @@ FILE* kvfs_fopen_read(kvfs_store_t* store, const uint8_t* key)
 	static cookie_io_functions_t funcs = {
 		.read  = kvfs_stdio_reader_wrapper,
 		.write = NULL,
-		.seek  = NULL,
+		.seek  = kvfs_stdio_reader_seek_wrapper,
 		.close = kvfs_stdio_reader_close
 	};
 
-	return fopencookie(cookie, "r", funcs);
+	FILE* fp = fopencookie(cookie, "r", funcs);
 #else
-	return funopen(cookie, kvfs_stdio_reader_read, NULL, NULL, kvfs_stdio_reader_close);
+	FILE* fp = funopen(cookie, kvfs_stdio_reader_top, NULL,
+					   kvfs_stdio_reader_seek_wrapper, kvfs_stdio_reader_close);
 #endif
+
+	if (!fp) {
+		kvfs_stdio_reader_close(cookie);
+	}
+
+	return fp;
 }
 
 FILE* kvfs_fopen_write(kvfs_store_t* store)
 {
-	if (!store) {
+	return kvfs_fopen_write_ex(store, NULL);
+}
+
+FILE* kvfs_fopen_write_ex(kvfs_store_t* store, const kvfs_write_options_t* options)
+{
+	unsigned int threads = options ? options->threads : 0;
+
+	if (!store || threads > kvfs_pipeline_max || (options && options->window > kvfs_put_window_max)) {
 		errno = EINVAL;
 		return NULL;
 	}
 
-	kvfs_write_cookie_t* cookie = kvfs_stdio_writer_alloc(store, 0);
+	int window = (options && options->window) ? options->window : (int)store->put_window;
+	kvfs_dedup_t dedup = options ? options->dedup : KVFS_DEDUP_NONE;
+
+	kvfs_write_cookie_t* cookie = kvfs_stdio_writer_alloc(store);
 	if (!cookie) {
 		return NULL;
 	}
 
+	if (window > 0) {
+		cookie->putter = kvfs_putter_create(store, window, dedup);
+		if (!cookie->putter) {
+			kvfs_stdio_writer_free(cookie);
+			return NULL;
+		}
+	}
+
+	cookie->dedup = dedup;
+	kvfs_builder_init(&cookie->builder, store, cookie->putter, dedup);
+
+	if (threads) {
+		cookie->pipeline = kvfs_pipeline_create(threads, kvfs_stdio_writer_commit, cookie);
+		if (!cookie->pipeline) {
+			kvfs_stdio_writer_free(cookie);
+			return NULL;
+		}
+	}
+
 #ifdef __linux__
 	static cookie_io_functions_t funcs = {
 		.read  = NULL,
@@ -96,111 +183,164 @@ FILE* kvfs_fopen_write(kvfs_store_t* store)
 		.seek  = NULL,
 		.close = kvfs_stdio_writer_close
 	};
-	return fopencookie(cookie, "w", funcs);
+	FILE* fp = fopencookie(cookie, "w", funcs);
 #else
-	return funopen(cookie, NULL, kvfs_stdio_writer_write, NULL, kvfs_stdio_writer_close);
+	FILE* fp = funopen(cookie, NULL, kvfs_stdio_writer_write, NULL, kvfs_stdio_writer_close);
 #endif
+
+	if (!fp) {
+		kvfs_stdio_writer_free(cookie);
+	}
+
+	return fp;
 }
 
 //---------------------------------------------------------------------
 
-static kvfs_read_cookie_t* kvfs_stdio_reader_alloc(kvfs_store_t* store, const uint8_t* key)
+/*
+ * positions the reader at 'offset', fetching only the chunks on
+ * the path down to that byte
+ */
+static int kvfs_stdio_reader_position(kvfs_read_cookie_t* cookie, uint64_t offset)
 {
-	kvfs_read_cookie_t* cookie = malloc(sizeof *cookie);
-	uint8_t* buffer = malloc(chunk_maxlength);
+	uint64_t skip;
 
-	if (!cookie || !buffer) {
-		goto error;
+	if (cookie->leaf) {
+		chunk_free(cookie->leaf);
+		cookie->leaf = NULL;
+	}
+
+	if (cookie->parallel) {
+		kvfs_fetcher_free(cookie->fetcher);
+		cookie->avail = 0;
+		cookie->fetcher = kvfs_fetcher_create(cookie->store, cookie->root, offset, cookie->parallel);
+		return cookie->fetcher ? 0 : -1;
+	}
+
+	if (cookie->prefetch) {
+		kvfs_prefetch_reset(cookie->prefetch);
+	}
+
+	kvfs_cursor_close(&cookie->cursor);
+	if (kvfs_cursor_open(&cookie->cursor, cookie->store, cookie->root, offset, cookie->prefetch, &skip) < 0) {
+		return -1;
+	}
+
+	/* past the end of the file there's no leaf, so reads return EOF */
+	if (kvfs_cursor_next_leaf(&cookie->cursor, &cookie->leaf) < 0) {
+		return -1;
+	}
+
+	if (cookie->leaf) {
+		uint16_t length = chunk_length(cookie->leaf);
+		cookie->offset = skip < length ? skip : length;
+	}
+
+	return 0;
+}
+
+static kvfs_read_cookie_t* kvfs_stdio_reader_alloc(kvfs_store_t* store, const uint8_t* key,
+												   kvfs_prefetch_t* prefetch, unsigned int parallel)
+{
+	kvfs_read_cookie_t* cookie = calloc(1, sizeof *cookie);
+	if (!cookie) {
+		return NULL;
 	}
 
 	cookie->store = store;
-	cookie->buffer = buffer;
-	cookie->key = key;
-	cookie->next = NULL;
-	cookie->chunk = kvfs_get(cookie->store, cookie->key);
-	if (!cookie->chunk) {
-		goto error;
+	memcpy(cookie->root, key, chunk_keylength);
+	cookie->prefetch = prefetch;
+	cookie->parallel = parallel;
+	cookie->size = UINT64_MAX;
+
+	if (kvfs_stdio_reader_position(cookie, 0) < 0) {
+		kvfs_stdio_reader_free(cookie);
+		return NULL;
 	}
-	cookie->length = chunk_length(cookie->chunk);
-	cookie->offset = 0;
 
 	return cookie;
-
-error:
-	free(buffer);
-	free(cookie);
-	return NULL;
 }
 
+/* the prefetcher belongs to the caller */
 static void	kvfs_stdio_reader_free(void* _cookie)
 {
 	kvfs_read_cookie_t* cookie = _cookie;
 	if (cookie) {
-		if (cookie->chunk) {
-			chunk_free(cookie->chunk);
+		if (cookie->leaf) {
+			chunk_free(cookie->leaf);
 		}
-		free(cookie->buffer);
+		kvfs_fetcher_free(cookie->fetcher);
+		kvfs_cursor_close(&cookie->cursor);
 		free(cookie);
 	}
 }
 
-static int kvfs_stdio_reader_branch(kvfs_read_cookie_t* cookie, char *buf, int size)
+/* copies from the current leaf, moving on to the next one as needed */
+static int kvfs_stdio_reader_read(kvfs_read_cookie_t* cookie, char* buf, int size)
 {
-	while (cookie->next != NULL || cookie->offset < cookie->length) {
-
-		if (!cookie->next) {
-			const uint8_t* key = chunk_data(cookie->chunk) + cookie->offset;
-			cookie->next = kvfs_stdio_reader_alloc(cookie->store, key);
-			cookie->offset += chunk_keylength;
+	while (!cookie->leaf || cookie->offset == chunk_length(cookie->leaf)) {
+		if (cookie->leaf) {
+			chunk_free(cookie->leaf);
+			cookie->leaf = NULL;
 		}
 
-		if (cookie->next) {
-			int r = kvfs_stdio_reader_read(cookie->next, buf, size);
-			if (cookie->next->offset == cookie->next->length || r == 0) {
-				kvfs_stdio_reader_free(cookie->next);
-				cookie->next = 0;
-			}
-			if (r > 0) {
-				return r;
-			} else if (r < 0) {
-				return -1;
-			}
-		} else {
-			return -1;
+		int r = kvfs_cursor_next_leaf(&cookie->cursor, &cookie->leaf);
+		if (r <= 0) {
+			return r;
 		}
+		cookie->offset = 0;
 	}
 
-	return 0;
+	/* copy the smaller of the data available or the destination buffer */
+	int avail = chunk_length(cookie->leaf) - cookie->offset;
+	int tocopy = avail < size ? avail : size;
+
+	assert(tocopy > 0);
+	memcpy(buf, chunk_data(cookie->leaf) + cookie->offset, tocopy);
+	cookie->offset += tocopy;
+
+	return tocopy;
 }
 
-static int kvfs_stdio_reader_leaf(kvfs_read_cookie_t* cookie, char *buf, int size)
+/* reads whatever the parallel fetcher has delivered */
+static int kvfs_stdio_reader_fetch(kvfs_read_cookie_t* cookie, char* buf, int size)
 {
-	if (cookie->offset == cookie->length) {
-		return 0;
-	} else if (cookie->offset > cookie->length) {
-		return -1;
-	} else  {
-		/* for leaf nodes, copy the smaller of the
-		 * data available or the destination buffer */
-		int avail = cookie->length - cookie->offset;
-		int tocopy = avail < size ? avail : size;
-
-		assert(tocopy > 0);
-		memcpy(buf, chunk_data(cookie->chunk) + cookie->offset, tocopy);
-		cookie->offset += tocopy;
-		return tocopy;
+	if (cookie->avail == 0) {
+		int r = kvfs_fetcher_next(cookie->fetcher, &cookie->data, &cookie->avail);
+		if (r <= 0) {
+			cookie->avail = 0;
+			return r;
+		}
 	}
+
+	int tocopy = cookie->avail < (size_t)size ? (int)cookie->avail : size;
+	memcpy(buf, cookie->data, tocopy);
+	cookie->data += tocopy;
+	cookie->avail -= tocopy;
+
+	return tocopy;
 }
 
-static int kvfs_stdio_reader_read(void* _cookie, char* buf, int size)
+/* reads from the tree, keeping track of the stream position */
+static int kvfs_stdio_reader_top(void* _cookie, char* buf, int size)
 {
 	kvfs_read_cookie_t* cookie = _cookie;
 
-	if (chunk_depth(cookie->chunk) == 0) {
-		return kvfs_stdio_reader_leaf(cookie, buf, size);
-	} else {
-		return kvfs_stdio_reader_branch(cookie, buf, size);
+	if (cookie->failed) {
+		errno = EIO;
+		return -1;
+	}
+
+	int r = cookie->parallel ? kvfs_stdio_reader_fetch(cookie, buf, size)
+							 : kvfs_stdio_reader_read(cookie, buf, size);
+	if (r > 0) {
+		cookie->position += r;
+	} else if (r < 0) {
+		/* the cursor has moved past the failed chunk, so don't carry on */
+		cookie->failed = true;
 	}
+
+	return r;
 }
 
 static ssize_t kvfs_stdio_reader_wrapper(void* cookie, char* buf, size_t size)
@@ -208,7 +348,7 @@ static ssize_t kvfs_stdio_reader_wrapper(void* cookie, char* buf, size_t size)
 	size_t read = 0;
 
 	do {
-		ssize_t n = kvfs_stdio_reader_read(cookie, buf + read, size - read);
+		ssize_t n = kvfs_stdio_reader_top(cookie, buf + read, size - read);
 		if (n == 0) {
 			break;
 		} else if (n < 0) {
@@ -220,9 +360,84 @@ static ssize_t kvfs_stdio_reader_wrapper(void* cookie, char* buf, size_t size)
 	return read;
 }
 
-static int kvfs_stdio_reader_close(void* cookie)
+static int kvfs_stdio_reader_seek(kvfs_read_cookie_t* cookie, int64_t offset, int whence, uint64_t* result)
+{
+	uint64_t base;
+
+	switch (whence) {
+		case SEEK_SET:
+			base = 0;
+			break;
+		case SEEK_CUR:
+			base = cookie->position;
+			break;
+		case SEEK_END:
+			if (cookie->size == UINT64_MAX &&
+				kvfs_tree_size(cookie->store, cookie->root, &cookie->size) < 0)
+			{
+				return -1;
+			}
+			base = cookie->size;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+	if (offset < 0 && (uint64_t)0 - (uint64_t)offset > base) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint64_t target = base + (uint64_t)offset;
+
+	/* ftell() comes through here, so don't walk the tree for nothing */
+	if (target != cookie->position || cookie->failed) {
+		if (kvfs_stdio_reader_position(cookie, target) < 0) {
+			cookie->failed = true;
+			return -1;
+		}
+		cookie->failed = false;
+		cookie->position = target;
+	}
+
+	*result = target;
+
+	return 0;
+}
+
+#ifdef __linux__
+static int kvfs_stdio_reader_seek_wrapper(void* cookie, off64_t* offset, int whence)
+{
+	uint64_t result;
+
+	if (kvfs_stdio_reader_seek(cookie, *offset, whence, &result) < 0) {
+		return -1;
+	}
+	*offset = result;
+
+	return 0;
+}
+#else
+static fpos_t kvfs_stdio_reader_seek_wrapper(void* cookie, fpos_t offset, int whence)
+{
+	uint64_t result;
+
+	if (kvfs_stdio_reader_seek(cookie, offset, whence, &result) < 0) {
+		return -1;
+	}
+
+	return result;
+}
+#endif
+
+static int kvfs_stdio_reader_close(void* _cookie)
 {
+	kvfs_read_cookie_t* cookie = _cookie;
+	kvfs_prefetch_t* prefetch = cookie->prefetch;
+
 	kvfs_stdio_reader_free(cookie);
+	kvfs_prefetch_free(prefetch);
 
 	return 0;
 }
@@ -230,28 +445,26 @@ static int kvfs_stdio_reader_close(void* cookie)
 //---------------------------------------------------------------------
 
 static kvfs_write_cookie_t*
-				kvfs_stdio_writer_alloc(kvfs_store_t* store, uint8_t depth)
+				kvfs_stdio_writer_alloc(kvfs_store_t* store)
 {
 	kvfs_write_cookie_t* cookie = malloc(sizeof *cookie);
-	uint8_t* buffer = malloc(chunk_maxlength);
-	uint8_t* keybuffer = malloc(chunk_maxlength);
+	uint8_t* buffer = malloc(kvfs_stdio_batch * chunk_maxlength);
 
-	if (!cookie || !buffer || !keybuffer) {
+	if (!cookie || !buffer) {
 		goto error;
 	}
 
 	cookie->store = store;
 	cookie->buffer = buffer;
-	cookie->keybuffer = keybuffer;
-	cookie->keybuffer_length = chunk_maxlength;
-	cookie->keybuffer_offset = 0;
 	cookie->offset = 0;
-	cookie->depth = depth;
+	cookie->pipeline = NULL;
+	cookie->putter = NULL;
+	cookie->dedup = KVFS_DEDUP_NONE;
+	kvfs_builder_init(&cookie->builder, store, NULL, KVFS_DEDUP_NONE);
 
 	return cookie;
 
 error:
-	free(keybuffer);
 	free(buffer);
 	free(cookie);
 	return NULL;
@@ -261,90 +474,105 @@ static void	kvfs_stdio_writer_free(void* _cookie)
 {
 	kvfs_write_cookie_t* cookie = _cookie;
 
-	free(cookie->keybuffer);
+	kvfs_pipeline_free(cookie->pipeline);
+	kvfs_putter_free(cookie->putter);
+	kvfs_builder_free(&cookie->builder);
 	free(cookie->buffer);
 	free(cookie);
 }
 
-static int kvfs_stdio_writer_save_key(kvfs_write_cookie_t* cookie, const uint8_t* key)
+/* stores a leaf and hands its key to the next level up */
+static int kvfs_stdio_writer_commit(void* _cookie, chunk_t* chunk)
 {
-	uint8_t* buf = cookie->keybuffer;
-	if (cookie->keybuffer_offset + chunk_keylength > cookie->keybuffer_length) {
-		cookie->keybuffer_length *= 2;
-		buf = realloc(buf, cookie->keybuffer_length);
-		if (!buf) {
-			free(cookie->keybuffer);
-			return -1;
-		}
-		cookie->keybuffer = buf;
-	}
+	kvfs_write_cookie_t* cookie = _cookie;
 
-	memcpy(cookie->keybuffer + cookie->keybuffer_offset, key, chunk_keylength);
-	cookie->keybuffer_offset += chunk_keylength;
+	int r = cookie->putter ? kvfs_putter_put(cookie->putter, chunk)
+						   : kvfs_store_put_dedup(cookie->store, chunk, cookie->dedup);
+	if (r < 0) {
+		return -1;
+	}
 
-	return 0;
+	return kvfs_builder_add(&cookie->builder, chunk_key(chunk));
 }
 
-int kvfs_stdio_writer_emit(kvfs_write_cookie_t* cookie, const uint8_t* buffer)
+/*
+ * hashes and stores up to a batch of chunks from 'buffer', all
+ * of which are full length except possibly the last
+ */
+static int kvfs_stdio_writer_emit(kvfs_write_cookie_t* cookie, const uint8_t* buffer, size_t length)
 {
-	int r = 0;
-
-	chunk_t* chunk = chunk_create(buffer, cookie->offset, cookie->depth, false, NULL);
-	if (!chunk) {
-		r = -1;
-		goto cleanup;
+	chunk_t* chunks[kvfs_stdio_batch];
+	const uint8_t* data[kvfs_stdio_batch];
+	uint16_t lengths[kvfs_stdio_batch];
+	int errors[kvfs_stdio_batch];
+	size_t count = 0;
+	int r;
+
+	assert(length > 0 && length <= kvfs_stdio_batch * chunk_maxlength);
+
+	for (size_t offset = 0; offset < length; offset += chunk_maxlength, ++count) {
+		data[count] = buffer + offset;
+		lengths[count] = (length - offset < chunk_maxlength) ? length - offset : chunk_maxlength;
 	}
 
-	r = kvfs_put(cookie->store, chunk);
-	if (r < 0) {
-		goto cleanup;
-	}
+	r = chunk_create_batch(chunks, data, lengths, 0, false, NULL, count);
 
-	r = kvfs_stdio_writer_save_key(cookie, chunk_key(chunk));
-	if (r < 0) {
-		goto cleanup;
+	if (r >= 0 && !cookie->putter && cookie->dedup == KVFS_DEDUP_NONE) {
+		/* nothing to check first, so store the whole batch at once */
+		r = kvfs_put_many(cookie->store, chunks, count, errors);
+		for (size_t i = 0; r >= 0 && i < count; ++i) {
+			r = kvfs_builder_add(&cookie->builder, chunk_key(chunks[i]));
+		}
+	} else {
+		for (size_t i = 0; r >= 0 && i < count; ++i) {
+			r = kvfs_stdio_writer_commit(cookie, chunks[i]);
+		}
 	}
 
-	r = cookie->offset;
-	cookie->offset = 0;
-
-cleanup:
-	if (chunk) {
-		chunk_free(chunk);
+	for (size_t i = 0; i < count; ++i) {
+		if (chunks[i]) {
+			chunk_free(chunks[i]);
+		}
 	}
 
-	return r;
+	return (r < 0) ? -1 : (int)length;
 }
 
 static int kvfs_stdio_writer_write(void* _cookie, const char* buf, int size)
 {
 	kvfs_write_cookie_t* cookie = _cookie;
+	const size_t batch = kvfs_stdio_batch * chunk_maxlength;
 
-	/* how much fits in the current chunk */
-	int avail = chunk_maxlength - cookie->offset;
+	if (cookie->pipeline) {
+		return kvfs_pipeline_write(cookie->pipeline, (const uint8_t*)buf, size) < 0 ? -1 : size;
+	}
+
+	if (cookie->offset == 0 && size >= (int)chunk_maxlength) {
+		/* if there are whole chunks, hash them in place to avoid the copy */
+		size_t amount = size - size % chunk_maxlength;
+		return kvfs_stdio_writer_emit(cookie, (const uint8_t*)buf, amount < batch ? amount : batch);
+	}
+
+	/* how much fits in the current batch */
+	size_t avail = batch - cookie->offset;
 
 	/* how much do we actually copy */
-	int amount = avail < size ? avail : size;
+	size_t amount = avail < (size_t)size ? avail : (size_t)size;
 
-	if (cookie->offset == 0 && amount == (int)chunk_maxlength) {
-		/* if it's a whole chunk, avoid the copy */
-		cookie->offset = chunk_maxlength;
-		return kvfs_stdio_writer_emit(cookie, buf);
-	} else {
-		memcpy(cookie->buffer + cookie->offset, buf, amount);
-		cookie->offset += amount;
-		assert(cookie->offset <= chunk_maxlength);
-		if (cookie->offset == chunk_maxlength) {
-			return kvfs_stdio_writer_emit(cookie, cookie->buffer);
-		} else {
-			return amount;
+	memcpy(cookie->buffer + cookie->offset, buf, amount);
+	cookie->offset += amount;
+	assert(cookie->offset <= batch);
+	if (cookie->offset == batch) {
+		if (kvfs_stdio_writer_emit(cookie, cookie->buffer, batch) < 0) {
+			return -1;
 		}
+		cookie->offset = 0;
 	}
+
+	return amount;
 }
 
-/* required with glibc because fopencookie can't cope with short writes,
- * but also provides a handy helper for the close function since it does
- * output the whole buffer */
+/* required with glibc because fopencookie can't cope with short writes */
 static ssize_t kvfs_stdio_writer_wrapper(void* cookie, const char* buf, size_t size)
 {
 	size_t written = 0;
@@ -365,27 +593,29 @@ static int kvfs_stdio_writer_close(void* _cookie)
 	kvfs_write_cookie_t* cookie = _cookie;
 	int r = 0;
 
-	if (cookie->offset) {
-		r = kvfs_stdio_writer_emit(cookie, cookie->buffer);
-		if (r < 0) {
-			return r;
-		}
+	if (cookie->pipeline) {
+		r = kvfs_pipeline_finish(cookie->pipeline);
+	} else if (cookie->offset) {
+		r = kvfs_stdio_writer_emit(cookie, cookie->buffer, cookie->offset);
 	}
 
-	/* if there's more than one key in the keybuffer then
-	 * the keybuffer needs to be serialised, too */
-	if (cookie->keybuffer_offset > chunk_keylength) {
-		// TODO: error checks
-		kvfs_write_cookie_t* next = kvfs_stdio_writer_alloc(cookie->store, cookie->depth + 1);
-		if (next) {
-			r = kvfs_stdio_writer_wrapper(next, cookie->keybuffer, cookie->keybuffer_offset);
-			r = kvfs_stdio_writer_close(next);
-		} else {
-			r = -1;
-		}
+	/* store what's left of the upper levels */
+	uint8_t root[chunk_keylength];
+	if (r >= 0) {
+		r = kvfs_builder_finish(&cookie->builder, root);
+	}
+
+	/* the earliest failed put in the stream takes precedence */
+	if (cookie->putter && kvfs_putter_finish(cookie->putter) < 0) {
+		r = -1;
+	}
+
+	/* the root is only of use once everything under it is stored */
+	if (r > 0) {
+		memcpy(cookie->store->last, root, chunk_keylength);
 	}
 
 	kvfs_stdio_writer_free(cookie);
 
-	return r;
+	return (r < 0) ? -1 : 0;
 }
@@ -0,0 +1,743 @@
+/*
+ * kvfs_tree.c
+ *
+ * helpers that work out the shape of a tree from its keys.
+ *
+ * every key except the last in an indirection chunk is for a full
+ * chunk, and the writer only ever produces complete subtrees to the
+ * left of the last key, so the subtree under any non-last key at
+ * depth 'd' holds exactly kvfs_span(d) bytes.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#include <kvfs/kvfs.h>
+#include <kvfs/chunk.h>
+#include <kvfs/private.h>
+
+/*
+ * returns the number of bytes under a complete subtree whose root
+ * is at 'depth', saturating at UINT64_MAX
+ */
+uint64_t kvfs_span(uint8_t depth)
+{
+	if (depth > kvfs_maxdepth) {
+		return UINT64_MAX;
+	}
+
+	uint64_t span = chunk_maxlength;
+	while (depth--) {
+		span *= chunk_maxkeys;
+	}
+
+	return span;
+}
+
+/*
+ * calculates the size of the file under 'key' by following the
+ * rightmost keys down the tree, fetching one chunk per level
+ */
+int kvfs_tree_size(kvfs_store_t* store, const uint8_t* key, uint64_t* size)
+{
+	uint8_t current[chunk_keylength];
+	uint64_t total = 0;
+
+	if (chunk_depth_from_key(key) > kvfs_maxdepth) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	memcpy(current, key, chunk_keylength);
+
+	for (uint8_t depth; (depth = chunk_depth_from_key(current)) > 0; ) {
+		chunk_t* chunk = kvfs_get(store, current);
+		if (!chunk) {
+			return -1;
+		}
+
+		uint16_t keys = chunk_length(chunk) / chunk_keylength;
+		total += (uint64_t)(keys - 1) * kvfs_span(depth - 1);
+		memcpy(current, chunk_data(chunk) + (keys - 1) * chunk_keylength, chunk_keylength);
+		chunk_free(chunk);
+	}
+
+	/* the length of the last leaf is in its key */
+	*size = total + chunk_length_from_key(current);
+
+	return 0;
+}
+
+/*
+ * describes the file under 'root' without reading it, fetching just
+ * the indirection chunks down the right hand edge of the tree
+ */
+int kvfs_stat(kvfs_store_t* store, const uint8_t* root, kvfs_stat_t* info)
+{
+	uint64_t size;
+
+	if (!store || !root || !info) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (kvfs_tree_size(store, root, &size) < 0) {
+		return -1;
+	}
+
+	info->size = size;
+	info->depth = chunk_depth_from_key(root);
+
+	/* the tree is canonical, so the chunk count follows from the size */
+	uint64_t count = size ? (size + chunk_maxlength - 1) / chunk_maxlength : 1;
+	info->chunks = count;
+	for (uint8_t depth = 1; depth <= info->depth; ++depth) {
+		count = (count + chunk_maxkeys - 1) / chunk_maxkeys;
+		info->chunks += count;
+	}
+
+	return 0;
+}
+
+/*
+ * copies up to 'length' bytes starting 'offset' bytes into the subtree
+ * under 'key', returning the number copied, which is only short at the
+ * end of the file
+ */
+static ssize_t kvfs_tree_read(kvfs_store_t* store, const uint8_t* key, uint64_t offset, uint8_t* buf, size_t length)
+{
+	ssize_t done = 0;
+
+	chunk_t* chunk = kvfs_get(store, key);
+	if (!chunk) {
+		return -1;
+	}
+
+	uint8_t depth = chunk_depth(chunk);
+	uint16_t clength = chunk_length(chunk);
+
+	if (depth == 0) {
+		if (offset < clength) {
+			done = (clength - offset < length) ? clength - offset : length;
+			memcpy(buf, chunk_data(chunk) + offset, done);
+		}
+	} else {
+		uint64_t span = kvfs_span(depth - 1);
+		uint16_t keys = clength / chunk_keylength;
+
+		for (uint64_t index = offset / span; index < keys && (size_t)done < length; ++index) {
+			const uint8_t* child = chunk_data(chunk) + index * chunk_keylength;
+			ssize_t r = kvfs_tree_read(store, child, offset + done - index * span, buf + done, length - done);
+			if (r < 0) {
+				done = -1;
+				break;
+			} else if (r == 0) {
+				break;
+			}
+			done += r;
+		}
+	}
+
+	chunk_free(chunk);
+
+	return done;
+}
+
+/*
+ * reads from the file under 'root' at the given offset, fetching only
+ * the subtrees that overlap the requested range.  no state is kept
+ * between calls, so it's safe to call from many threads at once.
+ */
+ssize_t kvfs_pread(kvfs_store_t* store, const uint8_t* root, uint64_t offset, void* buf, size_t length)
+{
+	if (!store || !root || (!buf && length)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (chunk_depth_from_key(root) > kvfs_maxdepth) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (length > SSIZE_MAX) {
+		length = SSIZE_MAX;
+	}
+
+	if (length == 0) {
+		return 0;
+	}
+
+	return kvfs_tree_read(store, root, offset, buf, length);
+}
+
+/* does the range overlap [start, end) */
+static bool kvfs_range_overlaps(const kvfs_range_t* range, uint64_t start, uint64_t end)
+{
+	return range->length && range->offset < end && range->offset + range->length > start;
+}
+
+/*
+ * copies out of, or descends into, a chunk whose first byte is at
+ * 'base', for each of the ranges that overlap it.  the children of an
+ * indirection chunk that are needed are all fetched at once.
+ */
+static void kvfs_tree_readv(kvfs_store_t* store, chunk_t* chunk, uint64_t base,
+							kvfs_range_t* ranges, size_t count, int* error)
+{
+	uint8_t depth = chunk_depth(chunk);
+	uint16_t length = chunk_length(chunk);
+
+	if (depth == 0) {
+		for (size_t i = 0; i < count; ++i) {
+			kvfs_range_t* range = &ranges[i];
+			if (range->result < 0 || !kvfs_range_overlaps(range, base, base + length)) {
+				continue;
+			}
+			uint64_t start = range->offset > base ? range->offset : base;
+			uint64_t end = range->offset + range->length < base + length ? range->offset + range->length : base + length;
+			memcpy((uint8_t*)range->buf + (start - range->offset), chunk_data(chunk) + (start - base), end - start);
+			range->result += end - start;
+		}
+		return;
+	}
+
+	uint8_t keys[chunk_maxkeys * chunk_keylength];
+	uint64_t bases[chunk_maxkeys];
+	chunk_t* children[chunk_maxkeys];
+	size_t needed = 0;
+
+	uint64_t span = kvfs_span(depth - 1);
+	for (uint16_t index = 0; index < length / chunk_keylength; ++index) {
+		uint64_t start = base + index * span;
+		for (size_t i = 0; i < count; ++i) {
+			if (ranges[i].offset >= start + span) {
+				break;
+			}
+			if (ranges[i].result >= 0 && kvfs_range_overlaps(&ranges[i], start, start + span)) {
+				memcpy(keys + needed * chunk_keylength, chunk_data(chunk) + index * chunk_keylength, chunk_keylength);
+				bases[needed++] = start;
+				break;
+			}
+		}
+	}
+
+	if (kvfs_get_parallel(store, keys, needed, children) < 0 && !*error) {
+		*error = errno;
+	}
+
+	for (size_t n = 0; n < needed; ++n) {
+		if (children[n]) {
+			kvfs_tree_readv(store, children[n], bases[n], ranges, count, error);
+			chunk_free(children[n]);
+		} else {
+			/* fail just the ranges that needed this subtree */
+			for (size_t i = 0; i < count; ++i) {
+				if (kvfs_range_overlaps(&ranges[i], bases[n], bases[n] + span)) {
+					ranges[i].result = -1;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * reads many ranges of the same file in one pass over the tree, so
+ * each chunk is fetched (and verified) at most once however many of
+ * the ranges it serves.  the ranges must be sorted by offset.  each
+ * range's result is set to the number of bytes read, which is only
+ * short at the end of the file, or -1 if a chunk it needed couldn't
+ * be fetched.  returns -1 if any range failed.
+ */
+int kvfs_preadv(kvfs_store_t* store, const uint8_t* root, kvfs_range_t* ranges, size_t count)
+{
+	int error = 0;
+
+	if (!store || !root || (!ranges && count)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		if ((i > 0 && ranges[i].offset < ranges[i - 1].offset) ||
+			(!ranges[i].buf && ranges[i].length) ||
+			ranges[i].length > SSIZE_MAX ||
+			ranges[i].offset + ranges[i].length < ranges[i].offset)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		ranges[i].result = 0;
+	}
+
+	if (chunk_depth_from_key(root) > kvfs_maxdepth) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	chunk_t* chunk = kvfs_get(store, root);
+	if (!chunk) {
+		return -1;
+	}
+
+	kvfs_tree_readv(store, chunk, 0, ranges, count, &error);
+	chunk_free(chunk);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+//---------------------------------------------------------------------
+
+typedef struct kvfs_diff_t {
+	kvfs_store_t*			store;
+	kvfs_diff_callback_t	callback;
+	void*					context;
+	uint64_t				start;			// of the range not yet reported
+	uint64_t				length;
+} kvfs_diff_t;
+
+/*
+ * adds a differing range, which is reported once it's known not to
+ * run on into the next one
+ */
+static int kvfs_diff_emit(kvfs_diff_t* diff, uint64_t offset, uint64_t length)
+{
+	if (diff->length && diff->start + diff->length == offset) {
+		diff->length += length;
+		return 0;
+	}
+
+	if (diff->length) {
+		int r = diff->callback(diff->context, diff->start, diff->length);
+		if (r != 0) {
+			return r;
+		}
+	}
+
+	diff->start = offset;
+	diff->length = length;
+
+	return 0;
+}
+
+/*
+ * compares the subtrees under 'a' and 'b', which both start at 'offset',
+ * as far as the shorter of them goes.  equal keys mean equal subtrees,
+ * so those are skipped without being fetched.
+ */
+static int kvfs_diff_tree(kvfs_diff_t* diff, const uint8_t* a, const uint8_t* b, uint64_t offset)
+{
+	uint8_t keys[2 * chunk_keylength];
+	chunk_t* chunks[2];
+	int r = 0;
+
+	if (memcmp(a, b, chunk_keylength) == 0) {
+		return 0;
+	}
+
+	uint8_t depth_a = chunk_depth_from_key(a);
+	uint8_t depth_b = chunk_depth_from_key(b);
+
+	/* the shallower tree lies entirely within the deeper one's first child */
+	if (depth_a != depth_b) {
+		chunk_t* chunk = kvfs_get(diff->store, depth_a > depth_b ? a : b);
+		if (!chunk) {
+			return -1;
+		}
+
+		uint8_t first[chunk_keylength];
+		memcpy(first, chunk_data(chunk), chunk_keylength);
+		chunk_free(chunk);
+
+		return (depth_a > depth_b) ? kvfs_diff_tree(diff, first, b, offset)
+								   : kvfs_diff_tree(diff, a, first, offset);
+	}
+
+	memcpy(keys, a, chunk_keylength);
+	memcpy(keys + chunk_keylength, b, chunk_keylength);
+	if (kvfs_get_parallel(diff->store, keys, 2, chunks) < 0) {
+		r = -1;
+		goto cleanup;
+	}
+
+	const uint8_t* data_a = chunk_data(chunks[0]);
+	const uint8_t* data_b = chunk_data(chunks[1]);
+	uint16_t length = chunk_length(chunks[0]) < chunk_length(chunks[1]) ? chunk_length(chunks[0])
+																		: chunk_length(chunks[1]);
+
+	if (depth_a == 0) {
+		for (uint16_t i = 0; r == 0 && i < length; ) {
+			if (data_a[i] == data_b[i]) {
+				++i;
+				continue;
+			}
+
+			uint16_t j = i;
+			while (j < length && data_a[j] != data_b[j]) {
+				++j;
+			}
+			r = kvfs_diff_emit(diff, offset + i, j - i);
+			i = j;
+		}
+	} else {
+		uint64_t span = kvfs_span(depth_a - 1);
+		for (uint16_t i = 0; r == 0 && i < length / chunk_keylength; ++i) {
+			r = kvfs_diff_tree(diff, data_a + i * chunk_keylength, data_b + i * chunk_keylength, offset + i * span);
+		}
+	}
+
+cleanup:
+	for (int i = 0; i < 2; ++i) {
+		if (chunks[i]) {
+			chunk_free(chunks[i]);
+		}
+	}
+
+	return r;
+}
+
+/*
+ * reports the byte ranges that differ between the files under 'a' and
+ * 'b' to 'callback', in order, with adjacent ranges merged together.
+ * if one file is longer, everything past the end of the other differs.
+ * only the chunks where the two trees differ are fetched.  a non-zero
+ * return from the callback stops the diff and is passed back.
+ */
+int kvfs_diff(kvfs_store_t* store, const uint8_t* a, const uint8_t* b,
+			  kvfs_diff_callback_t callback, void* context)
+{
+	uint64_t size_a, size_b;
+
+	if (!store || !a || !b || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (memcmp(a, b, chunk_keylength) == 0) {
+		return 0;
+	}
+
+	if (kvfs_tree_size(store, a, &size_a) < 0 || kvfs_tree_size(store, b, &size_b) < 0) {
+		return -1;
+	}
+
+	kvfs_diff_t diff = {
+		.store = store,
+		.callback = callback,
+		.context = context
+	};
+
+	int r = kvfs_diff_tree(&diff, a, b, 0);
+
+	if (r == 0 && size_a != size_b) {
+		uint64_t shorter = size_a < size_b ? size_a : size_b;
+		uint64_t longer = size_a < size_b ? size_b : size_a;
+		r = kvfs_diff_emit(&diff, shorter, longer - shorter);
+	}
+
+	if (r == 0 && diff.length) {
+		r = callback(context, diff.start, diff.length);
+	}
+
+	return r;
+}
+
+//---------------------------------------------------------------------
+
+/*
+ * overwrites the bytes at 'offset' within the subtree under 'key', which
+ * must all lie inside it, and stores new chunks down to the leaves that
+ * changed.  the new subtree's key is written to 'out', which may be
+ * 'key' itself.  leaves that are overwritten completely aren't fetched.
+ */
+static int kvfs_tree_patch(kvfs_store_t* store, const uint8_t* key, uint64_t offset,
+						   const uint8_t* data, size_t length, uint8_t* out)
+{
+	uint8_t buffer[chunk_maxlength];
+	uint8_t depth = chunk_depth_from_key(key);
+	uint16_t clength = chunk_length_from_key(key);
+
+	if (depth > 0 || offset > 0 || length < clength) {
+		chunk_t* chunk = kvfs_get(store, key);
+		if (!chunk) {
+			return -1;
+		}
+		memcpy(buffer, chunk_data(chunk), clength);
+		chunk_free(chunk);
+	}
+
+	if (depth == 0) {
+		memcpy(buffer + offset, data, length);
+	} else {
+		uint64_t span = kvfs_span(depth - 1);
+		uint16_t keys = clength / chunk_keylength;
+		size_t done = 0;
+
+		for (uint64_t index = offset / span; index < keys && done < length; ++index) {
+			uint64_t start = offset + done - index * span;
+			size_t n = (span - start < length - done) ? span - start : length - done;
+			uint8_t* child = buffer + index * chunk_keylength;
+
+			if (kvfs_tree_patch(store, child, start, data + done, n, child) < 0) {
+				return -1;
+			}
+			done += n;
+		}
+	}
+
+	chunk_t* chunk = chunk_create(buffer, clength, depth, false, NULL);
+	if (!chunk) {
+		return -1;
+	}
+
+	int r = kvfs_store_put(store, chunk);
+	if (r == 0) {
+		memcpy(out, chunk_key(chunk), chunk_keylength);
+	}
+	chunk_free(chunk);
+
+	return r;
+}
+
+/*
+ * overwrites 'length' bytes of the file under 'root' from 'offset'
+ * onwards, copying the new file's key to 'new_root'.  only the leaves
+ * that overlap the range and the chunks above them are replaced, and
+ * every other subtree is shared with the old file.  writing past the
+ * end extends the file, but it can't start beyond the end.
+ */
+int kvfs_patch(kvfs_store_t* store, const uint8_t* root, uint64_t offset,
+			   const void* data, size_t length, uint8_t* new_root)
+{
+	uint8_t key[chunk_keylength];
+	uint64_t size;
+
+	if (!store || !root || (length && !data) || !new_root) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (kvfs_tree_size(store, root, &size) < 0) {
+		return -1;
+	}
+
+	if (offset > size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	size_t inside = (size - offset < length) ? size - offset : length;
+	memcpy(key, root, chunk_keylength);
+
+	if (inside && kvfs_tree_patch(store, key, offset, data, inside, key) < 0) {
+		return -1;
+	}
+
+	return kvfs_append(store, key, (const uint8_t*)data + inside, length - inside, new_root);
+}
+
+//---------------------------------------------------------------------
+
+/*
+ * a cursor enumerates the leaf keys of a tree from left to right,
+ * holding just the one indirection chunk per level on the path to
+ * the current leaf
+ */
+
+static chunk_t* kvfs_cursor_get(kvfs_cursor_t* cursor, const uint8_t* key)
+{
+	chunk_t* chunk = cursor->prefetch ? kvfs_prefetch_take(cursor->prefetch, key) : NULL;
+	return chunk ? chunk : kvfs_get(cursor->store, key);
+}
+
+/* replaces the chunk held at 'depth' with the one for 'key' */
+static int kvfs_cursor_load(kvfs_cursor_t* cursor, uint8_t depth, const uint8_t* key)
+{
+	if (cursor->chunks[depth]) {
+		chunk_free(cursor->chunks[depth]);
+	}
+	cursor->next[depth] = 0;
+	cursor->hinted[depth] = 0;
+	cursor->chunks[depth] = kvfs_cursor_get(cursor, key);
+	if (!cursor->chunks[depth]) {
+		return -1;
+	}
+	if (chunk_depth(cursor->chunks[depth]) != depth) {
+		errno = KVFS_BAD_INDIRECT_DEPTH;
+		return -1;
+	}
+
+	/*
+	 * fetch the rest of the indirection chunks at this level in the
+	 * background.  at the bottom level just the next one is enough to
+	 * cover the boundary, and leaves the window to the leaves.
+	 */
+	if (cursor->prefetch && depth < cursor->depth) {
+		chunk_t* parent = cursor->chunks[depth + 1];
+		uint16_t from = cursor->next[depth + 1];
+		if (cursor->hinted[depth + 1] > from) {
+			from = cursor->hinted[depth + 1];
+		}
+		size_t count = (chunk_length(parent) - from) / chunk_keylength;
+		if (depth == 1 && count > 1) {
+			count = 1;
+		}
+		size_t n = kvfs_prefetch_hint(cursor->prefetch, chunk_data(parent) + from, count);
+		cursor->hinted[depth + 1] = from + n * chunk_keylength;
+	}
+
+	return 0;
+}
+
+/*
+ * positions the cursor so that the next key returned is for the leaf
+ * holding byte 'offset', and sets 'skip' to that byte's offset within
+ * the leaf.  'prefetch' is optional and is used to read ahead the
+ * indirection chunks.
+ */
+int kvfs_cursor_open(kvfs_cursor_t* cursor, kvfs_store_t* store, const uint8_t* root,
+					 uint64_t offset, kvfs_prefetch_t* prefetch, uint64_t* skip)
+{
+	memset(cursor, 0, sizeof *cursor);
+	cursor->store = store;
+	cursor->prefetch = prefetch;
+	cursor->depth = chunk_depth_from_key(root);
+	memcpy(cursor->root, root, chunk_keylength);
+
+	if (cursor->depth > kvfs_maxdepth) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (cursor->depth == 0) {
+		*skip = offset;
+		return 0;
+	}
+
+	cursor->chunks[cursor->depth] = kvfs_get(store, root);
+	if (!cursor->chunks[cursor->depth]) {
+		return -1;
+	}
+
+	for (uint8_t depth = cursor->depth; depth > 0; --depth) {
+		uint64_t span = kvfs_span(depth - 1);
+		uint64_t index = offset / span;
+		uint16_t length = chunk_length(cursor->chunks[depth]);
+
+		/* past the end, so leave the cursor exhausted */
+		if (index >= (uint64_t)(length / chunk_keylength)) {
+			cursor->next[depth] = length;
+			cursor->done = true;
+			*skip = 0;
+			return 0;
+		}
+
+		cursor->next[depth] = index * chunk_keylength;
+		offset -= index * span;
+
+		if (depth > 1) {
+			const uint8_t* key = chunk_data(cursor->chunks[depth]) + cursor->next[depth];
+			cursor->next[depth] += chunk_keylength;
+			if (kvfs_cursor_load(cursor, depth - 1, key) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	*skip = offset;
+
+	return 0;
+}
+
+/*
+ * copies the next leaf key into 'key', returning 1 if there was one,
+ * 0 at the end of the tree or -1 on error
+ */
+int kvfs_cursor_next(kvfs_cursor_t* cursor, uint8_t* key)
+{
+	if (cursor->done) {
+		return 0;
+	}
+
+	if (cursor->depth == 0) {
+		memcpy(key, cursor->root, chunk_keylength);
+		cursor->done = true;
+		return 1;
+	}
+
+	/* find the lowest level with keys left */
+	uint8_t depth = 1;
+	while (depth <= cursor->depth &&
+		   (!cursor->chunks[depth] || cursor->next[depth] >= chunk_length(cursor->chunks[depth])))
+	{
+		++depth;
+	}
+
+	if (depth > cursor->depth) {
+		cursor->done = true;
+		return 0;
+	}
+
+	/* and then back down to the leaves */
+	for (; depth > 1; --depth) {
+		const uint8_t* child = chunk_data(cursor->chunks[depth]) + cursor->next[depth];
+		cursor->next[depth] += chunk_keylength;
+		if (kvfs_cursor_load(cursor, depth - 1, child) < 0) {
+			return -1;
+		}
+	}
+
+	memcpy(key, chunk_data(cursor->chunks[1]) + cursor->next[1], chunk_keylength);
+	cursor->next[1] += chunk_keylength;
+
+	return 1;
+}
+
+/*
+ * fetches the next leaf chunk into 'leaf', returning 1 if there was
+ * one, 0 at the end of the tree or -1 on error.  if the cursor has a
+ * prefetcher the following leaves are read ahead, too.
+ */
+int kvfs_cursor_next_leaf(kvfs_cursor_t* cursor, chunk_t** leaf)
+{
+	uint8_t key[chunk_keylength];
+
+	int r = kvfs_cursor_next(cursor, key);
+	if (r <= 0) {
+		return r;
+	}
+
+	if (cursor->prefetch && cursor->depth > 0) {
+		chunk_t* parent = cursor->chunks[1];
+		uint16_t from = cursor->next[1] - chunk_keylength;
+		if (cursor->hinted[1] > from) {
+			from = cursor->hinted[1];
+		}
+		size_t n = kvfs_prefetch_hint(cursor->prefetch, chunk_data(parent) + from,
+									  (chunk_length(parent) - from) / chunk_keylength);
+		cursor->hinted[1] = from + n * chunk_keylength;
+	}
+
+	*leaf = kvfs_cursor_get(cursor, key);
+
+	return *leaf ? 1 : -1;
+}
+
+void kvfs_cursor_close(kvfs_cursor_t* cursor)
+{
+	for (size_t i = 0; i <= kvfs_maxdepth; ++i) {
+		if (cursor->chunks[i]) {
+			chunk_free(cursor->chunks[i]);
+			cursor->chunks[i] = NULL;
+		}
+	}
+}
@@ -0,0 +1,122 @@
+/*
+ * kvfs_workq.c
+ *
+ * a small pool of worker threads shared by everything using a store.
+ *
+ * work items are intrusive - callers embed a kvfs_work_t in their own
+ * structures - so submitting work never allocates.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <kvfs/private.h>
+
+struct kvfs_workq_t {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	kvfs_work_t*		head;
+	kvfs_work_t*		tail;
+	bool				stopping;
+	unsigned int		count;
+	pthread_t			threads[];
+};
+
+static void* kvfs_workq_run(void* arg)
+{
+	kvfs_workq_t* workq = arg;
+
+	pthread_mutex_lock(&workq->lock);
+	for (;;) {
+		while (!workq->head && !workq->stopping) {
+			pthread_cond_wait(&workq->cond, &workq->lock);
+		}
+
+		/* finish any queued work before stopping */
+		kvfs_work_t* work = workq->head;
+		if (!work) {
+			break;
+		}
+
+		workq->head = work->next;
+		if (!workq->head) {
+			workq->tail = NULL;
+		}
+
+		pthread_mutex_unlock(&workq->lock);
+		work->run(work);
+		pthread_mutex_lock(&workq->lock);
+	}
+	pthread_mutex_unlock(&workq->lock);
+
+	return NULL;
+}
+
+kvfs_workq_t* kvfs_workq_create(unsigned int threads)
+{
+	if (threads == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	kvfs_workq_t* workq = calloc(1, sizeof *workq + threads * sizeof(pthread_t));
+	if (!workq) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&workq->lock, NULL);
+	pthread_cond_init(&workq->cond, NULL);
+
+	for (; workq->count < threads; ++workq->count) {
+		if (pthread_create(&workq->threads[workq->count], NULL, kvfs_workq_run, workq) != 0) {
+			kvfs_workq_free(workq);
+			errno = EAGAIN;
+			return NULL;
+		}
+	}
+
+	return workq;
+}
+
+/*
+ * runs whatever work is still queued, then stops the threads
+ */
+void kvfs_workq_free(kvfs_workq_t* workq)
+{
+	if (!workq) {
+		return;
+	}
+
+	pthread_mutex_lock(&workq->lock);
+	workq->stopping = true;
+	pthread_cond_broadcast(&workq->cond);
+	pthread_mutex_unlock(&workq->lock);
+
+	for (unsigned int i = 0; i < workq->count; ++i) {
+		pthread_join(workq->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&workq->cond);
+	pthread_mutex_destroy(&workq->lock);
+	free(workq);
+}
+
+/*
+ * queues 'work' to be run on one of the threads.  the caller must keep
+ * it alive until its run function has been called.
+ */
+void kvfs_workq_submit(kvfs_workq_t* workq, kvfs_work_t* work)
+{
+	work->next = NULL;
+
+	pthread_mutex_lock(&workq->lock);
+	if (workq->tail) {
+		workq->tail->next = work;
+	} else {
+		workq->head = work;
+	}
+	workq->tail = work;
+	pthread_cond_signal(&workq->cond);
+	pthread_mutex_unlock(&workq->lock);
+}
@@ -0,0 +1,496 @@
+/*
+ * sha256.c
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <kvfs/sha256.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/*
+ * each implementation compresses a run of whole 64 byte blocks
+ * into the running state - padding is handled once, in kvfs_sha256()
+ */
+typedef void (*sha256_blocks_t)(uint32_t* state, const uint8_t* data, size_t blocks);
+
+static void sha256_blocks_scalar(uint32_t* state, const uint8_t* data, size_t blocks);
+#ifdef SHA256_X86
+static void sha256_blocks_avx2(uint32_t* state, const uint8_t* data, size_t blocks);
+static void sha256_blocks_shani(uint32_t* state, const uint8_t* data, size_t blocks);
+#endif
+
+#ifdef SHA256_X86
+static void sha256_batch_avx2(const uint8_t* const* data, const size_t* length, uint8_t* digests, size_t count);
+#endif
+
+static const sha256_blocks_t sha256_impls[KVFS_SHA256_LAST] = {
+	[KVFS_SHA256_SCALAR] = sha256_blocks_scalar,
+#ifdef SHA256_X86
+	[KVFS_SHA256_AVX2] = sha256_blocks_avx2,
+	[KVFS_SHA256_SHANI] = sha256_blocks_shani,
+#endif
+};
+
+static kvfs_sha256_impl_t sha256_impl = KVFS_SHA256_SCALAR;
+static sha256_blocks_t sha256_blocks = sha256_blocks_scalar;
+
+static const uint32_t sha256_h0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_k[64] __attribute__((aligned(32))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/*
+ * the number of blocks needed for the padded end of the message
+ */
+static inline size_t sha256_tail_blocks(size_t length)
+{
+	return (length % sha256_blocklength < sha256_blocklength - 8) ? 1 : 2;
+}
+
+/*
+ * copies the last partial block of a message into 'tail', followed
+ * by the SHA-256 padding and the message length in bits
+ */
+static void sha256_pad(uint8_t* tail, const uint8_t* rest, size_t length)
+{
+	size_t rest_length = length % sha256_blocklength;
+	size_t tail_length = sha256_tail_blocks(length) * sha256_blocklength;
+	uint64_t bits = (uint64_t)length << 3;
+
+	memcpy(tail, rest, rest_length);
+	tail[rest_length] = 0x80;
+	memset(tail + rest_length + 1, 0, tail_length - rest_length - 1);
+	for (size_t i = 1; i <= 8; ++i, bits >>= 8) {
+		tail[tail_length - i] = bits & 0xff;
+	}
+}
+
+static void sha256_digest(const uint32_t* state, uint8_t* digest)
+{
+	for (int i = 0; i < 8; ++i) {
+		*digest++ = state[i] >> 24;
+		*digest++ = state[i] >> 16;
+		*digest++ = state[i] >> 8;
+		*digest++ = state[i];
+	}
+}
+
+/*
+ * hashes the data using the best implementation available
+ * on this CPU.  The result is identical to ldns_sha256().
+ */
+void kvfs_sha256(const uint8_t* data, size_t length, uint8_t* digest)
+{
+	uint32_t state[8];
+	uint8_t tail[2 * sha256_blocklength];
+	size_t blocks = length / sha256_blocklength;
+
+	memcpy(state, sha256_h0, sizeof state);
+	sha256_blocks(state, data, blocks);
+	sha256_pad(tail, data + blocks * sha256_blocklength, length);
+	sha256_blocks(state, tail, sha256_tail_blocks(length));
+	sha256_digest(state, digest);
+}
+
+/*
+ * hashes 'count' independent messages, writing the digests
+ * consecutively into 'digests'.  With AVX2 selected, runs of
+ * equal length messages are hashed eight at a time, one per
+ * vector lane.
+ */
+void kvfs_sha256_batch(const uint8_t* const* data, const size_t* length, uint8_t* digests, size_t count)
+{
+#ifdef SHA256_X86
+	if (sha256_impl == KVFS_SHA256_AVX2) {
+		sha256_batch_avx2(data, length, digests, count);
+		return;
+	}
+#endif
+
+	for (size_t i = 0; i < count; ++i) {
+		kvfs_sha256(data[i], length[i], digests + i * sha256_digestlength);
+	}
+}
+
+/*
+ * returns the implementation currently in use
+ */
+kvfs_sha256_impl_t kvfs_sha256_impl(void)
+{
+	return sha256_impl;
+}
+
+/*
+ * checks whether the CPU can run the given implementation
+ */
+bool kvfs_sha256_supported(kvfs_sha256_impl_t impl)
+{
+	switch (impl) {
+		case KVFS_SHA256_SCALAR:
+			return true;
+#ifdef SHA256_X86
+		case KVFS_SHA256_AVX2:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+		case KVFS_SHA256_SHANI: {
+			unsigned int eax, ebx, ecx, edx;
+			__builtin_cpu_init();
+			if (!__builtin_cpu_supports("sse4.1")) {
+				return false;
+			}
+			if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+				return false;
+			}
+			return (ebx & bit_SHA) != 0;
+		}
+#endif
+		default:
+			return false;
+	}
+}
+
+/*
+ * forces a specific implementation - mostly useful for testing
+ */
+int kvfs_sha256_select(kvfs_sha256_impl_t impl)
+{
+	if (impl >= KVFS_SHA256_LAST || !kvfs_sha256_supported(impl)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	sha256_impl = impl;
+	sha256_blocks = sha256_impls[impl];
+
+	return 0;
+}
+
+/*
+ * picks the fastest supported implementation once, at load time
+ */
+__attribute__((constructor))
+static void sha256_init(void)
+{
+	for (int impl = KVFS_SHA256_LAST - 1; impl >= 0; --impl) {
+		if (kvfs_sha256_supported(impl)) {
+			kvfs_sha256_select(impl);
+			break;
+		}
+	}
+}
+
+//---------------------------------------------------------------------
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define S0(x)		(ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x)		(ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define s0(x)		(ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define s1(x)		(ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+#define CH(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+static inline uint32_t load_be32(const uint8_t* p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/*
+ * the 64 rounds, given the message schedule with the round
+ * constants already added in.  Inlined into each implementation
+ * so that it picks up that implementation's instruction set.
+ */
+static inline __attribute__((always_inline))
+void sha256_rounds(uint32_t* state, const uint32_t* wk)
+{
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (int t = 0; t < 64; ++t) {
+		uint32_t t1 = h + S1(e) + CH(e, f, g) + wk[t];
+		uint32_t t2 = S0(a) + MAJ(a, b, c);
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256_blocks_scalar(uint32_t* state, const uint8_t* data, size_t blocks)
+{
+	uint32_t w[64];
+
+	for ( ; blocks > 0; --blocks, data += sha256_blocklength) {
+		for (int t = 0; t < 16; ++t) {
+			w[t] = load_be32(data + 4 * t);
+		}
+		for (int t = 16; t < 64; ++t) {
+			w[t] = s1(w[t - 2]) + w[t - 7] + s0(w[t - 15]) + w[t - 16];
+		}
+		for (int t = 0; t < 64; ++t) {
+			w[t] += sha256_k[t];
+		}
+		sha256_rounds(state, w);
+	}
+}
+
+#ifdef SHA256_X86
+
+#define AVX2_ROR(x, n)	_mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define AVX2_s0(x)		_mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(x, 7), AVX2_ROR(x, 18)), _mm256_srli_epi32(x, 3))
+#define AVX2_s1(x)		_mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(x, 17), AVX2_ROR(x, 19)), _mm256_srli_epi32(x, 10))
+
+/*
+ * computes the message schedules of two blocks at once, one
+ * per 128 bit lane, four words at a time.  The rounds themselves
+ * stay scalar but get BMI2's non-destructive rotates.
+ */
+__attribute__((target("avx2,bmi2")))
+static void sha256_blocks_avx2(uint32_t* state, const uint8_t* data, size_t blocks)
+{
+	uint32_t wk[2][64] __attribute__((aligned(32)));
+	const __m256i bswap = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m256i zero = _mm256_setzero_si256();
+
+	while (blocks > 0) {
+		/* an odd last block is paired with itself */
+		const uint8_t* lo = data;
+		const uint8_t* hi = (blocks > 1) ? data + sha256_blocklength : data;
+		__m256i x[4];
+
+		for (int j = 0; j < 16; ++j) {
+			__m256i w;
+			if (j < 4) {
+				w = _mm256_inserti128_si256(
+						_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(lo + 16 * j))),
+						_mm_loadu_si128((const __m128i*)(hi + 16 * j)), 1);
+				w = _mm256_shuffle_epi8(w, bswap);
+			} else {
+				/* W[t-16] + s0(W[t-15]) + W[t-7] */
+				__m256i w16 = x[j & 3];
+				__m256i w15 = _mm256_alignr_epi8(x[(j + 1) & 3], x[j & 3], 4);
+				__m256i w7 = _mm256_alignr_epi8(x[(j + 3) & 3], x[(j + 2) & 3], 4);
+				w = _mm256_add_epi32(_mm256_add_epi32(w16, AVX2_s0(w15)), w7);
+
+				/* s1(W[t-2]) for the first two words comes from the previous group */
+				__m256i w2 = _mm256_shuffle_epi32(x[(j + 3) & 3], _MM_SHUFFLE(1, 0, 3, 2));
+				w = _mm256_add_epi32(w, _mm256_blend_epi32(AVX2_s1(w2), zero, 0xcc));
+
+				/* ... and for the last two, from the words just computed */
+				w2 = _mm256_shuffle_epi32(w, _MM_SHUFFLE(1, 0, 1, 0));
+				w = _mm256_add_epi32(w, _mm256_blend_epi32(AVX2_s1(w2), zero, 0x33));
+			}
+			x[j & 3] = w;
+
+			__m256i k = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)&sha256_k[4 * j]));
+			w = _mm256_add_epi32(w, k);
+			_mm_store_si128((__m128i*)&wk[0][4 * j], _mm256_castsi256_si128(w));
+			_mm_store_si128((__m128i*)&wk[1][4 * j], _mm256_extracti128_si256(w, 1));
+		}
+
+		sha256_rounds(state, wk[0]);
+		if (blocks > 1) {
+			sha256_rounds(state, wk[1]);
+			blocks -= 2;
+			data += 2 * sha256_blocklength;
+		} else {
+			blocks -= 1;
+			data += sha256_blocklength;
+		}
+	}
+}
+
+#define SHANI_ROUNDS(msg, j) do { \
+	__m128i t = _mm_add_epi32(msg, _mm_load_si128((const __m128i*)&sha256_k[4 * (j)])); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, t); \
+	t = _mm_shuffle_epi32(t, 0x0e); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, t); \
+} while (0)
+
+#define SHANI_SCHEDULE(m0, m1, m2, m3) \
+	m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), _mm_alignr_epi8(m3, m2, 4)), m3)
+
+/*
+ * uses the dedicated SHA extensions, which keep the state
+ * packed as ABEF / CDGH pairs
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t* state, const uint8_t* data, size_t blocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+	__m128i state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+	__m128i state0;
+
+	tmp = _mm_shuffle_epi32(tmp, 0xb1);
+	state1 = _mm_shuffle_epi32(state1, 0x1b);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+	for ( ; blocks > 0; --blocks, data += sha256_blocklength) {
+		__m128i save0 = state0;
+		__m128i save1 = state1;
+		__m128i m0, m1, m2, m3;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), bswap);
+		SHANI_ROUNDS(m0, 0);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), bswap);
+		SHANI_ROUNDS(m1, 1);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), bswap);
+		SHANI_ROUNDS(m2, 2);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), bswap);
+		SHANI_ROUNDS(m3, 3);
+
+		for (int j = 4; j < 16; j += 4) {
+			SHANI_SCHEDULE(m0, m1, m2, m3);
+			SHANI_ROUNDS(m0, j);
+			SHANI_SCHEDULE(m1, m2, m3, m0);
+			SHANI_ROUNDS(m1, j + 1);
+			SHANI_SCHEDULE(m2, m3, m0, m1);
+			SHANI_ROUNDS(m2, j + 2);
+			SHANI_SCHEDULE(m3, m0, m1, m2);
+			SHANI_ROUNDS(m3, j + 3);
+		}
+
+		state0 = _mm_add_epi32(state0, save0);
+		state1 = _mm_add_epi32(state1, save1);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i*)&state[0], state0);
+	_mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+typedef uint32_t sha256_v8 __attribute__((vector_size(32)));
+
+#define V8_ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+/*
+ * compresses one run of blocks from each of eight messages in
+ * parallel.  Every lane must have the same number of blocks.
+ * The state is transposed, so that state[i] holds word 'i' of
+ * all eight messages.
+ */
+__attribute__((target("avx2")))
+static void sha256_blocks_x8(sha256_v8* state, const uint8_t* const* data, size_t blocks)
+{
+	sha256_v8 w[16];
+
+	for (size_t block = 0; block < blocks; ++block) {
+		size_t base = block * sha256_blocklength;
+		sha256_v8 a = state[0], b = state[1], c = state[2], d = state[3];
+		sha256_v8 e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (int t = 0; t < 64; ++t) {
+			if (t < 16) {
+				for (int lane = 0; lane < 8; ++lane) {
+					w[t][lane] = load_be32(data[lane] + base + 4 * t);
+				}
+			} else {
+				sha256_v8 w2 = w[(t - 2) & 15], w15 = w[(t - 15) & 15];
+				w[t & 15] += (V8_ROR(w2, 17) ^ V8_ROR(w2, 19) ^ (w2 >> 10))
+						   + w[(t - 7) & 15]
+						   + (V8_ROR(w15, 7) ^ V8_ROR(w15, 18) ^ (w15 >> 3));
+			}
+
+			sha256_v8 t1 = h + (V8_ROR(e, 6) ^ V8_ROR(e, 11) ^ V8_ROR(e, 25))
+							 + ((e & f) ^ (~e & g)) + sha256_k[t] + w[t & 15];
+			sha256_v8 t2 = (V8_ROR(a, 2) ^ V8_ROR(a, 13) ^ V8_ROR(a, 22))
+							 + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+/*
+ * groups consecutive messages of equal length eight at a time,
+ * padding short groups by repeating the first message.  Singletons
+ * aren't worth the transposition and use the two-block code instead.
+ */
+__attribute__((target("avx2")))
+static void sha256_batch_avx2(const uint8_t* const* data, const size_t* length, uint8_t* digests, size_t count)
+{
+	uint8_t tails[8][2 * sha256_blocklength];
+
+	for (size_t i = 0; i < count; ) {
+		size_t n = 1;
+		while (n < 8 && i + n < count && length[i + n] == length[i]) {
+			++n;
+		}
+
+		if (n == 1) {
+			kvfs_sha256(data[i], length[i], digests + i * sha256_digestlength);
+			++i;
+			continue;
+		}
+
+		size_t blocks = length[i] / sha256_blocklength;
+		const uint8_t* lanes[8];
+		const uint8_t* tail_lanes[8];
+		sha256_v8 state[8];
+
+		for (int lane = 0; lane < 8; ++lane) {
+			size_t k = i + ((size_t)lane < n ? (size_t)lane : 0);
+			lanes[lane] = data[k];
+			tail_lanes[lane] = tails[lane];
+			sha256_pad(tails[lane], data[k] + blocks * sha256_blocklength, length[k]);
+		}
+		for (int word = 0; word < 8; ++word) {
+			for (int lane = 0; lane < 8; ++lane) {
+				state[word][lane] = sha256_h0[word];
+			}
+		}
+
+		sha256_blocks_x8(state, lanes, blocks);
+		sha256_blocks_x8(state, tail_lanes, sha256_tail_blocks(length[i]));
+
+		for (size_t lane = 0; lane < n; ++lane) {
+			uint32_t words[8];
+			for (int word = 0; word < 8; ++word) {
+				words[word] = state[word][lane];
+			}
+			sha256_digest(words, digests + (i + lane) * sha256_digestlength);
+		}
+
+		i += n;
+	}
+}
+
+#endif
@@ -1,5 +1,8 @@
 #include <cstring>
 #include <cerrno>
+#include <thread>
+#include <vector>
+#include <kvfs/kvfs.h>
 #include <kvfs/chunk.h>
 
 #include <UnitTest++/UnitTest++.h>
@@ -59,20 +62,6 @@ SUITE(Chunk)
 		CHECK_EQUAL(EINVAL, errno);
 	}
 
-	TEST(HexFromKey)
-	{
-		const char *hex = "0000bf18a086007016e948b04aed3b82103a36bea41755b6cddfaf10ace3c6ef";
-		const uint8_t key[] = {
-			0x00, 0x00, 0xbf, 0x18, 0xa0, 0x86, 0x00, 0x70,
-			0x16, 0xe9, 0x48, 0xb0, 0x4a, 0xed, 0x3b, 0x82,
-			0x10, 0x3a, 0x36, 0xbe, 0xa4, 0x17, 0x55, 0xb6,
-			0xcd, 0xdf, 0xaf, 0x10, 0xac, 0xe3, 0xc6, 0xef
-		};
-
-		CHECK(strcmp(hex, chunk_hex_from_key(key)) == 0);
-		CHECK(memcmp(key, chunk_key_from_hex(hex), chunk_keylength) == 0);
-	}
-
 	TEST_FIXTURE(ChunkZeroX1024, Length)
 	{
 		CHECK_EQUAL(1024, chunk_length(chunk));
@@ -116,4 +105,141 @@ SUITE(Chunk)
 
 		CHECK(chunk_key_valid(chunk, key));
 	}
+
+	TEST(CreateBatch)
+	{
+		uint8_t buf[3000];
+		for (size_t i = 0; i < sizeof buf; ++i) {
+			buf[i] = i & 0xff;
+		}
+
+		const uint8_t* data[3] = { buf, buf + 1024, buf + 2048 };
+		uint16_t length[3] = { 1024, 1024, 952 };
+		chunk_t* chunks[3];
+
+		CHECK_EQUAL(0, chunk_create_batch(chunks, data, length, 0, false, NULL, 3));
+		for (int i = 0; i < 3; ++i) {
+			chunk_t* single = chunk_create(data[i], length[i], 0, false, NULL);
+			CHECK(chunks[i] && single);
+			if (chunks[i] && single) {
+				CHECK(chunk_key_valid(chunks[i], chunk_key(single)));
+				CHECK_EQUAL(length[i], chunk_length(chunks[i]));
+			}
+			chunk_free(single);
+			chunk_free(chunks[i]);
+		}
+	}
+
+	TEST(CreateBatchBadKey)
+	{
+		uint8_t buf[2048] = { 0, };
+		const uint8_t* data[2] = { buf, buf + 1024 };
+		uint16_t length[2] = { 1024, 1024 };
+		uint8_t keys[2 * chunk_keylength];
+		chunk_t* chunks[2];
+
+		chunk_calckey_batch(data, length, 0, keys, 2);
+		keys[chunk_keylength + 5] ^= 0x01;
+
+		CHECK_EQUAL(-1, chunk_create_batch(chunks, data, length, 0, false, keys, 2));
+		CHECK_EQUAL(KVFS_KEY_NOT_VALID, errno);
+		CHECK(chunks[0] != NULL);
+		CHECK(chunks[1] == NULL);
+		chunk_free(chunks[0]);
+	}
+
+	TEST(AllocCommit)
+	{
+		chunk_t* chunk = chunk_alloc(NULL);
+		CHECK(chunk);
+		memset(chunk_buffer(chunk), 0, 1024);
+		chunk = chunk_commit(chunk, 1024, 0, NULL);
+		CHECK(chunk);
+		CHECK_EQUAL(1024, chunk_length(chunk));
+		CHECK(chunk_data(chunk) == chunk_buffer(chunk));
+		CHECK_EQUAL(0, (uintptr_t)chunk_data(chunk) % 64);
+		chunk_free(chunk);
+	}
+
+	TEST(CommitBadKeyShouldFail)
+	{
+		uint8_t key[chunk_keylength] = { 0, };
+		chunk_t* chunk = chunk_alloc(NULL);
+		memset(chunk_buffer(chunk), 0, 1024);
+		CHECK(!chunk_commit(chunk, 1024, 0, key));
+		CHECK_EQUAL(KVFS_KEY_NOT_VALID, errno);
+	}
+
+	TEST(CreateCopyIsInline)
+	{
+		uint8_t data[100] = { 1, 2, 3 };
+		chunk_t* chunk = chunk_create_copy(data, sizeof data, 0, NULL);
+		CHECK(chunk);
+		CHECK(chunk_data(chunk) != data);
+		CHECK(memcmp(chunk_data(chunk), data, sizeof data) == 0);
+		chunk_free(chunk);
+	}
+
+	TEST(PoolReusesChunks)
+	{
+		chunk_pool_t* pool = chunk_pool_create(4);
+		chunk_t* first = chunk_alloc(pool);
+		chunk_free(first);
+		chunk_t* second = chunk_alloc(pool);
+		CHECK(first == second);
+		chunk_free(second);
+		chunk_pool_free(pool);
+	}
+
+	TEST(PoolOutlivedByChunk)
+	{
+		chunk_pool_t* pool = chunk_pool_create(4);
+		chunk_t* chunk = chunk_alloc(pool);
+		chunk_pool_free(pool);
+		memset(chunk_buffer(chunk), 0, 32);
+		chunk = chunk_commit(chunk, 32, 0, NULL);
+		CHECK(chunk);
+		chunk_free(chunk);
+	}
+
+	TEST(RefKeepsChunkAlive)
+	{
+		chunk_pool_t* pool = chunk_pool_create(4);
+		chunk_t* chunk = chunk_alloc(pool);
+		memset(chunk_buffer(chunk), 0x55, 1024);
+		chunk = chunk_commit(chunk, 1024, 0, NULL);
+
+		CHECK(chunk_ref(chunk) == chunk);
+		chunk_free(chunk);
+
+		/* still referenced, so mustn't have gone back to the pool */
+		chunk_t* other = chunk_alloc(pool);
+		CHECK(other != chunk);
+		CHECK_EQUAL(0x55, chunk_data(chunk)[1023]);
+		chunk_free(other);
+
+		chunk_unref(chunk);
+		chunk_pool_free(pool);
+	}
+
+	TEST(RefConcurrent)
+	{
+		uint8_t data[1024] = { 0, };
+		chunk_t* chunk = chunk_create_copy(data, sizeof data, 0, NULL);
+		std::vector<std::thread> threads;
+
+		for (int i = 0; i < 4; ++i) {
+			threads.emplace_back([chunk] {
+				for (int j = 0; j < 100000; ++j) {
+					chunk_unref(chunk_ref(chunk));
+				}
+			});
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+
+		CHECK_EQUAL(1024, chunk_length(chunk));
+		chunk_free(chunk);
+	}
 }
@@ -0,0 +1,139 @@
+#include <cstring>
+#include <cerrno>
+#include <kvfs/chunk.h>
+
+#include <UnitTest++/UnitTest++.h>
+
+SUITE(Codec)
+{
+	TEST(HexFromKey)
+	{
+		const char *hex = "0000bf18a086007016e948b04aed3b82103a36bea41755b6cddfaf10ace3c6ef";
+		const uint8_t key[] = {
+			0x00, 0x00, 0xbf, 0x18, 0xa0, 0x86, 0x00, 0x70,
+			0x16, 0xe9, 0x48, 0xb0, 0x4a, 0xed, 0x3b, 0x82,
+			0x10, 0x3a, 0x36, 0xbe, 0xa4, 0x17, 0x55, 0xb6,
+			0xcd, 0xdf, 0xaf, 0x10, 0xac, 0xe3, 0xc6, 0xef
+		};
+
+		CHECK(strcmp(hex, chunk_hex_from_key(key)) == 0);
+		CHECK(memcmp(key, chunk_key_from_hex(hex), chunk_keylength) == 0);
+	}
+
+	TEST(HexFromKeyMixedCase)
+	{
+		const char *hex = "0000BF18a086007016E948B04AED3B82103A36BEA41755B6CDDFAF10ACE3C6EF";
+		uint8_t key[chunk_keylength];
+		CHECK(chunk_key_from_hex_r(hex, key));
+		CHECK_EQUAL(0xbf, key[2]);
+		CHECK_EQUAL(0xef, key[31]);
+	}
+
+	TEST(HexBadDigitShouldFail)
+	{
+		char hex[] = "0000bf18a086007016e948b04aed3b82103a36bea41755b6cddfaf10ace3c6ef";
+		uint8_t key[chunk_keylength];
+		const char bad[] = { 'g', 'G', ' ', '+', '/', ':', '@', '`', (char)0xb0 };
+
+		for (size_t i = 0; i < sizeof bad; ++i) {
+			for (size_t pos = 0; pos < chunk_hexlength; pos += 21) {
+				char saved = hex[pos];
+				hex[pos] = bad[i];
+				errno = 0;
+				CHECK(!chunk_key_from_hex_r(hex, key));
+				CHECK_EQUAL(EINVAL, errno);
+				hex[pos] = saved;
+			}
+		}
+	}
+
+	TEST(HexShortShouldFail)
+	{
+		uint8_t key[chunk_keylength];
+		CHECK(!chunk_key_from_hex_r("0000bf18", key));
+		CHECK_EQUAL(EINVAL, errno);
+	}
+
+	TEST(HexLongShouldFail)
+	{
+		uint8_t key[chunk_keylength];
+		CHECK(!chunk_key_from_hex_r("0000bf18a086007016e948b04aed3b82103a36bea41755b6cddfaf10ace3c6ef0", key));
+		CHECK_EQUAL(EINVAL, errno);
+		errno = 0;
+		CHECK(!chunk_key_from_hex_r("0000bf18a086007016e948b04aed3b82103a36bea41755b6cddfaf10ace3c6ef.kvfs", key));
+		CHECK_EQUAL(EINVAL, errno);
+	}
+
+	TEST(HexRoundTrip)
+	{
+		uint8_t key[chunk_keylength];
+		uint8_t out[chunk_keylength];
+		char hex[chunk_hexlength + 1];
+
+		for (int i = 0; i < chunk_keylength; ++i) {
+			key[i] = i * 37 + 11;
+		}
+
+		CHECK(chunk_hex_from_key_r(key, hex) == hex + chunk_hexlength);
+		hex[chunk_hexlength] = '\0';
+		CHECK(chunk_key_from_hex_r(hex, out));
+		CHECK(memcmp(key, out, chunk_keylength) == 0);
+	}
+
+	TEST(Base32RoundTrip)
+	{
+		uint8_t key[chunk_keylength];
+		uint8_t out[chunk_keylength];
+		char text[chunk_base32length];
+
+		for (int i = 0; i < chunk_keylength; ++i) {
+			key[i] = i * 37 + 11;
+		}
+
+		CHECK(chunk_base32_from_key_r(key, text) == text + chunk_base32length);
+		CHECK(chunk_key_from_base32_r(text, out));
+		CHECK(memcmp(key, out, chunk_keylength) == 0);
+
+		/* the last character only carries one bit */
+		text[chunk_base32length - 1] = '1';
+		CHECK(!chunk_key_from_base32_r(text, out));
+	}
+
+	TEST(Base32Vector)
+	{
+		const uint8_t key[chunk_keylength] = { 0xff, 0x00, 0x10, };
+		char text[chunk_base32length + 1] = { 0, };
+
+		chunk_base32_from_key_r(key, text);
+		CHECK(strncmp("vs0100", text, 6) == 0);
+		CHECK_EQUAL('0', text[chunk_base32length - 1]);
+	}
+
+	TEST(Base64RoundTrip)
+	{
+		uint8_t key[chunk_keylength];
+		uint8_t out[chunk_keylength];
+		char text[chunk_base64length];
+
+		for (int i = 0; i < chunk_keylength; ++i) {
+			key[i] = i * 37 + 11;
+		}
+
+		CHECK(chunk_base64_from_key_r(key, text) == text + chunk_base64length);
+		CHECK(chunk_key_from_base64_r(text, out));
+		CHECK(memcmp(key, out, chunk_keylength) == 0);
+
+		text[0] = '+';
+		CHECK(!chunk_key_from_base64_r(text, out));
+	}
+
+	TEST(Base64Vector)
+	{
+		const uint8_t key[chunk_keylength] = { 0xfb, 0xff, 0x00, };
+		char text[chunk_base64length + 1] = { 0, };
+
+		chunk_base64_from_key_r(key, text);
+		CHECK(strncmp("-_8A", text, 4) == 0);
+		CHECK_EQUAL('A', text[chunk_base64length - 1]);
+	}
+}
@@ -1,5 +1,6 @@
 #include <ldns/ldns.h>
 #include <cerrno>
+#include <cstring>
 
 #include <kvfs/kvfs.h>
 #include <kvfs/drivers/dns.h>
@@ -53,6 +54,24 @@ SUITE(DNS)
 		CHECK(store);
 	}
 
+	TEST(ResolverWithoutTSIG)
+	{
+		uint8_t key[chunk_keylength] = { 0, };
+		ldns_resolver* resolver = ldns_resolver_new();
+		ldns_rdf* ns = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_A, "54.165.45.170");
+		ldns_resolver_push_nameserver(resolver, ns);
+		ldns_rdf_deep_free(ns);
+		ldns_resolver_set_domain(resolver, ldns_dname_new_frm_str("rb.me.uk"));
+
+		/* queries are sent on a clone of the resolver, which has no TSIG to copy */
+		kvfs_store_t* store = kvfs_create_dns(resolver);
+		CHECK(store);
+		CHECK_EQUAL(0, kvfs_has(store, key));
+
+		kvfs_free(store);
+		ldns_resolver_deep_free(resolver);
+	}
+
 	TEST_FIXTURE(KVFSDNSHelper, Put)
 	{
 		uint8_t data[1024] = { 0, };
@@ -82,4 +101,28 @@ SUITE(DNS)
 			chunk_free(chunk);
 		}
 	}
+
+	TEST_FIXTURE(KVFSDNSHelper, PutMany)
+	{
+		uint8_t data[3][100];
+		uint8_t keys[3 * chunk_keylength];
+		chunk_t* chunks[3];
+		int errors[3];
+
+		for (int i = 0; i < 3; ++i) {
+			memset(data[i], 0x60 + i, sizeof data[i]);
+			chunks[i] = chunk_create(data[i], sizeof data[i], 0, false, NULL);
+			memcpy(keys + i * chunk_keylength, chunk_key(chunks[i]), chunk_keylength);
+		}
+		CHECK_EQUAL(0, kvfs_put_many(store, chunks, 3, errors));
+		for (int i = 0; i < 3; ++i) {
+			chunk_free(chunks[i]);
+		}
+
+		CHECK_EQUAL(0, kvfs_get_many(store, keys, 3, chunks, errors));
+		for (int i = 0; i < 3; ++i) {
+			CHECK(chunks[i] && memcmp(chunk_data(chunks[i]), data[i], sizeof data[i]) == 0);
+			chunk_free(chunks[i]);
+		}
+	}
 }
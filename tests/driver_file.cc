@@ -1,4 +1,6 @@
 #include <cerrno>
+#include <cstring>
+#include <string>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -21,6 +23,29 @@ class KVFSFileHelper {
 		}
 };
 
+class KVFSFileCorruptHelper : public KVFSFileHelper {
+	protected:
+		uint8_t			key[chunk_keylength];
+	public:
+		/* stores a chunk, then overwrites its file with different data */
+		KVFSFileCorruptHelper() {
+			uint8_t data[1024];
+			memset(data, 0x11, sizeof data);
+			chunk_t* chunk = chunk_create(data, sizeof data, 0, false, NULL);
+			memcpy(key, chunk_key(chunk), sizeof key);
+			kvfs_put(store, chunk);
+			chunk_free(chunk);
+
+			char path[128];
+			snprintf(path, sizeof path, "/tmp/%s.kvfs", chunk_hex_from_key(key));
+			int fd = open(path, O_WRONLY);
+			memset(data, 0x22, sizeof data);
+			CHECK_EQUAL(1024, write(fd, data, sizeof data));
+			close(fd);
+			errno = 0;
+		}
+};
+
 SUITE(File)
 {
 	TEST(PassingNullContextShouldFail)
@@ -77,4 +102,107 @@ SUITE(File)
 		CHECK(!chunk);
 		CHECK_EQUAL(ENOENT, errno);
 	}
+
+	TEST_FIXTURE(KVFSFileCorruptHelper, VerifyAlways)
+	{
+		kvfs_stats_t stats;
+
+		CHECK(!kvfs_get(store, key));
+		CHECK_EQUAL(KVFS_KEY_NOT_VALID, errno);
+		kvfs_stats(store, &stats);
+		CHECK_EQUAL(1u, stats.verify_failures);
+		CHECK_EQUAL(0u, stats.unverified);
+	}
+
+	TEST_FIXTURE(KVFSFileCorruptHelper, VerifyIndirectTrustsLeaves)
+	{
+		kvfs_stats_t stats;
+
+		CHECK_EQUAL(0, kvfs_set_verify(store, KVFS_VERIFY_INDIRECT, 0));
+		chunk_t* chunk = kvfs_get(store, key);
+		CHECK(chunk);
+		chunk_free(chunk);
+
+		kvfs_stats(store, &stats);
+		CHECK_EQUAL(0u, stats.verified);
+		CHECK_EQUAL(1u, stats.unverified);
+		CHECK_EQUAL(1024u, stats.unverified_bytes);
+	}
+
+	TEST_FIXTURE(KVFSFileCorruptHelper, VerifySampled)
+	{
+		kvfs_stats_t stats;
+
+		CHECK_EQUAL(-1, kvfs_set_verify(store, KVFS_VERIFY_SAMPLED, 0));
+		CHECK_EQUAL(0, kvfs_set_verify(store, KVFS_VERIFY_SAMPLED, 2));
+		for (int i = 0; i < 4; ++i) {
+			chunk_free(kvfs_get(store, key));
+		}
+
+		kvfs_stats(store, &stats);
+		CHECK_EQUAL(4u, stats.gets);
+		CHECK_EQUAL(2u, stats.verify_failures);
+		CHECK_EQUAL(2u, stats.unverified);
+	}
+
+	TEST_FIXTURE(KVFSFileCorruptHelper, VerifyDeferred)
+	{
+		kvfs_stats_t stats;
+
+		CHECK_EQUAL(0, kvfs_set_verify(store, KVFS_VERIFY_DEFERRED, 0));
+		chunk_t* chunk = kvfs_get(store, key);
+		CHECK(chunk);
+		chunk_free(chunk);
+
+		/* switching policy drains the background verifier */
+		CHECK_EQUAL(0, kvfs_set_verify(store, KVFS_VERIFY_ALWAYS, 0));
+		kvfs_stats(store, &stats);
+		CHECK_EQUAL(1u, stats.deferred);
+		CHECK_EQUAL(1u, stats.verify_failures);
+	}
+
+	TEST_FIXTURE(KVFSFileCorruptHelper, VerifyMany)
+	{
+		uint8_t data[1024];
+		uint8_t keys[3 * chunk_keylength];
+		chunk_t* chunks[3];
+		int errors[3];
+		kvfs_stats_t stats;
+
+		/* a good chunk either side of the corrupt one */
+		for (int i = 0; i < 3; i += 2) {
+			memset(data, 0x40 + i, sizeof data);
+			chunk_t* chunk = chunk_create(data, sizeof data, 0, false, NULL);
+			memcpy(keys + i * chunk_keylength, chunk_key(chunk), chunk_keylength);
+			kvfs_put(store, chunk);
+			chunk_free(chunk);
+		}
+		memcpy(keys + chunk_keylength, key, chunk_keylength);
+
+		CHECK_EQUAL(-1, kvfs_get_many(store, keys, 3, chunks, errors));
+		CHECK(chunks[0] && chunks[2]);
+		CHECK(!chunks[1]);
+		CHECK_EQUAL(KVFS_KEY_NOT_VALID, errors[1]);
+		chunk_free(chunks[0]);
+		chunk_free(chunks[2]);
+
+		kvfs_stats(store, &stats);
+		CHECK_EQUAL(2u, stats.verified);
+		CHECK_EQUAL(1u, stats.verify_failures);
+	}
+
+	TEST_FIXTURE(KVFSFileHelper, Has)
+	{
+		uint8_t data[100];
+		memset(data, 0x33, sizeof data);
+		chunk_t* chunk = chunk_create(data, sizeof data, 0, false, NULL);
+		uint8_t key[chunk_keylength];
+		memcpy(key, chunk_key(chunk), sizeof key);
+
+		unlink((std::string("/tmp/") + chunk_hex_from_key(key) + ".kvfs").c_str());
+		CHECK_EQUAL(0, kvfs_has(store, key));
+		CHECK_EQUAL(0, kvfs_put(store, chunk));
+		CHECK_EQUAL(1, kvfs_has(store, key));
+		chunk_free(chunk);
+	}
 }
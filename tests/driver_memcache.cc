@@ -1,4 +1,5 @@
 #include <cerrno>
+#include <cstring>
 
 #include <kvfs/kvfs.h>
 #include <kvfs/drivers/memcache.h>
@@ -73,4 +74,28 @@ SUITE(Memcached)
 		CHECK(!chunk);
 		CHECK_EQUAL(ENOENT, errno);
 	}
+
+	TEST_FIXTURE(KVFSMemcacheHelper, PutMany)
+	{
+		uint8_t data[3][100];
+		uint8_t keys[3 * chunk_keylength];
+		chunk_t* chunks[3];
+		int errors[3];
+
+		for (int i = 0; i < 3; ++i) {
+			memset(data[i], 0x60 + i, sizeof data[i]);
+			chunks[i] = chunk_create(data[i], sizeof data[i], 0, false, NULL);
+			memcpy(keys + i * chunk_keylength, chunk_key(chunks[i]), chunk_keylength);
+		}
+		CHECK_EQUAL(0, kvfs_put_many(store, chunks, 3, errors));
+		for (int i = 0; i < 3; ++i) {
+			chunk_free(chunks[i]);
+		}
+
+		CHECK_EQUAL(0, kvfs_get_many(store, keys, 3, chunks, errors));
+		for (int i = 0; i < 3; ++i) {
+			CHECK(chunks[i] && memcmp(chunk_data(chunks[i]), data[i], sizeof data[i]) == 0);
+			chunk_free(chunks[i]);
+		}
+	}
 }
@@ -2,6 +2,10 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <thread>
+#include <vector>
+#include <string>
 
 #include <kvfs/kvfs.h>
 #include <kvfs/drivers/file.h>
@@ -21,6 +25,23 @@ class KVFSStdioHelper {
 		}
 };
 
+class KVFSSeekHelper : public KVFSStdioHelper {
+	protected:
+		uint8_t			data[70000];
+		uint8_t			root[chunk_keylength];
+
+	public:
+		KVFSSeekHelper() {
+			for (size_t i = 0; i < sizeof data; ++i) {
+				data[i] = (i * 7 + i / 1024) & 0xff;
+			}
+			FILE *fp = kvfs_fopen_write(store);
+			fwrite(data, 1, sizeof data, fp);
+			fclose(fp);
+			memcpy(root, kvfs_last(store), sizeof root);
+		}
+};
+
 SUITE(StdioFile)
 {
 	TEST(PassingNullStoreShouldFail)
@@ -123,4 +144,1147 @@ SUITE(StdioFile)
 
 		CHECK(ok == true);
 	}
+
+	TEST_FIXTURE(KVFSSeekHelper, SeekSet)
+	{
+		FILE *fp = kvfs_fopen_read(store, root);
+		const long offsets[] = { 69999, 0, 1023, 1024, 32768, 33791, 40000, 5 };
+		for (long offset : offsets) {
+			CHECK_EQUAL(0, fseek(fp, offset, SEEK_SET));
+			CHECK_EQUAL(offset, ftell(fp));
+			CHECK_EQUAL(data[offset], fgetc(fp));
+			CHECK_EQUAL(offset + 1, ftell(fp));
+		}
+		fclose(fp);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, SeekCurAndEnd)
+	{
+		uint8_t buf[3000];
+
+		FILE *fp = kvfs_fopen_read(store, root);
+		CHECK_EQUAL(0, fseek(fp, 2000, SEEK_CUR));
+		CHECK_EQUAL(sizeof buf, fread(buf, 1, sizeof buf, fp));
+		CHECK(memcmp(buf, data + 2000, sizeof buf) == 0);
+		CHECK_EQUAL(0, fseek(fp, -1000, SEEK_CUR));
+		CHECK_EQUAL(4000, ftell(fp));
+		CHECK_EQUAL(data[4000], fgetc(fp));
+
+		CHECK_EQUAL(0, fseek(fp, 0, SEEK_END));
+		CHECK_EQUAL((long)sizeof data, ftell(fp));
+		CHECK_EQUAL(EOF, fgetc(fp));
+		CHECK_EQUAL(0, fseek(fp, -100, SEEK_END));
+		CHECK_EQUAL(100u, fread(buf, 1, sizeof buf, fp));
+		CHECK(memcmp(buf, data + sizeof data - 100, 100) == 0);
+		fclose(fp);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, SeekOutOfRange)
+	{
+		FILE *fp = kvfs_fopen_read(store, root);
+		CHECK_EQUAL(-1, fseek(fp, -1, SEEK_SET));
+		CHECK_EQUAL(0, fseek(fp, 100000, SEEK_SET));
+		CHECK_EQUAL(EOF, fgetc(fp));
+		CHECK_EQUAL(0, fseek(fp, 10, SEEK_SET));
+		CHECK_EQUAL(data[10], fgetc(fp));
+		fclose(fp);
+	}
+}
+
+SUITE(PRead)
+{
+	TEST_FIXTURE(KVFSSeekHelper, Ranges)
+	{
+		uint8_t buf[5000];
+		const uint64_t offsets[] = { 0, 1, 1023, 1024, 32767, 32768, 65000, 69000 };
+		for (uint64_t offset : offsets) {
+			size_t expect = sizeof data - offset < sizeof buf ? sizeof data - offset : sizeof buf;
+			CHECK_EQUAL((ssize_t)expect, kvfs_pread(store, root, offset, buf, sizeof buf));
+			CHECK(memcmp(buf, data + offset, expect) == 0);
+		}
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, PastEnd)
+	{
+		uint8_t buf[16];
+		CHECK_EQUAL(0, kvfs_pread(store, root, sizeof data, buf, sizeof buf));
+		CHECK_EQUAL(0, kvfs_pread(store, root, 1 << 20, buf, sizeof buf));
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, WholeFile)
+	{
+		static uint8_t buf[sizeof data + 100];
+		CHECK_EQUAL((ssize_t)sizeof data, kvfs_pread(store, root, 0, buf, sizeof buf));
+		CHECK(memcmp(buf, data, sizeof data) == 0);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, Threaded)
+	{
+		std::vector<std::thread> threads;
+		std::vector<int> failures(4, 0);
+
+		for (int t = 0; t < 4; ++t) {
+			threads.emplace_back([this, t, &failures] {
+				uint8_t buf[3000];
+				for (uint64_t offset = t * 97; offset < sizeof data; offset += 4001) {
+					ssize_t n = kvfs_pread(store, root, offset, buf, sizeof buf);
+					if (n <= 0 || memcmp(buf, data + offset, n) != 0) {
+						++failures[t];
+					}
+				}
+			});
+		}
+
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		for (int f : failures) {
+			CHECK_EQUAL(0, f);
+		}
+	}
+}
+
+SUITE(ReadAhead)
+{
+	TEST_FIXTURE(KVFSSeekHelper, SetReadAheadValidates)
+	{
+		CHECK_EQUAL(-1, kvfs_set_readahead(store, 1000, 2));
+		CHECK_EQUAL(-1, kvfs_set_readahead(store, 8, 0));
+		CHECK_EQUAL(0, kvfs_set_readahead(store, 0, 0));
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, StoreDefault)
+	{
+		static uint8_t buf[sizeof data];
+		kvfs_stats_t stats;
+
+		CHECK_EQUAL(0, kvfs_set_readahead(store, 16, 2));
+		FILE *fp = kvfs_fopen_read(store, root);
+		CHECK_EQUAL(sizeof buf, fread(buf, 1, sizeof buf, fp));
+		CHECK_EQUAL(EOF, fgetc(fp));
+		fclose(fp);
+
+		CHECK(memcmp(buf, data, sizeof data) == 0);
+		kvfs_stats(store, &stats);
+		CHECK(stats.readahead > 0);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, CrossesIndirectionBoundaries)
+	{
+		static uint8_t buf[sizeof data];
+		kvfs_stat_t st;
+		kvfs_stats_t before, after;
+
+		CHECK_EQUAL(0, kvfs_stat(store, root, &st));
+		CHECK_EQUAL(2, st.depth);
+
+		kvfs_set_readahead(store, 16, 2);
+		kvfs_stats(store, &before);
+		FILE *fp = kvfs_fopen_read(store, root);
+		CHECK_EQUAL(sizeof buf, fread(buf, 1, sizeof buf, fp));
+		fclose(fp);
+		kvfs_stats(store, &after);
+
+		/* only the root and the first depth 1 chunk are fetched inline */
+		CHECK(memcmp(buf, data, sizeof data) == 0);
+		CHECK_EQUAL(st.chunks - 2, after.readahead - before.readahead);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, PerStreamWithSeeks)
+	{
+		uint8_t buf[5000];
+		kvfs_read_options_t options = { 64 };
+
+		FILE *fp = kvfs_fopen_read_ex(store, root, &options);
+		const long offsets[] = { 0, 40000, 3, 65000, 1024, 69999 };
+		for (long offset : offsets) {
+			size_t expect = sizeof data - offset < sizeof buf ? sizeof data - offset : sizeof buf;
+			CHECK_EQUAL(0, fseek(fp, offset, SEEK_SET));
+			CHECK_EQUAL(expect, fread(buf, 1, sizeof buf, fp));
+			CHECK(memcmp(buf, data + offset, expect) == 0);
+		}
+
+		/* close with fetches still in flight */
+		CHECK_EQUAL(0, fseek(fp, 0, SEEK_SET));
+		CHECK_EQUAL(data[0], fgetc(fp));
+		fclose(fp);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, PerStreamDisabled)
+	{
+		kvfs_read_options_t options = { -1 };
+		kvfs_stats_t stats;
+
+		kvfs_set_readahead(store, 16, 2);
+		FILE *fp = kvfs_fopen_read_ex(store, root, &options);
+		CHECK_EQUAL(0, fseek(fp, 50000, SEEK_SET));
+		CHECK_EQUAL(data[50000], fgetc(fp));
+		fclose(fp);
+
+		kvfs_stats(store, &stats);
+		CHECK_EQUAL(0u, stats.readahead);
+	}
+}
+
+static int collect(void* context, const uint8_t* data, size_t length)
+{
+	static_cast<std::string*>(context)->append((const char*)data, length);
+	return 0;
+}
+
+static int stop_early(void* context, const uint8_t*, size_t)
+{
+	return ++*static_cast<int*>(context) == 3 ? 42 : 0;
+}
+
+SUITE(Fetch)
+{
+	TEST_FIXTURE(KVFSSeekHelper, WholeFile)
+	{
+		std::string out;
+		kvfs_read_options_t options = { 0, 5 };
+
+		CHECK_EQUAL(0, kvfs_fetch(store, root, collect, &out, &options));
+		CHECK_EQUAL(sizeof data, out.size());
+		CHECK(memcmp(out.data(), data, sizeof data) == 0);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, SingleChunk)
+	{
+		std::string out;
+		uint8_t small[100];
+		memcpy(small, data, sizeof small);
+
+		FILE *fp = kvfs_fopen_write(store);
+		fwrite(small, 1, sizeof small, fp);
+		fclose(fp);
+
+		CHECK_EQUAL(0, kvfs_fetch(store, kvfs_last(store), collect, &out, NULL));
+		CHECK_EQUAL(sizeof small, out.size());
+		CHECK(memcmp(out.data(), small, sizeof small) == 0);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, CallbackStops)
+	{
+		int calls = 0;
+		CHECK_EQUAL(42, kvfs_fetch(store, root, stop_early, &calls, NULL));
+		CHECK_EQUAL(3, calls);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, MissingChunkFails)
+	{
+		std::string out;
+		uint8_t missing[chunk_keylength];
+		memcpy(missing, root, sizeof missing);
+		missing[31] ^= 0xff;
+
+		CHECK_EQUAL(-1, kvfs_fetch(store, missing, collect, &out, NULL));
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, ParallelStream)
+	{
+		static uint8_t buf[sizeof data];
+		kvfs_read_options_t options = { 0, 16 };
+
+		FILE *fp = kvfs_fopen_read_ex(store, root, &options);
+		CHECK_EQUAL(sizeof buf, fread(buf, 1, sizeof buf, fp));
+		CHECK(memcmp(buf, data, sizeof data) == 0);
+		CHECK_EQUAL(EOF, fgetc(fp));
+
+		CHECK_EQUAL(0, fseek(fp, 33000, SEEK_SET));
+		CHECK_EQUAL(1000u, fread(buf, 1, 1000, fp));
+		CHECK(memcmp(buf, data + 33000, 1000) == 0);
+		CHECK_EQUAL(0, fseek(fp, -10, SEEK_END));
+		CHECK_EQUAL(10u, fread(buf, 1, 1000, fp));
+		CHECK(memcmp(buf, data + sizeof data - 10, 10) == 0);
+		fclose(fp);
+	}
+}
+
+SUITE(Stat)
+{
+	TEST_FIXTURE(KVFSSeekHelper, Tree)
+	{
+		kvfs_stat_t info;
+		kvfs_stats_t stats;
+
+		CHECK_EQUAL(0, kvfs_stat(store, root, &info));
+		CHECK_EQUAL(sizeof data, info.size);
+		CHECK_EQUAL(2, info.depth);
+		CHECK_EQUAL(69u + 3u + 1u, info.chunks);
+
+		/* only the root and the last depth 1 chunk are needed */
+		kvfs_stats(store, &stats);
+		CHECK_EQUAL(2u, stats.gets);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, SingleChunk)
+	{
+		kvfs_stat_t info;
+
+		FILE *fp = kvfs_fopen_write(store);
+		fwrite(data, 1, 1000, fp);
+		fclose(fp);
+
+		CHECK_EQUAL(0, kvfs_stat(store, kvfs_last(store), &info));
+		CHECK_EQUAL(1000u, info.size);
+		CHECK_EQUAL(0, info.depth);
+		CHECK_EQUAL(1u, info.chunks);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, ExactMultiple)
+	{
+		kvfs_stat_t info;
+
+		FILE *fp = kvfs_fopen_write(store);
+		fwrite(data, 1, 32 * 1024, fp);
+		fclose(fp);
+
+		CHECK_EQUAL(0, kvfs_stat(store, kvfs_last(store), &info));
+		CHECK_EQUAL(32u * 1024, info.size);
+		CHECK_EQUAL(1, info.depth);
+		CHECK_EQUAL(33u, info.chunks);
+	}
+}
+
+SUITE(Iterator)
+{
+	TEST_FIXTURE(KVFSSeekHelper, Sequential)
+	{
+		const uint8_t* view;
+		size_t length;
+		size_t offset = 0;
+		bool ok = true;
+		int r;
+
+		kvfs_iter_t* iter = kvfs_iter_open(store, root, NULL);
+		CHECK(iter);
+		while ((r = kvfs_iter_next(iter, &view, &length)) > 0) {
+			ok &= (offset + length <= sizeof data) && memcmp(view, data + offset, length) == 0;
+			offset += length;
+		}
+		kvfs_iter_close(iter);
+
+		CHECK_EQUAL(0, r);
+		CHECK(ok);
+		CHECK_EQUAL(sizeof data, offset);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, Parallel)
+	{
+		const uint8_t* view;
+		size_t length;
+		std::string out;
+		kvfs_read_options_t options = { 0, 8 };
+
+		kvfs_iter_t* iter = kvfs_iter_open(store, root, &options);
+		while (kvfs_iter_next(iter, &view, &length) > 0) {
+			out.append((const char*)view, length);
+		}
+		kvfs_iter_close(iter);
+
+		CHECK_EQUAL(sizeof data, out.size());
+		CHECK(memcmp(out.data(), data, sizeof data) == 0);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, CloseEarly)
+	{
+		const uint8_t* view;
+		size_t length;
+
+		kvfs_iter_t* iter = kvfs_iter_open(store, root, NULL);
+		CHECK_EQUAL(1, kvfs_iter_next(iter, &view, &length));
+		CHECK_EQUAL(1024u, length);
+		CHECK(memcmp(view, data, length) == 0);
+		kvfs_iter_close(iter);
+	}
+}
+
+SUITE(PReadV)
+{
+	TEST_FIXTURE(KVFSSeekHelper, ScatteredRanges)
+	{
+		const uint64_t offsets[] = { 0, 10, 1000, 1020, 5000, 33000, 33000, 65530, 69990, 70000 };
+		const size_t count = sizeof offsets / sizeof offsets[0];
+		static uint8_t bufs[count][2000];
+		kvfs_range_t ranges[count];
+
+		for (size_t i = 0; i < count; ++i) {
+			ranges[i].offset = offsets[i];
+			ranges[i].length = (i == 5) ? 50 : sizeof bufs[i];
+			ranges[i].buf = bufs[i];
+		}
+
+		CHECK_EQUAL(0, kvfs_preadv(store, root, ranges, count));
+
+		for (size_t i = 0; i < count; ++i) {
+			size_t left = sizeof data - offsets[i];
+			size_t expect = left < ranges[i].length ? left : ranges[i].length;
+			CHECK_EQUAL((ssize_t)expect, ranges[i].result);
+			CHECK(memcmp(bufs[i], data + offsets[i], expect) == 0);
+		}
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, FetchesEachChunkOnce)
+	{
+		uint8_t a[100], b[100], c[100];
+		kvfs_range_t ranges[] = {
+			{ 100, sizeof a, a, 0 },
+			{ 200, sizeof b, b, 0 },
+			{ 900, sizeof c, c, 0 }
+		};
+		kvfs_stats_t stats;
+
+		CHECK_EQUAL(0, kvfs_preadv(store, root, ranges, 3));
+		CHECK(memcmp(c, data + 900, sizeof c) == 0);
+
+		/* root, one depth 1 chunk and one leaf */
+		kvfs_stats(store, &stats);
+		CHECK_EQUAL(3u, stats.gets);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, UnsortedShouldFail)
+	{
+		uint8_t a[10], b[10];
+		kvfs_range_t ranges[] = {
+			{ 200, sizeof a, a, 0 },
+			{ 100, sizeof b, b, 0 }
+		};
+
+		CHECK_EQUAL(-1, kvfs_preadv(store, root, ranges, 2));
+		CHECK_EQUAL(EINVAL, errno);
+	}
+}
+
+SUITE(ThreadedWriter)
+{
+	TEST_FIXTURE(KVFSSeekHelper, SameRootAsSingleThreaded)
+	{
+		const unsigned int threads[] = { 1, 3, 8 };
+		for (unsigned int n : threads) {
+			kvfs_write_options_t options = { n };
+			FILE *fp = kvfs_fopen_write_ex(store, &options);
+			CHECK(fp);
+
+			/* awkward sizes so the batches don't line up with the writes */
+			for (size_t offset = 0; offset < sizeof data; offset += 3001) {
+				size_t length = sizeof data - offset < 3001 ? sizeof data - offset : 3001;
+				CHECK_EQUAL(length, fwrite(data + offset, 1, length, fp));
+			}
+			CHECK_EQUAL(0, fclose(fp));
+			CHECK(memcmp(root, kvfs_last(store), sizeof root) == 0);
+		}
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, LargeFile)
+	{
+		static uint8_t big[1 << 20];
+		static uint8_t back[sizeof big];
+		uint8_t single[chunk_keylength];
+
+		for (size_t i = 0; i < sizeof big; ++i) {
+			big[i] = (i * 13 + (i >> 10)) & 0xff;
+		}
+
+		FILE *fp = kvfs_fopen_write(store);
+		fwrite(big, 1, sizeof big - 7, fp);
+		fclose(fp);
+		memcpy(single, kvfs_last(store), sizeof single);
+
+		kvfs_write_options_t options = { 4 };
+		fp = kvfs_fopen_write_ex(store, &options);
+		fwrite(big, 1, sizeof big - 7, fp);
+		CHECK_EQUAL(0, fclose(fp));
+		CHECK(memcmp(single, kvfs_last(store), sizeof single) == 0);
+
+		CHECK_EQUAL((ssize_t)sizeof big - 7, kvfs_pread(store, single, 0, back, sizeof back));
+		CHECK(memcmp(big, back, sizeof big - 7) == 0);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, TooManyThreadsShouldFail)
+	{
+		kvfs_write_options_t options = { 1000 };
+		CHECK(!kvfs_fopen_write_ex(store, &options));
+		CHECK_EQUAL(EINVAL, errno);
+	}
+}
+
+SUITE(TreeBuilder)
+{
+	/* builds each level in turn from the whole of the one below */
+	static void reference_root(const uint8_t* data, size_t length, uint8_t* root)
+	{
+		std::vector<uint8_t> level;
+		uint8_t depth = 0;
+
+		for (size_t offset = 0; offset == 0 || offset < length; offset += chunk_maxlength) {
+			size_t n = length - offset < chunk_maxlength ? length - offset : chunk_maxlength;
+			chunk_t* chunk = chunk_create(data + offset, n, 0, false, nullptr);
+			level.insert(level.end(), chunk_key(chunk), chunk_key(chunk) + chunk_keylength);
+			chunk_free(chunk);
+		}
+
+		while (level.size() > chunk_keylength) {
+			std::vector<uint8_t> next;
+			++depth;
+			for (size_t offset = 0; offset < level.size(); offset += chunk_maxlength) {
+				size_t n = level.size() - offset < chunk_maxlength ? level.size() - offset : chunk_maxlength;
+				chunk_t* chunk = chunk_create(level.data() + offset, n, depth, false, nullptr);
+				next.insert(next.end(), chunk_key(chunk), chunk_key(chunk) + chunk_keylength);
+				chunk_free(chunk);
+			}
+			level.swap(next);
+		}
+
+		memcpy(root, level.data(), chunk_keylength);
+	}
+
+	TEST_FIXTURE(KVFSStdioHelper, MatchesLevelByLevel)
+	{
+		static uint8_t data[(1 << 20) + 1];
+		const size_t sizes[] = {
+			1, 1024, 32 * 1024, 32 * 1024 + 1, 33 * 1024, 1 << 20, (1 << 20) + 1
+		};
+		uint8_t expected[chunk_keylength];
+
+		for (size_t i = 0; i < sizeof data; ++i) {
+			data[i] = (i * 11 + (i >> 10)) & 0xff;
+		}
+
+		for (size_t size : sizes) {
+			reference_root(data, size, expected);
+
+			const unsigned int threads[] = { 0, 2 };
+			for (unsigned int n : threads) {
+				kvfs_write_options_t options = { n };
+				FILE *fp = kvfs_fopen_write_ex(store, &options);
+				CHECK_EQUAL(size, fwrite(data, 1, size, fp));
+				CHECK_EQUAL(0, fclose(fp));
+				CHECK(memcmp(expected, kvfs_last(store), sizeof expected) == 0);
+			}
+		}
+	}
+
+	TEST_FIXTURE(KVFSStdioHelper, EmptyFileLeavesLastAlone)
+	{
+		uint8_t before[chunk_keylength];
+		FILE *fp = kvfs_fopen_write(store);
+		fputc('x', fp);
+		fclose(fp);
+		memcpy(before, kvfs_last(store), sizeof before);
+
+		fp = kvfs_fopen_write(store);
+		CHECK_EQUAL(0, fclose(fp));
+		CHECK(memcmp(before, kvfs_last(store), sizeof before) == 0);
+	}
+}
+
+SUITE(AsyncPuts)
+{
+	TEST_FIXTURE(KVFSSeekHelper, SameRootAsSynchronous)
+	{
+		uint8_t back[sizeof data];
+		const unsigned int threads[] = { 0, 3 };
+		for (unsigned int n : threads) {
+			kvfs_write_options_t options = { n, 8 };
+			FILE *fp = kvfs_fopen_write_ex(store, &options);
+			CHECK(fp);
+			CHECK_EQUAL(sizeof data, fwrite(data, 1, sizeof data, fp));
+			CHECK_EQUAL(0, fclose(fp));
+			CHECK(memcmp(root, kvfs_last(store), sizeof root) == 0);
+		}
+
+		CHECK_EQUAL((ssize_t)sizeof back, kvfs_pread(store, root, 0, back, sizeof back));
+		CHECK(memcmp(data, back, sizeof data) == 0);
+	}
+
+	TEST_FIXTURE(KVFSStdioHelper, ManyIndirectionChunks)
+	{
+		/* more depth 1 chunks than the writer holds back at once */
+		static uint8_t data[2200 * 1024];
+		uint8_t expected[chunk_keylength];
+
+		for (size_t i = 0; i < sizeof data; ++i) {
+			data[i] = (i * 11 + i / 1024) & 0xff;
+		}
+		CHECK_EQUAL(0, kvfs_put_buffer(store, data, sizeof data, expected));
+
+		kvfs_write_options_t options = { 0, 8 };
+		FILE *fp = kvfs_fopen_write_ex(store, &options);
+		CHECK_EQUAL(sizeof data, fwrite(data, 1, sizeof data, fp));
+		CHECK_EQUAL(0, fclose(fp));
+		CHECK(memcmp(expected, kvfs_last(store), sizeof expected) == 0);
+	}
+
+	TEST(FailedPutIsReportedAtClose)
+	{
+		static uint8_t data[100000];
+		kvfs_store_t* store = kvfs_create_file("/nonexistent/kvfs");
+		CHECK(store);
+
+		kvfs_write_options_t options = { 0, 8 };
+		FILE *fp = kvfs_fopen_write_ex(store, &options);
+		CHECK(fp);
+		fwrite(data, 1, sizeof data, fp);
+		errno = 0;
+		CHECK_EQUAL(EOF, fclose(fp));
+		CHECK_EQUAL(ENOENT, errno);
+
+		kvfs_free(store);
+	}
+
+	TEST_FIXTURE(KVFSStdioHelper, WindowTooLargeShouldFail)
+	{
+		kvfs_write_options_t options = { 0, 1000 };
+		CHECK(!kvfs_fopen_write_ex(store, &options));
+		CHECK_EQUAL(EINVAL, errno);
+	}
+}
+
+SUITE(Dedup)
+{
+	/* 69 leaves, three indirection chunks and the root */
+	static const uint64_t chunks = 73;
+
+	static void write_file(kvfs_store_t* store, const uint8_t* data, size_t length, kvfs_dedup_t dedup, int window)
+	{
+		kvfs_write_options_t options = { 0, window, dedup };
+		FILE *fp = kvfs_fopen_write_ex(store, &options);
+		CHECK_EQUAL(length, fwrite(data, 1, length, fp));
+		CHECK_EQUAL(0, fclose(fp));
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, CheckSkipsEverything)
+	{
+		const int windows[] = { -1, 4 };
+		for (int window : windows) {
+			kvfs_stats_t before, after;
+			kvfs_stats(store, &before);
+			write_file(store, data, sizeof data, KVFS_DEDUP_CHECK, window);
+			kvfs_stats(store, &after);
+
+			CHECK(memcmp(root, kvfs_last(store), sizeof root) == 0);
+			CHECK_EQUAL(before.puts, after.puts);
+			CHECK_EQUAL(chunks, after.skipped - before.skipped);
+			CHECK_EQUAL(sizeof data + (chunks - 1) * chunk_keylength, after.skipped_bytes - before.skipped_bytes);
+		}
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, FilterOnlyAsksAboutKnownChunks)
+	{
+		kvfs_stats_t stats;
+
+		/* a fresh handle's filter hasn't seen anything */
+		kvfs_store_t* other = kvfs_create_file("/tmp");
+		write_file(other, data, sizeof data, KVFS_DEDUP_FILTER, -1);
+		kvfs_stats(other, &stats);
+		CHECK_EQUAL(chunks, stats.puts);
+		CHECK_EQUAL(0u, stats.skipped);
+
+		write_file(other, data, sizeof data, KVFS_DEDUP_FILTER, -1);
+		kvfs_stats(other, &stats);
+		CHECK_EQUAL(chunks, stats.puts);
+		CHECK_EQUAL(chunks, stats.skipped);
+		CHECK(memcmp(root, kvfs_last(other), sizeof root) == 0);
+
+		kvfs_free(other);
+	}
+
+	TEST_FIXTURE(KVFSStdioHelper, NewDataIsStored)
+	{
+		/* something the store won't have seen before */
+		uint8_t data[5000];
+		srand(time(nullptr) ^ getpid());
+		for (size_t i = 0; i < sizeof data; ++i) {
+			data[i] = rand() & 0xff;
+		}
+
+		kvfs_stats_t stats;
+		kvfs_stats(store, &stats);
+		uint64_t puts = stats.puts;
+		write_file(store, data, sizeof data, KVFS_DEDUP_CHECK, -1);
+		kvfs_stats(store, &stats);
+		CHECK_EQUAL(6u, stats.puts - puts);
+	}
+}
+
+SUITE(PutBuffer)
+{
+	TEST_FIXTURE(KVFSSeekHelper, SameRootAsStream)
+	{
+		uint8_t key[chunk_keylength];
+		uint8_t last[chunk_keylength];
+		memcpy(last, kvfs_last(store), sizeof last);
+
+		CHECK_EQUAL(0, kvfs_put_buffer(store, data, sizeof data, key));
+		CHECK(memcmp(root, key, sizeof key) == 0);
+		CHECK(memcmp(last, kvfs_last(store), sizeof last) == 0);
+
+		CHECK_EQUAL(0, kvfs_put_buffer(store, data, 1000, key));
+		CHECK_EQUAL(0, chunk_depth_from_key(key));
+	}
+
+	TEST_FIXTURE(KVFSStdioHelper, LargeBuffer)
+	{
+		static uint8_t big[(1 << 21) + 5];
+		uint8_t expected[chunk_keylength];
+		uint8_t key[chunk_keylength];
+
+		for (size_t i = 0; i < sizeof big; ++i) {
+			big[i] = (i * 17 + (i >> 10)) & 0xff;
+		}
+
+		FILE *fp = kvfs_fopen_write(store);
+		fwrite(big, 1, sizeof big, fp);
+		fclose(fp);
+		memcpy(expected, kvfs_last(store), sizeof expected);
+
+		CHECK_EQUAL(0, kvfs_put_buffer(store, big, sizeof big, key));
+		CHECK(memcmp(expected, key, sizeof key) == 0);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, Iov)
+	{
+		/* boundaries on, just before and just after chunk edges, and an empty piece */
+		const size_t cuts[] = { 100, 1024, 1024, 3071, 3072, 5000, 5001, 40000, sizeof data };
+		struct iovec iov[sizeof cuts / sizeof cuts[0]];
+		size_t from = 0;
+		for (size_t i = 0; i < sizeof cuts / sizeof cuts[0]; ++i) {
+			iov[i].iov_base = data + from;
+			iov[i].iov_len = cuts[i] - from;
+			from = cuts[i];
+		}
+
+		uint8_t key[chunk_keylength];
+		CHECK_EQUAL(0, kvfs_put_iov(store, iov, sizeof iov / sizeof iov[0], key));
+		CHECK(memcmp(root, key, sizeof key) == 0);
+	}
+
+	TEST_FIXTURE(KVFSStdioHelper, EmptyShouldFail)
+	{
+		uint8_t key[chunk_keylength];
+		CHECK_EQUAL(-1, kvfs_put_buffer(store, "", 0, key));
+		CHECK_EQUAL(EINVAL, errno);
+	}
+}
+
+SUITE(PutFd)
+{
+	TEST_FIXTURE(KVFSSeekHelper, RegularFile)
+	{
+		char path[] = "/tmp/kvfs_put_fd_XXXXXX";
+		int fd = mkstemp(path);
+		CHECK(fd >= 0);
+		unlink(path);
+		CHECK_EQUAL((ssize_t)sizeof data, write(fd, data, sizeof data));
+
+		/* the whole file is stored, wherever the offset is */
+		uint8_t key[chunk_keylength];
+		CHECK_EQUAL(0, kvfs_put_fd(store, fd, key));
+		CHECK(memcmp(root, key, sizeof key) == 0);
+		close(fd);
+	}
+
+	TEST_FIXTURE(KVFSStdioHelper, LargerThanAWindow)
+	{
+		static uint8_t big[(5 << 20) + 3];
+		uint8_t expected[chunk_keylength];
+		uint8_t key[chunk_keylength];
+
+		for (size_t i = 0; i < sizeof big; ++i) {
+			big[i] = (i * 29 + (i >> 10)) & 0xff;
+		}
+		CHECK_EQUAL(0, kvfs_put_buffer(store, big, sizeof big, expected));
+
+		char path[] = "/tmp/kvfs_put_fd_XXXXXX";
+		int fd = mkstemp(path);
+		unlink(path);
+		CHECK_EQUAL((ssize_t)sizeof big, write(fd, big, sizeof big));
+		CHECK_EQUAL(0, kvfs_put_fd(store, fd, key));
+		CHECK(memcmp(expected, key, sizeof key) == 0);
+		close(fd);
+
+		/* and again through a pipe, in awkward pieces */
+		int fds[2];
+		CHECK_EQUAL(0, pipe(fds));
+		std::thread writer([&]() {
+			for (size_t offset = 0; offset < sizeof big; offset += 7777) {
+				size_t n = sizeof big - offset < 7777 ? sizeof big - offset : 7777;
+				if (write(fds[1], big + offset, n) != (ssize_t)n) {
+					break;
+				}
+			}
+			close(fds[1]);
+		});
+		memset(key, 0, sizeof key);
+		CHECK_EQUAL(0, kvfs_put_fd(store, fds[0], key));
+		writer.join();
+		close(fds[0]);
+		CHECK(memcmp(expected, key, sizeof key) == 0);
+	}
+
+	TEST_FIXTURE(KVFSStdioHelper, EmptyShouldFail)
+	{
+		uint8_t key[chunk_keylength];
+		int fd = open("/dev/null", O_RDONLY);
+		CHECK_EQUAL(-1, kvfs_put_fd(store, fd, key));
+		CHECK_EQUAL(EINVAL, errno);
+		close(fd);
+	}
+}
+
+SUITE(Append)
+{
+	TEST_FIXTURE(KVFSSeekHelper, SameRootAsWritingItAllAtOnce)
+	{
+		const size_t splits[] = { 1, 1000, 1024, 1025, 32 * 1024, 32 * 1024 + 7, 33 * 1024, 69999 };
+		const size_t extras[] = { 1, 23, 1024, 5000 };
+
+		for (size_t split : splits) {
+			uint8_t first[chunk_keylength];
+			CHECK_EQUAL(0, kvfs_put_buffer(store, data, split, first));
+
+			/* append the rest, or just a little more of it */
+			const size_t rest = sizeof data - split;
+			for (size_t extra : extras) {
+				size_t n = extra < rest ? extra : rest;
+				uint8_t expected[chunk_keylength], key[chunk_keylength];
+				CHECK_EQUAL(0, kvfs_put_buffer(store, data, split + n, expected));
+				CHECK_EQUAL(0, kvfs_append(store, first, data + split, n, key));
+				CHECK(memcmp(expected, key, sizeof key) == 0);
+			}
+
+			uint8_t key[chunk_keylength];
+			CHECK_EQUAL(0, kvfs_append(store, first, data + split, rest, key));
+			CHECK(memcmp(root, key, sizeof key) == 0);
+		}
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, OnlyFetchesTheRightHandSide)
+	{
+		kvfs_stats_t before, after;
+		uint8_t key[chunk_keylength];
+
+		/* the root, the last depth 1 chunk and the last leaf */
+		kvfs_stats(store, &before);
+		CHECK_EQUAL(0, kvfs_append(store, root, "more", 4, key));
+		kvfs_stats(store, &after);
+		CHECK_EQUAL(3u, after.gets - before.gets);
+
+		uint8_t back[sizeof data + 4];
+		CHECK_EQUAL((ssize_t)sizeof back, kvfs_pread(store, key, 0, back, sizeof back));
+		CHECK(memcmp(data, back, sizeof data) == 0);
+		CHECK(memcmp("more", back + sizeof data, 4) == 0);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, NothingToAppend)
+	{
+		uint8_t key[chunk_keylength];
+		CHECK_EQUAL(0, kvfs_append(store, root, nullptr, 0, key));
+		CHECK(memcmp(root, key, sizeof key) == 0);
+	}
+}
+
+SUITE(Patch)
+{
+	TEST_FIXTURE(KVFSSeekHelper, SameRootAsRewriting)
+	{
+		static uint8_t patched[sizeof data + 5000];
+		const struct { uint64_t offset; size_t length; } edits[] = {
+			{ 0, 1 }, { 0, 1024 }, { 1023, 2 }, { 5000, 3000 }, { 32 * 1024 - 10, 20 },
+			{ 40000, 29999 }, { 69990, 10 }, { 69990, 100 }, { 70000, 5000 }, { 0, sizeof data }
+		};
+
+		for (auto edit : edits) {
+			memcpy(patched, data, sizeof data);
+			for (size_t i = 0; i < edit.length; ++i) {
+				patched[edit.offset + i] = ~patched[edit.offset + i] ^ i;
+			}
+			size_t size = edit.offset + edit.length > sizeof data ? edit.offset + edit.length : sizeof data;
+
+			uint8_t expected[chunk_keylength], key[chunk_keylength];
+			CHECK_EQUAL(0, kvfs_put_buffer(store, patched, size, expected));
+			CHECK_EQUAL(0, kvfs_patch(store, root, edit.offset, patched + edit.offset, edit.length, key));
+			CHECK(memcmp(expected, key, sizeof key) == 0);
+		}
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, OnlyTouchesOnePath)
+	{
+		kvfs_stats_t before, after;
+		uint8_t key[chunk_keylength];
+
+		/* two chunks down the right spine for the size, then the path to the leaf */
+		kvfs_stats(store, &before);
+		CHECK_EQUAL(0, kvfs_patch(store, root, 2000, "x", 1, key));
+		kvfs_stats(store, &after);
+		CHECK_EQUAL(5u, after.gets - before.gets);
+		CHECK_EQUAL(3u, after.puts - before.puts);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, PastTheEndShouldFail)
+	{
+		uint8_t key[chunk_keylength];
+		CHECK_EQUAL(-1, kvfs_patch(store, root, sizeof data + 1, "x", 1, key));
+		CHECK_EQUAL(EINVAL, errno);
+	}
+}
+
+static int diff_collect(void* context, uint64_t offset, uint64_t length)
+{
+	auto ranges = static_cast<std::vector<std::pair<uint64_t, uint64_t>>*>(context);
+	ranges->push_back({ offset, length });
+	return 0;
+}
+
+static int diff_stop(void* context, uint64_t, uint64_t)
+{
+	return 42;
+}
+
+SUITE(Diff)
+{
+	TEST_FIXTURE(KVFSSeekHelper, SameFileHasNoDifferences)
+	{
+		std::vector<std::pair<uint64_t, uint64_t>> ranges;
+		CHECK_EQUAL(0, kvfs_diff(store, root, root, diff_collect, &ranges));
+		CHECK(ranges.empty());
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, PatchedRanges)
+	{
+		uint8_t once[chunk_keylength], twice[chunk_keylength];
+		uint8_t patch[2000];
+
+		for (size_t i = 0; i < sizeof patch; ++i) {
+			patch[i] = ~data[1000 + i];
+		}
+
+		/* the two edits touch, so they're reported as one range */
+		CHECK_EQUAL(0, kvfs_patch(store, root, 1000, patch, sizeof patch, once));
+		CHECK_EQUAL(0, kvfs_patch(store, once, 3000, patch, 10, twice));
+		memcpy(once, twice, sizeof once);
+		patch[0] = ~data[50000];
+		CHECK_EQUAL(0, kvfs_patch(store, once, 50000, patch, 1, twice));
+
+		std::vector<std::pair<uint64_t, uint64_t>> ranges;
+		CHECK_EQUAL(0, kvfs_diff(store, root, twice, diff_collect, &ranges));
+		CHECK_EQUAL(2u, ranges.size());
+		CHECK_EQUAL(1000u, ranges[0].first);
+		CHECK_EQUAL(2010u, ranges[0].second);
+		CHECK_EQUAL(50000u, ranges[1].first);
+		CHECK_EQUAL(1u, ranges[1].second);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, DifferentLengths)
+	{
+		uint8_t shorter[chunk_keylength], longer[chunk_keylength];
+		static uint8_t extra[100000];
+
+		memset(extra, 0x5a, sizeof extra);
+		CHECK_EQUAL(0, kvfs_put_buffer(store, data, 500, shorter));
+		CHECK_EQUAL(0, kvfs_append(store, root, extra, sizeof extra, longer));
+
+		std::vector<std::pair<uint64_t, uint64_t>> ranges;
+		CHECK_EQUAL(0, kvfs_diff(store, root, longer, diff_collect, &ranges));
+		CHECK_EQUAL(1u, ranges.size());
+		CHECK_EQUAL(sizeof data, ranges[0].first);
+		CHECK_EQUAL(sizeof extra, ranges[0].second);
+
+		ranges.clear();
+		CHECK_EQUAL(0, kvfs_diff(store, longer, shorter, diff_collect, &ranges));
+		CHECK_EQUAL(1u, ranges.size());
+		CHECK_EQUAL(500u, ranges[0].first);
+		CHECK_EQUAL(sizeof data + sizeof extra - 500, ranges[0].second);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, OnlyFetchesWhatDiffers)
+	{
+		kvfs_stats_t before, after;
+		uint8_t key[chunk_keylength];
+
+		CHECK_EQUAL(0, kvfs_patch(store, root, 2000, "x", 1, key));
+
+		/* two spines for the sizes, then three chunks down each path */
+		std::vector<std::pair<uint64_t, uint64_t>> ranges;
+		kvfs_stats(store, &before);
+		CHECK_EQUAL(0, kvfs_diff(store, root, key, diff_collect, &ranges));
+		kvfs_stats(store, &after);
+		CHECK_EQUAL(1u, ranges.size());
+		CHECK_EQUAL(10u, after.gets - before.gets);
+	}
+
+	TEST_FIXTURE(KVFSSeekHelper, CallbackCanStop)
+	{
+		uint8_t key[chunk_keylength];
+		CHECK_EQUAL(0, kvfs_patch(store, root, 2000, "x", 1, key));
+		CHECK_EQUAL(42, kvfs_diff(store, root, key, diff_stop, NULL));
+	}
+}
+
+/* a second, empty file store to copy into */
+class KVFSCopyHelper : public KVFSSeekHelper {
+	protected:
+		char			dir[32];
+		kvfs_store_t*	dst;
+	public:
+		KVFSCopyHelper() : dst(nullptr) {
+			strcpy(dir, "/tmp/kvfs-copy-XXXXXX");
+			if (mkdtemp(dir)) {
+				dst = kvfs_create_file(dir);
+			}
+			errno = 0;
+		}
+		~KVFSCopyHelper() {
+			kvfs_free(dst);
+			DIR* d = opendir(dir);
+			while (struct dirent* entry = d ? readdir(d) : nullptr) {
+				if (entry->d_name[0] != '.') {
+					unlinkat(dirfd(d), entry->d_name, 0);
+				}
+			}
+			if (d) {
+				closedir(d);
+			}
+			rmdir(dir);
+		}
+};
+
+SUITE(Copy)
+{
+	TEST_FIXTURE(KVFSCopyHelper, SameFileInBothStores)
+	{
+		static uint8_t buf[sizeof data];
+		kvfs_stat_t info;
+
+		CHECK_EQUAL(0, kvfs_copy(store, dst, root, NULL));
+
+		kvfs_stats_t stats;
+		kvfs_stats(dst, &stats);
+		CHECK_EQUAL(0, kvfs_stat(store, root, &info));
+		CHECK_EQUAL(info.chunks, stats.puts);
+
+		CHECK_EQUAL((ssize_t)sizeof data, kvfs_pread(dst, root, 0, buf, sizeof buf));
+		CHECK(memcmp(data, buf, sizeof data) == 0);
+	}
+
+	TEST_FIXTURE(KVFSCopyHelper, SkipsWhatTheDestinationHas)
+	{
+		kvfs_stats_t before, after;
+		uint8_t key[chunk_keylength];
+		kvfs_copy_options_t options = { -1 };
+
+		CHECK_EQUAL(0, kvfs_copy(store, dst, root, &options));
+
+		/* a second copy stops at the root */
+		kvfs_stats(store, &before);
+		CHECK_EQUAL(0, kvfs_copy(store, dst, root, &options));
+		kvfs_stats(store, &after);
+		CHECK_EQUAL(0u, after.gets - before.gets);
+
+		/* only the path down to the edited leaf is new */
+		CHECK_EQUAL(0, kvfs_patch(store, root, 2000, "x", 1, key));
+		kvfs_stats(store, &before);
+		CHECK_EQUAL(0, kvfs_copy(store, dst, key, &options));
+		kvfs_stats(store, &after);
+		CHECK_EQUAL(3u, after.gets - before.gets);
+
+		char c;
+		CHECK_EQUAL(1, kvfs_pread(dst, key, 2000, &c, 1));
+		CHECK_EQUAL('x', c);
+	}
+
+	TEST_FIXTURE(KVFSCopyHelper, Parallel)
+	{
+		static uint8_t big[300000], buf[sizeof big];
+		uint8_t key[chunk_keylength];
+		kvfs_copy_options_t options = { 8 };
+
+		for (size_t i = 0; i < sizeof big; ++i) {
+			big[i] = rand();
+		}
+		CHECK_EQUAL(0, kvfs_put_buffer(store, big, sizeof big, key));
+		CHECK_EQUAL(0, kvfs_copy(store, dst, key, &options));
+		CHECK_EQUAL((ssize_t)sizeof big, kvfs_pread(dst, key, 0, buf, sizeof buf));
+		CHECK(memcmp(big, buf, sizeof big) == 0);
+	}
+
+	TEST_FIXTURE(KVFSCopyHelper, MissingChunkShouldFail)
+	{
+		uint8_t key[chunk_keylength];
+		memcpy(key, root, sizeof key);
+		key[chunk_keylength - 1] ^= 1;
+		CHECK_EQUAL(-1, kvfs_copy(store, dst, key, NULL));
+	}
+
+	TEST_FIXTURE(KVFSCopyHelper, TooManyShouldFail)
+	{
+		kvfs_copy_options_t options = { 1000 };
+		CHECK_EQUAL(-1, kvfs_copy(store, dst, root, &options));
+		CHECK_EQUAL(EINVAL, errno);
+	}
+}
+
+SUITE(Batched)
+{
+	TEST_FIXTURE(KVFSStdioHelper, PutManyThenGetMany)
+	{
+		uint8_t data[3][1024];
+		chunk_t* chunks[3];
+		chunk_t* fetched[4];
+		uint8_t keys[4 * chunk_keylength];
+		int errors[4];
+
+		for (int i = 0; i < 3; ++i) {
+			memset(data[i], 0x30 + i, sizeof data[i]);
+			chunks[i] = chunk_create(data[i], sizeof data[i] - i, 0, false, NULL);
+			memcpy(keys + i * chunk_keylength, chunk_key(chunks[i]), chunk_keylength);
+		}
+		CHECK_EQUAL(0, kvfs_put_many(store, chunks, 3, errors));
+		for (int i = 0; i < 3; ++i) {
+			CHECK_EQUAL(0, errors[i]);
+		}
+
+		/* one key that was never stored */
+		memcpy(keys + 3 * chunk_keylength, keys, chunk_keylength);
+		keys[4 * chunk_keylength - 1] ^= 1;
+
+		kvfs_stats_t before, after;
+		kvfs_stats(store, &before);
+		CHECK_EQUAL(-1, kvfs_get_many(store, keys, 4, fetched, errors));
+		CHECK_EQUAL(ENOENT, errno);
+		kvfs_stats(store, &after);
+		CHECK_EQUAL(4u, after.gets - before.gets);
+
+		for (int i = 0; i < 3; ++i) {
+			CHECK_EQUAL(0, errors[i]);
+			CHECK(fetched[i] && memcmp(chunk_data(fetched[i]), data[i], sizeof data[i] - i) == 0);
+			chunk_free(fetched[i]);
+			chunk_free(chunks[i]);
+		}
+		CHECK_EQUAL(ENOENT, errors[3]);
+		CHECK(!fetched[3]);
+	}
+
+	TEST_FIXTURE(KVFSStdioHelper, PutManyLeavesLastAlone)
+	{
+		uint8_t data[1024], last[chunk_keylength];
+		int error;
+
+		memset(data, 0x77, sizeof data);
+		chunk_t* chunk = chunk_create(data, sizeof data, 0, false, NULL);
+		memcpy(last, kvfs_last(store), sizeof last);
+		CHECK_EQUAL(0, kvfs_put_many(store, &chunk, 1, &error));
+		CHECK(memcmp(last, kvfs_last(store), sizeof last) == 0);
+		chunk_free(chunk);
+	}
+
+	TEST_FIXTURE(KVFSStdioHelper, NullErrorsShouldFail)
+	{
+		uint8_t key[chunk_keylength] = { 0, };
+		chunk_t* chunk;
+		CHECK_EQUAL(-1, kvfs_get_many(store, key, 1, &chunk, NULL));
+		CHECK_EQUAL(EINVAL, errno);
+	}
 }
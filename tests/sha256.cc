@@ -0,0 +1,109 @@
+#include <cstring>
+#include <ldns/sha2.h>
+#include <kvfs/sha256.h>
+
+#include <UnitTest++/UnitTest++.h>
+
+class SHA256Helper {
+	protected:
+		kvfs_sha256_impl_t	saved;
+		uint8_t				buf[4096];
+
+	public:
+		SHA256Helper() {
+			saved = kvfs_sha256_impl();
+			for (size_t i = 0; i < sizeof buf; ++i) {
+				buf[i] = (i * 7 + 3) & 0xff;
+			}
+		}
+		~SHA256Helper() {
+			kvfs_sha256_select(saved);
+		}
+
+		/* compare against ldns for every length up to and including 'max' */
+		bool matches_ldns(kvfs_sha256_impl_t impl, size_t max) {
+			if (kvfs_sha256_select(impl) != 0) {
+				return false;
+			}
+
+			for (size_t length = 0; length <= max; ++length) {
+				uint8_t expected[sha256_digestlength];
+				uint8_t actual[sha256_digestlength];
+				ldns_sha256(buf, length, expected);
+				kvfs_sha256(buf, length, actual);
+				if (memcmp(expected, actual, sizeof actual) != 0) {
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		/* compare batched hashing of mixed lengths with single hashing */
+		bool batch_matches(kvfs_sha256_impl_t impl) {
+			const size_t count = 40;
+			const uint8_t* data[count];
+			size_t length[count];
+			uint8_t expected[count * sha256_digestlength];
+			uint8_t actual[count * sha256_digestlength];
+
+			if (kvfs_sha256_select(impl) != 0) {
+				return false;
+			}
+
+			for (size_t i = 0; i < count; ++i) {
+				data[i] = buf + i * 11;
+				length[i] = (i < 20) ? 1024 : (i < 30) ? 55 + (i & 1) : i * 31;
+				kvfs_sha256(data[i], length[i], expected + i * sha256_digestlength);
+			}
+
+			kvfs_sha256_batch(data, length, actual, count);
+			return memcmp(expected, actual, sizeof actual) == 0;
+		}
+};
+
+SUITE(SHA256)
+{
+	TEST(ScalarAlwaysSupported)
+	{
+		CHECK(kvfs_sha256_supported(KVFS_SHA256_SCALAR));
+	}
+
+	TEST(SelectUnknownShouldFail)
+	{
+		CHECK_EQUAL(-1, kvfs_sha256_select(KVFS_SHA256_LAST));
+	}
+
+	TEST(DefaultIsSupported)
+	{
+		CHECK(kvfs_sha256_supported(kvfs_sha256_impl()));
+	}
+
+	TEST_FIXTURE(SHA256Helper, Scalar)
+	{
+		CHECK(matches_ldns(KVFS_SHA256_SCALAR, sizeof buf));
+	}
+
+	TEST_FIXTURE(SHA256Helper, AVX2)
+	{
+		if (kvfs_sha256_supported(KVFS_SHA256_AVX2)) {
+			CHECK(matches_ldns(KVFS_SHA256_AVX2, sizeof buf));
+		}
+	}
+
+	TEST_FIXTURE(SHA256Helper, SHANI)
+	{
+		if (kvfs_sha256_supported(KVFS_SHA256_SHANI)) {
+			CHECK(matches_ldns(KVFS_SHA256_SHANI, sizeof buf));
+		}
+	}
+
+	TEST_FIXTURE(SHA256Helper, Batch)
+	{
+		for (int impl = 0; impl < KVFS_SHA256_LAST; ++impl) {
+			if (kvfs_sha256_supported((kvfs_sha256_impl_t)impl)) {
+				CHECK(batch_matches((kvfs_sha256_impl_t)impl));
+			}
+		}
+	}
+}